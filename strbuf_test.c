@@ -15,9 +15,17 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <math.h> // INFINITY, NAN
 #include <zlib.h>
+#include <pthread.h>
+#include <unistd.h> // sysconf()
 
 #include "string_buffer.h"
+#include "string_rope.h"
+#include "string_intern.h"
+#include "string_aho.h"
 
 #define MAX(x,y) ((x) >= (y) ? (x) : (y))
 #define MIN(x,y) ((x) <= (y) ? (x) : (y))
@@ -280,10 +288,10 @@ void test_buffered_reading()
   ASSERT(c4 == 'h');
 
   // readline
-  ASSERT(freadline(file1, &(st1->b), &(st1->end), &(st1->size)) > 0);
-  ASSERT(freadline_buf(file2, fbuf, &(st2->b), &(st2->end), &(st2->size)) > 0);
-  ASSERT(gzreadline(gzfile1, &(st3->b), &(st3->end), &(st3->size)) > 0);
-  ASSERT(gzreadline_buf(gzfile2, gzbuf, &(st4->b), &(st4->end), &(st4->size)) > 0);
+  ASSERT(freadline(file1, strbuf_heap_ptr(st1), &(st1->end), &(st1->size)) > 0);
+  ASSERT(freadline_buf(file2, fbuf, strbuf_heap_ptr(st2), &(st2->end), &(st2->size)) > 0);
+  ASSERT(gzreadline(gzfile1, strbuf_heap_ptr(st3), &(st3->end), &(st3->size)) > 0);
+  ASSERT(gzreadline_buf(gzfile2, gzbuf, strbuf_heap_ptr(st4), &(st4->end), &(st4->size)) > 0);
 
   ASSERT(strcmp(st1->b, "i\n") == 0);
   ASSERT(strcmp(st2->b, "i\n") == 0);
@@ -299,10 +307,10 @@ void test_buffered_reading()
   st1->end = st2->end = st3->end = st4->end = 0;
 
   // readline
-  freadline(file1, &st1->b, &st1->end, &st1->size);
-  freadline_buf(file2, fbuf, &st2->b, &st2->end, &st2->size);
-  gzreadline(gzfile1, &st3->b, &st3->end, &st3->size);
-  gzreadline_buf(gzfile2, gzbuf, &st4->b, &st4->end, &st4->size);
+  freadline(file1, strbuf_heap_ptr(st1), &st1->end, &st1->size);
+  freadline_buf(file2, fbuf, strbuf_heap_ptr(st2), &st2->end, &st2->size);
+  gzreadline(gzfile1, strbuf_heap_ptr(st3), &st3->end, &st3->size);
+  gzreadline_buf(gzfile2, gzbuf, strbuf_heap_ptr(st4), &st4->end, &st4->size);
 
   ASSERT(strcmp(st1->b, lines[0]) == 0);
   ASSERT(strcmp(st2->b, lines[0]) == 0);
@@ -314,10 +322,10 @@ void test_buffered_reading()
   ASSERT(st4->end == strlen(lines[0]));
 
   // skipline
-  fskipline(file1);
-  fskipline_buf(file2, fbuf);
-  gzskipline(gzfile1);
-  gzskipline_buf(gzfile2, gzbuf);
+  ASSERT(fskipline(file1) == strlen(lines[1]));
+  ASSERT(fskipline_buf(file2, fbuf) == strlen(lines[1]));
+  ASSERT(gzskipline(gzfile1) == strlen(lines[1]));
+  ASSERT(gzskipline_buf(gzfile2, gzbuf) == strlen(lines[1]));
 
   // gets
   ASSERT(fgets2(file1, st1->b, 10) != NULL);
@@ -337,10 +345,10 @@ void test_buffered_reading()
   st4->end = strlen(st1->b);
 
   // readline
-  freadline(file1, &st1->b, &st1->end, &st1->size);
-  freadline_buf(file2, fbuf, &st2->b, &st2->end, &st2->size);
-  gzreadline(gzfile1, &st3->b, &st3->end, &st3->size);
-  gzreadline_buf(gzfile2, gzbuf, &st4->b, &st4->end, &st4->size);
+  freadline(file1, strbuf_heap_ptr(st1), &st1->end, &st1->size);
+  freadline_buf(file2, fbuf, strbuf_heap_ptr(st2), &st2->end, &st2->size);
+  gzreadline(gzfile1, strbuf_heap_ptr(st3), &st3->end, &st3->size);
+  gzreadline_buf(gzfile2, gzbuf, strbuf_heap_ptr(st4), &st4->end, &st4->size);
 
   for(i = 0; i < 1000; i++)
   {
@@ -392,7 +400,7 @@ void test_buffered_reading()
   fbuf->begin = fbuf->end = gzbuf->begin = gzbuf->end = 0;
 
   // Read lines from file1 and compare to fread results on other files
-  while(freadline(file1, &st1->b, &st1->end, &st1->size) > 0)
+  while(freadline(file1, strbuf_heap_ptr(st1), &st1->end, &st1->size) > 0)
   {
     ASSERT(fread_buf(file2, st2->b, st1->end, fbuf) == st1->end);
     ASSERT(gzread(gzfile1, st3->b, (unsigned int)st1->end) == (int)st1->end);
@@ -408,6 +416,40 @@ void test_buffered_reading()
     st1->end = 0;
   }
 
+  // strbuf_*readline* grow inline buffers without strbuf_heap_ptr()
+  rewind(file1);
+  rewind(file2);
+  gzrewind(gzfile1);
+  gzrewind(gzfile2);
+  fbuf->begin = fbuf->end = gzbuf->begin = gzbuf->end = 0;
+  strbuf_reset(st1);
+  StrBuf *w1 = strbuf_new(10), *w2 = strbuf_new(10);
+  StrBuf *w3 = strbuf_new(10), *w4 = strbuf_new(10);
+  ASSERT(strbuf_is_inline(w1) && strbuf_is_inline(w4));
+
+  while(strbuf_readline(w1, file1) > 0)
+  {
+    ASSERT(strbuf_readline_buf(w2, file2, fbuf) == w1->end);
+    ASSERT(strbuf_gzreadline(w3, gzfile1) == w1->end);
+    ASSERT(strbuf_gzreadline_buf(w4, gzfile2, gzbuf) == w1->end);
+    ASSERT(strcmp(w1->b, w2->b) == 0);
+    ASSERT(strcmp(w1->b, w3->b) == 0);
+    ASSERT(strcmp(w1->b, w4->b) == 0);
+    ASSERT_VALID(w1);
+    ASSERT_VALID(w4);
+    strbuf_append_str(st1, w1->b);
+    strbuf_reset(w1);
+    strbuf_reset(w2);
+    strbuf_reset(w3);
+    strbuf_reset(w4);
+  }
+  ASSERT(st1->end == (size_t)ftell(file1));
+
+  strbuf_free(w1);
+  strbuf_free(w2);
+  strbuf_free(w3);
+  strbuf_free(w4);
+
   // close files
   fclose(file1);
   fclose(file2);
@@ -524,6 +566,1105 @@ void test_resize()
   SUITE_END();
 }
 
+void test_sso()
+{
+  SUITE_START("small string optimisation");
+
+  StrBuf *sbuf = strbuf_new(0);
+  ASSERT(strbuf_is_inline(sbuf));
+  ASSERT(sbuf->size == STRBUF_SSO_SIZE);
+  ASSERT_VALID(sbuf);
+
+  // Fill inline storage then spill over to the heap
+  size_t i;
+  for(i = 0; i+1 < STRBUF_SSO_SIZE; i++) strbuf_append_char(sbuf, 'a'+(i%26));
+  ASSERT(strbuf_is_inline(sbuf));
+  ASSERT_VALID(sbuf);
+  strbuf_append_str(sbuf, "xyz");
+  ASSERT(!strbuf_is_inline(sbuf));
+  ASSERT(sbuf->end == STRBUF_SSO_SIZE+2);
+  ASSERT(strncmp(sbuf->b, "abcdefghij", 10) == 0);
+  ASSERT(strcmp(sbuf->b + sbuf->end - 3, "xyz") == 0);
+  ASSERT_VALID(sbuf);
+
+  // Shrink back inline
+  ASSERT(strbuf_resize(sbuf, 5));
+  ASSERT(strbuf_is_inline(sbuf));
+  ASSERT(strcmp(sbuf->b, "abcde") == 0);
+  ASSERT_VALID(sbuf);
+
+  // Insert from within itself whilst spilling
+  strbuf_set(sbuf, "0123456789");
+  strbuf_insert(sbuf, 5, sbuf->b, 10);
+  strbuf_insert(sbuf, 0, sbuf->b, 20);
+  ASSERT(!strbuf_is_inline(sbuf));
+  ASSERT(strcmp(sbuf->b, "01234012345678956789"
+                         "01234012345678956789") == 0);
+  ASSERT_VALID(sbuf);
+
+  // Clone of a short string stays inline
+  strbuf_set(sbuf, "chr1");
+  StrBuf *cpy = strbuf_clone(sbuf);
+  ASSERT(strbuf_is_inline(cpy));
+  ASSERT(strcmp(cpy->b, "chr1") == 0);
+  ASSERT_VALID(cpy);
+  strbuf_free(cpy);
+
+  // Stack allocated
+  StrBuf buf;
+  ASSERT(strbuf_alloc(&buf, 10) == &buf);
+  ASSERT(strbuf_is_inline(&buf));
+  strbuf_sprintf(&buf, "%s:%i", "chr1", 1000);
+  ASSERT(strcmp(buf.b, "chr1:1000") == 0);
+  ASSERT_VALID(&buf);
+
+  // strbuf_heap_ptr() moves the string to a block that realloc accepts
+  char **ptr = strbuf_heap_ptr(&buf);
+  ASSERT(ptr == &buf.b && !strbuf_is_inline(&buf));
+  ASSERT(strcmp(buf.b, "chr1:1000") == 0);
+  cbuf_append_str(ptr, &buf.end, &buf.size, "-2000", 5);
+  ASSERT(strcmp(buf.b, "chr1:1000-2000") == 0);
+  ASSERT_VALID(&buf);
+  strbuf_dealloc(&buf);
+
+  strbuf_free(sbuf);
+
+  SUITE_END();
+}
+
+// Allocator that counts how many blocks are live
+static void* _count_alloc(void *ctx, size_t size) {
+  (*(long*)ctx)++;
+  return malloc(size);
+}
+static void* _count_resize(void *ctx, void *ptr, size_t old_size, size_t size) {
+  (void)old_size;
+  if(ptr == NULL) (*(long*)ctx)++;
+  return realloc(ptr, size);
+}
+static void _count_dealloc(void *ctx, void *ptr, size_t size) {
+  (void)size;
+  if(ptr != NULL) (*(long*)ctx)--;
+  free(ptr);
+}
+
+void test_allocator()
+{
+  SUITE_START("custom allocator");
+
+  long nblocks = 0;
+  BufAllocator counter = {.alloc = _count_alloc, .resize = _count_resize,
+                          .dealloc = _count_dealloc, .ctx = &nblocks};
+
+  // Struct only, string is inline
+  StrBuf *sbuf = strbuf_new_with(0, &counter);
+  ASSERT(nblocks == 1);
+  strbuf_append_str(sbuf, "chr1");
+  ASSERT(nblocks == 1);
+
+  // Spill onto the heap
+  strbuf_append_charn(sbuf, 'x', 1000);
+  ASSERT(nblocks == 2);
+  ASSERT(sbuf->end == 1004);
+  ASSERT_VALID(sbuf);
+
+  // Clone uses the same allocator
+  StrBuf *cpy = strbuf_clone(sbuf);
+  ASSERT(cpy->alloc == &counter);
+  ASSERT(nblocks == 4);
+  ASSERT(strcmp(cpy->b, sbuf->b) == 0);
+  strbuf_free(cpy);
+  strbuf_free(sbuf);
+  ASSERT(nblocks == 0);
+
+  // StreamBuffer
+  StreamBuffer *strm = strm_buf_new_with(100, &counter);
+  ASSERT(strm != NULL);
+  ASSERT(nblocks == 2);
+  strm_buf_ensure_capacity(strm, 10000);
+  ASSERT(strm->size >= 10001);
+  ASSERT(nblocks == 2);
+  strm_buf_free(strm);
+  ASSERT(nblocks == 0);
+
+  SUITE_END();
+}
+
+void test_arena()
+{
+  SUITE_START("arena allocator");
+
+  BufArena *arena = buf_arena_new(1024);
+  const BufAllocator *a = buf_arena_allocator(arena);
+  StrBuf *bufs[100];
+  size_t i, j, round;
+  char tmp[20];
+
+  for(round = 0; round < 3; round++)
+  {
+    // Mix of inline, small heap and large buffers
+    for(i = 0; i < 100; i++) {
+      bufs[i] = strbuf_new_with(i, a);
+      for(j = 0; j < i*(i%7); j++) strbuf_append_char(bufs[i], 'a'+(j%26));
+      strbuf_sprintf(bufs[i], "#%zu", i);
+    }
+    for(i = 0; i < 100; i++) {
+      ASSERT_VALID(bufs[i]);
+      ASSERT(bufs[i]->alloc == a);
+      ASSERT(bufs[i]->end == i*(i%7) + (size_t)sprintf(tmp, "#%zu", i));
+      ASSERT(strcmp(bufs[i]->b + i*(i%7), tmp) == 0);
+      for(j = 0; j < i*(i%7) && bufs[i]->b[j] == 'a'+(char)(j%26); j++) {}
+      ASSERT(j == i*(i%7));
+    }
+    // Free some explicitly, drop the rest with a reset
+    for(i = 0; i < 100; i += 3) strbuf_free(bufs[i]);
+    buf_arena_reset(arena);
+  }
+
+  // Growing the most recent allocation happens in place
+  StrBuf *sbuf = strbuf_new_with(STRBUF_SSO_SIZE, a);
+  char *ptr = sbuf->b;
+  strbuf_append_charn(sbuf, 'z', STRBUF_SSO_SIZE*2);
+  ASSERT(sbuf->b == ptr);
+  ASSERT_VALID(sbuf);
+
+  // StreamBuffer from an arena
+  StreamBuffer strm;
+  ASSERT(strm_buf_alloc_with(&strm, 64, a) == &strm);
+  strm_buf_ensure_capacity(&strm, 5000);
+  ASSERT(strm.size >= 5001);
+  strm_buf_dealloc(&strm);
+
+  buf_arena_free(arena);
+
+  SUITE_END();
+}
+
+static void* _pool_worker(void *ptr)
+{
+  StrBufPool *pool = (StrBufPool*)ptr;
+  StrBuf *bufs[20];
+  size_t i, j, ok = 1;
+  for(i = 0; i < 1000; i++) {
+    for(j = 0; j < 20; j++) {
+      bufs[j] = strbuf_pool_get(pool, j*10);
+      ok &= (bufs[j]->end == 0 && bufs[j]->size > j*10);
+      strbuf_append_charn(bufs[j], 'a', j*(i%13));
+    }
+    for(j = 0; j < 20; j++) strbuf_pool_put(pool, bufs[j]);
+  }
+  return ok ? ptr : NULL;
+}
+
+void test_pool()
+{
+  SUITE_START("buffer pool");
+
+  StrBufPool *pool = strbuf_pool_new(0);
+  StrBuf *a, *b, *c;
+
+  // Buffers are recycled
+  a = strbuf_pool_get(pool, 1000);
+  ASSERT(a->size > 1000);
+  strbuf_append_str(a, "hello");
+  strbuf_pool_put(pool, a);
+  b = strbuf_pool_get(pool, 500);
+  ASSERT(b == a);
+  ASSERT(b->end == 0 && b->b[0] == '\0');
+  ASSERT_VALID(b);
+
+  // Too small a buffer isn't handed out
+  c = strbuf_pool_get(pool, 5000);
+  ASSERT(c != b);
+  ASSERT(c->size > 5000);
+  strbuf_pool_put(pool, b);
+  strbuf_pool_put(pool, c);
+
+  // Spill past the thread cache into the shared buckets then get them back
+  StrBuf *bufs[40], *prev[40];
+  size_t i;
+  for(i = 0; i < 40; i++) bufs[i] = prev[i] = strbuf_pool_get(pool, 100+i);
+  for(i = 0; i < 40; i++) strbuf_pool_put(pool, bufs[i]);
+  ASSERT(strbuf_pool_bytes(pool) > 0);
+  for(i = 0; i < 40; i++) {
+    StrBuf *sbuf = strbuf_pool_get(pool, 100);
+    size_t j;
+    for(j = 0; j < 40 && prev[j] != sbuf; j++) {}
+    ASSERT(j < 40 || sbuf == a || sbuf == c);
+    ASSERT(sbuf->size > 100);
+    bufs[i] = sbuf;
+  }
+  for(i = 0; i < 40; i++) strbuf_pool_put(pool, bufs[i]);
+
+  // Large buffers go straight to the shared buckets
+  size_t before = strbuf_pool_bytes(pool);
+  a = strbuf_pool_get(pool, 1<<20);
+  strbuf_pool_put(pool, a);
+  ASSERT(strbuf_pool_bytes(pool) > before + (1<<20));
+
+  // Trim
+  strbuf_pool_flush_thread(pool);
+  ASSERT(strbuf_pool_bytes(pool) > 10000);
+  strbuf_pool_trim(pool, 1000);
+  ASSERT(strbuf_pool_bytes(pool) <= 1000);
+
+  // Threads
+  pthread_t threads[4];
+  void *ret;
+  for(i = 0; i < 4; i++) pthread_create(&threads[i], NULL, _pool_worker, pool);
+  for(i = 0; i < 4; i++) {
+    pthread_join(threads[i], &ret);
+    ASSERT(ret == pool);
+  }
+  strbuf_pool_free(pool);
+
+  // High water mark
+  pool = strbuf_pool_new(4096);
+  for(i = 0; i < 40; i++) bufs[i] = strbuf_pool_get(pool, 1000);
+  for(i = 0; i < 40; i++) strbuf_pool_put(pool, bufs[i]);
+  ASSERT(strbuf_pool_bytes(pool) <= 4096);
+  a = strbuf_pool_get(pool, 1<<20);
+  strbuf_pool_put(pool, a);
+  ASSERT(strbuf_pool_bytes(pool) <= 4096);
+  strbuf_pool_free(pool);
+
+  SUITE_END();
+}
+
+void test_mmap_growth()
+{
+  SUITE_START("mmap growth for large buffers");
+
+  size_t i, step = 1<<16;
+  strbuf_set_mmap_threshold(1<<20, step);
+
+  StrBuf *sbuf = strbuf_new(100);
+  for(i = 0; sbuf->end < (3<<20); i++) {
+    strbuf_append_charn(sbuf, 'a'+(i%26), 1000);
+    ASSERT(sbuf->size > sbuf->end);
+  }
+
+#if defined(__linux__)
+  ASSERT(strbuf_is_mmap(sbuf));
+  ASSERT(sbuf->size % step == 0);
+  ASSERT(sbuf->size - sbuf->end <= step);
+#endif
+  ASSERT_VALID(sbuf);
+  for(i = 0; i < sbuf->end && sbuf->b[i] == (char)('a'+(i/1000)%26); i++) {}
+  ASSERT(i == sbuf->end);
+
+  // Clone is also large
+  StrBuf *cpy = strbuf_clone(sbuf);
+  ASSERT(cpy->end == sbuf->end);
+  ASSERT(memcmp(cpy->b, sbuf->b, sbuf->end) == 0);
+  strbuf_free(cpy);
+
+  // Shrink back onto the heap then inline
+  ASSERT(strbuf_resize(sbuf, 5000));
+  ASSERT(!strbuf_is_mmap(sbuf));
+  ASSERT(sbuf->end == 5000);
+  for(i = 0; i < sbuf->end && sbuf->b[i] == (char)('a'+(i/1000)%26); i++) {}
+  ASSERT(i == sbuf->end);
+  ASSERT_VALID(sbuf);
+  ASSERT(strbuf_resize(sbuf, 3));
+  ASSERT(strbuf_is_inline(sbuf));
+  ASSERT(strcmp(sbuf->b, "aaa") == 0);
+
+  // Straight to a mapping
+  strbuf_reset(sbuf);
+  strbuf_ensure_capacity(sbuf, 2<<20);
+#if defined(__linux__)
+  ASSERT(strbuf_is_mmap(sbuf));
+#endif
+  ASSERT(sbuf->size > (2<<20));
+  strbuf_free(sbuf);
+
+  StrBuf buf;
+  strbuf_alloc(&buf, 4<<20);
+  strbuf_append_str(&buf, "hi");
+  ASSERT_VALID(&buf);
+  strbuf_dealloc(&buf);
+
+  // Disable
+  strbuf_set_mmap_threshold(0, 0);
+  sbuf = strbuf_new(4<<20);
+  ASSERT(!strbuf_is_mmap(sbuf));
+  ASSERT(sbuf->size == ROUNDUP2POW((4<<20)+1));
+  strbuf_free(sbuf);
+
+  strbuf_set_mmap_threshold(1UL<<26, 1UL<<24);
+
+  SUITE_END();
+}
+
+void test_growth_policy()
+{
+  SUITE_START("growth policy / shrink on reset");
+
+  size_t i, prev;
+  StrBuf *sbuf = strbuf_new(100);
+  ASSERT(sbuf->size == 128);
+
+  // Exact
+  strbuf_set_growth(sbuf, STRBUF_GROW_EXACT);
+  strbuf_append_charn(sbuf, 'x', 200);
+  ASSERT(sbuf->size == 201);
+  ASSERT(strbuf_resize(sbuf, 150));
+  ASSERT(sbuf->size == 151);
+  ASSERT_VALID(sbuf);
+
+  // 1.5x
+  strbuf_set_growth(sbuf, STRBUF_GROW_1_5X);
+  prev = sbuf->size;
+  strbuf_append_char(sbuf, 'y');
+  ASSERT(sbuf->size >= prev + prev/2);
+  ASSERT(sbuf->size < 2*prev);
+  for(i = 0; i < 10000; i++) strbuf_append_char(sbuf, 'z');
+  ASSERT(sbuf->end == 10151);
+  ASSERT_VALID(sbuf);
+
+  // Page
+  strbuf_set_growth(sbuf, STRBUF_GROW_PAGE);
+  strbuf_append_charn(sbuf, 'w', 10000);
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  ASSERT(sbuf->size % page == 0);
+  ASSERT(sbuf->size > sbuf->end);
+  ASSERT(sbuf->size - sbuf->end <= page);
+  ASSERT_VALID(sbuf);
+  strbuf_free(sbuf);
+
+  // Process default
+  strbuf_set_default_growth(STRBUF_GROW_EXACT);
+  sbuf = strbuf_new(100);
+  ASSERT(sbuf->size == 101);
+  strbuf_append_charn(sbuf, 'a', 300);
+  ASSERT(sbuf->size == 301);
+  strbuf_set_growth(sbuf, STRBUF_GROW_POW2);
+  strbuf_append_char(sbuf, 'b');
+  ASSERT(sbuf->size == 512);
+  strbuf_free(sbuf);
+  strbuf_set_default_growth(STRBUF_GROW_POW2);
+
+  // Shrink on reset: one giant line then many short ones
+  sbuf = strbuf_new(100);
+  strbuf_set_shrink_on_reset(sbuf, 1);
+  strbuf_append_charn(sbuf, 'a', 1<<22);
+  prev = sbuf->size;
+  strbuf_reset(sbuf);
+  ASSERT(sbuf->size == prev);
+  for(i = 0; i < 1000; i++) {
+    strbuf_append_str(sbuf, "short line\n");
+    ASSERT_VALID(sbuf);
+    strbuf_reset(sbuf);
+  }
+  ASSERT(sbuf->size < prev);
+  ASSERT(sbuf->size <= (1<<16));
+  ASSERT(sbuf->end == 0 && sbuf->b[0] == '\0');
+
+  // A buffer that is regularly filled isn't shrunk
+  strbuf_append_charn(sbuf, 'a', 1<<20);
+  strbuf_reset(sbuf);
+  prev = sbuf->size;
+  for(i = 0; i < 1000; i++) {
+    if(i % 4 == 0) strbuf_append_charn(sbuf, 'a', 1<<20);
+    strbuf_reset(sbuf);
+  }
+  ASSERT(sbuf->size == prev);
+  strbuf_free(sbuf);
+
+  // Process default
+  strbuf_set_default_shrink_on_reset(1);
+  sbuf = strbuf_new(10);
+  ASSERT(sbuf->flags & STRBUF_SHRINK);
+  strbuf_free(sbuf);
+  strbuf_set_default_shrink_on_reset(0);
+  sbuf = strbuf_new(10);
+  ASSERT(!(sbuf->flags & STRBUF_SHRINK));
+  strbuf_free(sbuf);
+
+  SUITE_END();
+}
+
+void test_stats()
+{
+  SUITE_START("statistics");
+
+  StrBufStats st;
+  strbuf_stats_reset();
+
+  StrBuf *sbuf = strbuf_new(0);
+  strbuf_append_charn(sbuf, 'a', 100);
+  strbuf_insert(sbuf, 10, "xyz", 3);
+  strbuf_delete(sbuf, 0, 3);
+  strbuf_overwrite(sbuf, 0, 2, "-", 1);
+  strbuf_sprintf(sbuf, "%0200i", 5);
+  strbuf_stats_get(&st);
+
+#if defined(STRBUF_STATS) && STRBUF_STATS
+  ASSERT(st.allocs == 2); // struct + spill to heap
+  ASSERT(st.grows == 2); // spill + sprintf
+  ASSERT(st.memmove_bytes == 90 + 100 + 98);
+  ASSERT(st.sprintf_retries == 1);
+  ASSERT(st.refills == 0);
+
+  // Allocating a char array is not a grow, enlarging it is
+  char *cb = NULL;
+  size_t cbsize = 0;
+  strbuf_stats_reset();
+  cbuf_capacity(&cb, &cbsize, 10);
+  cbuf_capacity(&cb, &cbsize, 12);
+  strbuf_stats_get(&st);
+  ASSERT(st.allocs == 1 && st.grows == 0);
+  cbuf_capacity(&cb, &cbsize, 100);
+  strbuf_stats_get(&st);
+  ASSERT(st.allocs == 1 && st.grows == 1);
+  free(cb);
+
+  strbuf_stats_reset();
+  strbuf_stats_get(&st);
+#endif
+
+  ASSERT(st.allocs == 0);
+  ASSERT(st.grows == 0);
+  ASSERT(st.memmove_bytes == 0);
+  ASSERT(st.sprintf_retries == 0);
+  ASSERT(st.refills == 0);
+
+  strbuf_free(sbuf);
+
+  SUITE_END();
+}
+
+void test_rope()
+{
+  SUITE_START("rope");
+
+  size_t i, pos, len, dlen;
+  char str[2000], out[2000];
+  StrBuf *sbuf = strbuf_new(100), *flat = strbuf_new(100);
+  StrRope *rope = strrope_create("hello world", 11);
+
+  ASSERT(strrope_len(rope) == 11);
+  ASSERT(strrope_char(rope, 4) == 'o');
+  strrope_insert(rope, 5, ",", 1);
+  strrope_overwrite(rope, 7, 5, "rope", 4);
+  strrope_append(rope, "!", 1);
+  strrope_to_strbuf(rope, flat);
+  ASSERT(strcmp(flat->b, "hello, rope!") == 0);
+  ASSERT_VALID(flat);
+  strrope_reset(rope);
+  ASSERT(strrope_len(rope) == 0);
+  strrope_to_strbuf(rope, flat);
+  ASSERT(flat->end == 0);
+
+  // Random edits checked against a StrBuf doing the same thing
+  strbuf_reset(sbuf);
+  for(i = 0; i < 5000; i++)
+  {
+    len = rand() % (i % 100 == 0 ? 1500 : 20);
+    random_str(str, len);
+    pos = sbuf->end ? (size_t)rand() % (sbuf->end+1) : 0;
+    dlen = (size_t)rand() % 1000;
+    dlen = MIN(dlen, sbuf->end - pos);
+
+    switch(rand() % 5) {
+      case 0: strrope_insert(rope, pos, str, len);
+              strbuf_insert(sbuf, pos, str, len); break;
+      case 1: strrope_delete(rope, pos, dlen);
+              strbuf_delete(sbuf, pos, dlen); break;
+      case 2: strrope_overwrite(rope, pos, dlen, str, len);
+              strbuf_overwrite(sbuf, pos, dlen, str, len); break;
+      case 3: strrope_copy(rope, pos, str, len);
+              strbuf_copy(sbuf, pos, str, len); break;
+      case 4: strrope_append(rope, str, len);
+              strbuf_append_strn(sbuf, str, len); break;
+    }
+    ASSERT(strrope_len(rope) == sbuf->end);
+
+    if(sbuf->end) {
+      pos = (size_t)rand() % sbuf->end;
+      ASSERT(strrope_char(rope, pos) == sbuf->b[pos]);
+      len = MIN(sizeof(out), sbuf->end - pos);
+      strrope_read(rope, pos, len, out);
+      ASSERT(memcmp(out, sbuf->b + pos, len) == 0);
+    }
+  }
+
+  strrope_to_strbuf(rope, flat);
+  ASSERT(flat->end == sbuf->end && strcmp(flat->b, sbuf->b) == 0);
+  ASSERT_VALID(flat);
+
+  strrope_free(rope);
+  strbuf_free(sbuf);
+  strbuf_free(flat);
+
+  SUITE_END();
+}
+
+void test_gap_buffer()
+{
+  SUITE_START("gap buffer");
+
+  size_t i, pos = 0, len, dlen;
+  char str[200];
+  StrBuf *sbuf = strbuf_new(100), *flat;
+  StrGapBuf gb;
+  ASSERT(strgap_alloc(&gb, 10) == &gb);
+
+  strbuf_set(strgap_strbuf(&gb), "aaaccc");
+  strgap_insert(&gb, 3, "bb", 2);
+  strgap_delete(&gb, 0, 1);
+  ASSERT(strgap_len(&gb) == 7);
+  ASSERT(strgap_get_char(&gb, 2) == 'b');
+  ASSERT(strgap_get_char(&gb, 4) == 'c');
+  strgap_overwrite(&gb, 4, 3, "dd", 2);
+  flat = strgap_strbuf(&gb);
+  ASSERT(strcmp(flat->b, "aabbdd") == 0);
+  ASSERT_VALID(flat);
+
+  // Edit the closed buffer directly, then keep going with gap edits
+  strbuf_append_str(flat, "eeee");
+  strgap_insert(&gb, 10, "f", 1);
+  strgap_insert(&gb, 0, "_", 1);
+  ASSERT(strcmp(strgap_strbuf(&gb)->b, "_aabbddeeeef") == 0);
+
+  // Random edits around a wandering cursor, checked against a StrBuf
+  strbuf_set(sbuf, strgap_strbuf(&gb)->b);
+  for(i = 0; i < 20000; i++)
+  {
+    len = rand() % 50;
+    random_str(str, len);
+    pos = pos + (size_t)(rand() % 21);
+    pos = pos < 10 ? 0 : pos - 10;
+    pos = MIN(pos, sbuf->end);
+    dlen = (size_t)rand() % 40;
+    dlen = MIN(dlen, sbuf->end - pos);
+
+    switch(rand() % 3) {
+      case 0: strgap_insert(&gb, pos, str, len);
+              strbuf_insert(sbuf, pos, str, len); break;
+      case 1: strgap_delete(&gb, pos, dlen);
+              strbuf_delete(sbuf, pos, dlen); break;
+      case 2: strgap_overwrite(&gb, pos, dlen, str, len);
+              strbuf_overwrite(sbuf, pos, dlen, str, len); break;
+    }
+    ASSERT(strgap_len(&gb) == sbuf->end);
+    if(sbuf->end) {
+      size_t j = (size_t)rand() % sbuf->end;
+      ASSERT(strgap_get_char(&gb, j) == sbuf->b[j]);
+    }
+    if(i % 1000 == 0) {
+      flat = strgap_strbuf(&gb);
+      ASSERT(strcmp(flat->b, sbuf->b) == 0);
+      ASSERT_VALID(flat);
+    }
+  }
+
+  flat = strgap_strbuf(&gb);
+  ASSERT(flat->end == sbuf->end && strcmp(flat->b, sbuf->b) == 0);
+  ASSERT_VALID(flat);
+
+  // Copy text from within the buffer, with the gap open at a random position.
+  // Start with no spare capacity so that the gap is widened often.
+  size_t k, phys;
+  strgap_dealloc(&gb);
+  strgap_alloc(&gb, 0);
+  strbuf_set(strgap_strbuf(&gb), sbuf->b);
+  for(i = 0; i < 2000; i++)
+  {
+    pos = (size_t)rand() % (sbuf->end+1);
+    strgap_insert(&gb, pos, "x", 1);
+    strbuf_insert(sbuf, pos, "x", 1);
+    k = (size_t)rand() % sbuf->end;
+    // src must not span the gap
+    phys = k < gb.gap ? k : k + gb.gap_len;
+    len = (size_t)rand() % ((k < gb.gap ? gb.gap : sbuf->end) - k + 1);
+    len = MIN(len, sizeof(str));
+    memcpy(str, sbuf->b + k, len);
+    pos = (size_t)rand() % (sbuf->end+1);
+    dlen = (size_t)rand() % 20;
+    dlen = MIN(dlen, sbuf->end - pos);
+    if(rand() & 1) {
+      strgap_insert(&gb, pos, gb.buf.b + phys, len);
+      strbuf_insert(sbuf, pos, str, len);
+    } else {
+      strgap_overwrite(&gb, pos, dlen, gb.buf.b + phys, len);
+      strbuf_overwrite(sbuf, pos, dlen, str, len);
+    }
+    if(sbuf->end > 2000) {
+      strbuf_shrink(sbuf, 100);
+      strgap_delete(&gb, 100, strgap_len(&gb) - 100);
+    }
+    ASSERT(strgap_len(&gb) == sbuf->end);
+    if(i % 100 == 0) {
+      flat = strgap_strbuf(&gb);
+      ASSERT(strcmp(flat->b, sbuf->b) == 0);
+      ASSERT_VALID(flat);
+    }
+  }
+
+  flat = strgap_strbuf(&gb);
+  ASSERT(strcmp(flat->b, sbuf->b) == 0);
+
+  strgap_dealloc(&gb);
+  strbuf_free(sbuf);
+
+  SUITE_END();
+}
+
+// Each thread edits and frees its own clone
+static void* _cow_worker(void *ptr)
+{
+  StrBuf *sbuf = ptr;
+  strbuf_to_uppercase(sbuf);
+  strbuf_append_str(sbuf, "!");
+  long ok = strstr(sbuf->b, "HELLO") != NULL && sbuf->b[sbuf->end-1] == '!';
+  strbuf_free(sbuf);
+  return (void*)ok;
+}
+
+void test_copy_on_write()
+{
+  SUITE_START("copy-on-write clones");
+
+  size_t i;
+  char orig[101];
+  memset(orig, 'a', 100);
+  orig[100] = '\0';
+
+  StrBuf *sbuf = strbuf_create(orig);
+  StrBuf *a = strbuf_clone(sbuf), *b = strbuf_clone(sbuf);
+  ASSERT(a->b == sbuf->b && b->b == sbuf->b);
+  ASSERT(strbuf_is_shared(sbuf) && strbuf_is_shared(a) && strbuf_is_shared(b));
+  ASSERT(*sbuf->refs == 3);
+
+  // First write copies
+  strbuf_append_char(a, 'x');
+  ASSERT(a->b != sbuf->b);
+  ASSERT(!strbuf_is_shared(a));
+  ASSERT(a->end == 101 && a->b[100] == 'x');
+  ASSERT(strcmp(sbuf->b, orig) == 0 && strcmp(b->b, orig) == 0);
+  ASSERT(*sbuf->refs == 2);
+  ASSERT_VALID(a);
+
+  // Trims and replaces that change nothing don't copy
+  strbuf_trim(b);
+  strbuf_ltrim(b, "xy");
+  strbuf_rtrim(b, "xy");
+  StrCharSet xy;
+  strcharset_init(&xy, "xy");
+  strbuf_trim_set(b, &xy);
+  ASSERT(strbuf_replace_char(b, 'x', 'y') == 0);
+  ASSERT(strbuf_replace_set(b, &xy, 'z') == 0);
+  ASSERT(b->b == sbuf->b && strbuf_is_shared(b) && *sbuf->refs == 2);
+  // ...but do when they do
+  StrBuf *d = strbuf_clone(b);
+  strbuf_rtrim(d, "a");
+  ASSERT(d->b != sbuf->b && d->end == 0);
+  ASSERT(strcmp(sbuf->b, orig) == 0);
+  strbuf_free(d);
+  d = strbuf_clone(b);
+  ASSERT(strbuf_replace_char(d, 'a', 'b') == 100);
+  ASSERT(d->b != sbuf->b && strcmp(sbuf->b, orig) == 0);
+  strbuf_free(d);
+  ASSERT(*sbuf->refs == 2);
+
+  // Last holder writes in place
+  strbuf_free(sbuf);
+  ASSERT(*b->refs == 1);
+  char *ptr = b->b;
+  strbuf_unshare(b);
+  strbuf_char(b, 0) = 'b';
+  ASSERT(b->b == ptr && !strbuf_is_shared(b));
+  ASSERT(b->b[0] == 'b' && strcmp(b->b+1, orig+1) == 0);
+
+  // Reset detaches without copying
+  StrBuf *c = strbuf_clone(b);
+  strbuf_reset(c);
+  ASSERT(c->end == 0 && !strbuf_is_shared(c));
+  ASSERT(b->b[0] == 'b' && b->end == 100);
+  strbuf_append_str(c, "cc");
+  ASSERT(strcmp(c->b, "cc") == 0);
+  strbuf_free(c);
+  strbuf_free(a);
+
+  // Every mutating function leaves the other clones alone
+  strbuf_set(b, "  Hello World\r\n");
+  strbuf_append_charn(b, '.', 50);
+  strbuf_append_str(b, "\n");
+  StrBuf *copy = strbuf_create(b->b);
+  for(i = 0; i < 15; i++)
+  {
+    c = strbuf_clone(b);
+    ASSERT(c->b == b->b);
+    switch(i) {
+      case 0: strbuf_chomp(c); break;
+      case 1: strbuf_reverse(c); break;
+      case 2: strbuf_to_uppercase(c); break;
+      case 3: strbuf_delete(c, 0, 2); break;
+      case 4: strbuf_trim(c); break;
+      case 5: strbuf_ltrim(c, " "); break;
+      case 6: strbuf_rtrim(c, "\n."); break;
+      case 7: strbuf_insert(c, 3, "x", 1); break;
+      case 8: strbuf_copy(c, 0, c->b+5, 3); break;
+      case 9: strbuf_overwrite(c, 2, 5, "y", 1); break;
+      case 10: strbuf_sprintf_at(c, 0, "%i", 42); break;
+      case 11: strbuf_shrink(c, 5); break;
+      case 12: strbuf_append_int(c, 7); break;
+      case 13: ASSERT(strbuf_resize(c, 10)); break;
+      case 14: strbuf_set(c, "set"); break;
+    }
+    ASSERT(!strbuf_is_shared(c) && c->b != b->b);
+    ASSERT(strcmp(b->b, copy->b) == 0 && b->end == copy->end);
+    ASSERT_VALID(c);
+    strbuf_free(c);
+  }
+  ASSERT(!strbuf_is_shared(b) || *b->refs == 1);
+
+  // Clones edited and freed on other threads
+  pthread_t threads[4];
+  void *ret;
+  for(i = 0; i < 4; i++)
+    pthread_create(&threads[i], NULL, _cow_worker, strbuf_clone(b));
+  for(i = 0; i < 4; i++) {
+    pthread_join(threads[i], &ret);
+    ASSERT(ret == (void*)1);
+  }
+  ASSERT(strcmp(b->b, copy->b) == 0);
+
+  strbuf_free(b);
+  strbuf_free(copy);
+
+  SUITE_END();
+}
+
+void test_strview()
+{
+  SUITE_START("string views");
+
+  StrBuf *sbuf = strbuf_create("  chr1\t1000\t\tA,C,G  \r\n");
+  StrView v = strview_buf(sbuf), field, rest;
+  ASSERT(v.p == sbuf->b && v.len == sbuf->end);
+
+  // chomp / trim
+  ASSERT(strview_chomp(v).len == sbuf->end - 2);
+  field = strview_trim(v);
+  ASSERT(field.p == sbuf->b + 2);
+  ASSERT(strview_eq(field, strview_str("chr1\t1000\t\tA,C,G")));
+  ASSERT(strview_trim(strview_str(" \t\n")).len == 0);
+
+  // substr
+  field = strview_substr(v, 2, 4);
+  ASSERT(field.p == sbuf->b + 2 && field.len == 4);
+  ASSERT(strview_eq(field, strview_str("chr1")));
+  ASSERT(strview_substr(v, v.len, 0).len == 0);
+
+  // find
+  ASSERT(strview_find_char(v, '\t') == 6);
+  ASSERT(strview_find_char(v, 'x') == STRVIEW_NPOS);
+  ASSERT(strview_find(v, strview_str("1000")) == 7);
+  ASSERT(strview_find(v, strview_str("A,C,G  \r\n")) == 13);
+  ASSERT(strview_find(v, strview_str("A,C,G  \r\n!")) == STRVIEW_NPOS);
+  ASSERT(strview_find(v, strview_str("chr2")) == STRVIEW_NPOS);
+  ASSERT(strview_find(v, strview_str("")) == 0);
+  ASSERT(strview_find(strview_str("aaab"), strview_str("aab")) == 1);
+
+  // split
+  const char *expect[] = {"chr1", "1000", "", "A,C,G"};
+  size_t n = 0;
+  rest = strview_trim(v);
+  while(strview_split_next(&rest, '\t', &field)) {
+    ASSERT(n < 4 && strview_eq(field, strview_str(expect[n])));
+    ASSERT(field.p >= sbuf->b && field.p + field.len <= sbuf->b + sbuf->end);
+    n++;
+  }
+  ASSERT(n == 4);
+  ASSERT(!strview_split_next(&rest, '\t', &field));
+
+  rest = strview_str("");
+  ASSERT(strview_split_next(&rest, ',', &field) && field.len == 0);
+  ASSERT(!strview_split_next(&rest, ',', &field));
+  rest = strview_str("a,");
+  ASSERT(strview_split_next(&rest, ',', &field) && strview_eq(field, strview_str("a")));
+  ASSERT(strview_split_next(&rest, ',', &field) && field.len == 0);
+  ASSERT(!strview_split_next(&rest, ',', &field));
+
+  // compare
+  ASSERT(strview_cmp(strview_str("abc"), strview_str("abd")) < 0);
+  ASSERT(strview_cmp(strview_str("abc"), strview_str("ab")) > 0);
+  ASSERT(strview_cmp(strview_str("ab"), strview_str("abc")) < 0);
+  ASSERT(strview_cmp(strview_str(""), strview_str("")) == 0);
+  ASSERT(strview_eq(strview_strn("chr1x", 4), strview_str("chr1")));
+
+  // To and from StrBuf
+  StrBuf *out = strbuf_new(10);
+  strbuf_set_view(out, strview_str("hello"));
+  strbuf_append_view(out, strview_substr(strview_buf(sbuf), 2, 4));
+  ASSERT(strcmp(out->b, "hellochr1") == 0);
+  ASSERT_VALID(out);
+  strbuf_set_view(out, strview_substr(strview_buf(out), 5, 3));
+  ASSERT(strcmp(out->b, "chr") == 0);
+  ASSERT_VALID(out);
+  strbuf_set_view(sbuf, strview_trim(strview_buf(sbuf)));
+  ASSERT(strcmp(sbuf->b, "chr1\t1000\t\tA,C,G") == 0);
+  ASSERT_VALID(sbuf);
+
+  strbuf_free(out);
+  strbuf_free(sbuf);
+
+  SUITE_END();
+}
+
+// All matches by brute force, in order of end then longest first
+static size_t _aho_naive(const char **pats, size_t npats,
+                         const char *str, size_t len,
+                         StrAhoMatch *hits, size_t max)
+{
+  size_t end, k, n = 0, plen, best;
+  char *used = calloc(npats, 1);
+  for(end = 1; end <= len; end++) {
+    // repeatedly take the longest unused pattern ending here
+    memset(used, 0, npats);
+    while(1) {
+      best = npats;
+      for(k = 0; k < npats; k++) {
+        plen = strlen(pats[k]);
+        if(!used[k] && plen && plen <= end && memcmp(str+end-plen, pats[k], plen) == 0 &&
+           (best == npats || plen > strlen(pats[best]))) best = k;
+      }
+      if(best == npats) break;
+      used[best] = 1;
+      if(n < max) {
+        hits[n].id = best;
+        hits[n].offset = end - strlen(pats[best]);
+      }
+      n++;
+    }
+  }
+  free(used);
+  return n;
+}
+
+static int _aho_same(const StrAhoMatch *a, const StrAhoMatch *b, size_t n,
+                     const char **pats)
+{
+  size_t i;
+  for(i = 0; i < n; i++) {
+    if(a[i].offset != b[i].offset) return 0;
+    // duplicate patterns may be reported in either order
+    if(a[i].id != b[i].id && strcmp(pats[a[i].id], pats[b[i].id]) != 0) return 0;
+  }
+  return 1;
+}
+
+void test_aho()
+{
+  SUITE_START("Aho-Corasick multi-pattern search");
+
+  const char *pats0[] = {"he", "she", "his", "hers", ""};
+  StrAhoMatch hits[2000], exp[2000];
+  size_t n;
+
+  StrAho *ac = straho_new();
+  ASSERT(ac != NULL);
+  for(n = 0; n < 5; n++) ASSERT(straho_add_str(ac, pats0[n]) == n);
+  straho_compile(ac, 0);
+  ASSERT(straho_num_patterns(ac) == 5);
+  ASSERT(straho_pattern_len(ac, 3) == 4);
+
+  n = straho_search(ac, "ushers", 6, hits, 10);
+  ASSERT(n == 3);
+  ASSERT(hits[0].id == 1 && hits[0].offset == 1); // she
+  ASSERT(hits[1].id == 0 && hits[1].offset == 2); // he
+  ASSERT(hits[2].id == 3 && hits[2].offset == 2); // hers
+  ASSERT(straho_search(ac, "ushers", 6, hits, 1) == 3);
+  ASSERT(straho_search(ac, "", 0, hits, 10) == 0);
+  ASSERT(straho_search(ac, "xyz", 3, NULL, 0) == 0);
+
+  // Feeding in pieces gives the same matches
+  StrAhoState st;
+  straho_state_init(&st);
+  ASSERT(straho_feed(ac, &st, "ush", 3, hits, 10) == 0);
+  n = straho_feed(ac, &st, "ers", 3, hits, 10);
+  ASSERT(n == 3 && hits[0].id == 1 && hits[0].offset == 1);
+  ASSERT(hits[1].id == 0 && hits[2].id == 3 && hits[2].offset == 2);
+  straho_free(ac);
+
+  // Random patterns and text over a small alphabet, with and without the
+  // prefilter, against brute force
+  const char *pats[40];
+  char patbuf[40][8], text[600];
+  size_t i, j, k, npats, len, m;
+  int flags;
+
+  for(i = 0; i < 60; i++)
+  {
+    npats = 1 + rand() % 40;
+    for(j = 0; j < npats; j++) {
+      m = 1 + rand() % 6;
+      for(k = 0; k < m; k++) patbuf[j][k] = "abcx\xfe"[rand() % (i % 2 ? 5 : 3)];
+      patbuf[j][m] = '\0';
+      pats[j] = patbuf[j];
+    }
+    len = rand() % sizeof(text);
+    for(k = 0; k < len; k++) text[k] = "abcdx\xfe"[rand() % 6];
+
+    for(flags = 0; flags <= STRAHO_PREFILTER; flags++) {
+      ac = straho_new();
+      for(j = 0; j < npats; j++) straho_add_str(ac, pats[j]);
+      straho_compile(ac, flags);
+
+      m = _aho_naive(pats, npats, text, len, exp, 2000);
+      n = straho_search(ac, text, len, hits, 2000);
+      ASSERT(n == m);
+      ASSERT(_aho_same(hits, exp, MIN(n, 2000), pats));
+
+      // Random split points
+      straho_state_init(&st);
+      for(n = k = 0; k < len; k += j) {
+        j = 1 + rand() % 50;
+        j = MIN(len - k, j);
+        n += straho_feed(ac, &st, text + k, j, n < 2000 ? hits + n : NULL,
+                         n < 2000 ? 2000 - n : 0);
+      }
+      ASSERT(n == m && st.offset == len);
+      ASSERT(_aho_same(hits, exp, MIN(n, 2000), pats));
+      straho_free(ac);
+    }
+  }
+
+  // Stream through a small StreamBuffer so matches span refills
+  FILE *fh = fopen(tmp_file1, "w");
+  if(fh == NULL) die("Cannot write tmp output file: %s", tmp_file1);
+  fwrite(text, 1, len, fh);
+  fclose(fh);
+
+  ac = straho_new();
+  for(j = 0; j < npats; j++) straho_add_str(ac, pats[j]);
+  straho_compile(ac, STRAHO_PREFILTER);
+  m = _aho_naive(pats, npats, text, len, exp, 2000);
+
+  fh = fopen(tmp_file1, "r");
+  if(fh == NULL) die("Cannot read tmp output file: %s", tmp_file1);
+  StreamBuffer *strm = strm_buf_new(7);
+  straho_state_init(&st);
+  n = straho_fscan_buf(ac, &st, fh, strm, hits, 2000);
+  ASSERT(n == m && st.offset == len);
+  ASSERT(_aho_same(hits, exp, MIN(n, 2000), pats));
+  fclose(fh);
+  strm_buf_free(strm);
+  straho_free(ac);
+
+  SUITE_END();
+}
+
+void test_intern()
+{
+  SUITE_START("string interning");
+
+  StrIntern *tbl = strintern_new(0);
+  ASSERT(tbl != NULL);
+  ASSERT(strintern_size(tbl) == 0);
+  ASSERT(strintern_find(tbl, "chr1", 4) == STRINTERN_NONE);
+
+  StrBuf *sbuf = strbuf_create("chr1");
+  const char *a = strintern_buf(tbl, sbuf);
+  const char *b = strintern_str(tbl, "chr1");
+  const char *c = strintern_view(tbl, strview_str("chr2"));
+  ASSERT(a == b && a != c && a != sbuf->b);
+  ASSERT(strcmp(a, "chr1") == 0 && strcmp(c, "chr2") == 0);
+  ASSERT(strintern_size(tbl) == 2);
+  ASSERT(strintern_id(tbl, "chr1", 4) == 0);
+  ASSERT(strintern_find(tbl, "chr2", 4) == 1);
+  ASSERT(strintern_len(tbl, 1) == 4);
+
+  // Empty strings and embedded nulls
+  size_t e = strintern_id(tbl, "", 0);
+  ASSERT(strintern_id(tbl, NULL, 0) == e);
+  ASSERT(strintern_len(tbl, e) == 0 && strintern_get(tbl, e)[0] == '\0');
+  size_t z = strintern_id(tbl, "a\0b", 3);
+  ASSERT(z != strintern_id(tbl, "a", 1));
+  ASSERT(strintern_id(tbl, "a\0b", 3) == z && strintern_len(tbl, z) == 3);
+
+  // Many duplicates across table growth: IDs and pointers are stable
+  size_t i, n = strintern_size(tbl);
+  const char *ptrs[5000];
+  for(i = 0; i < 5000; i++) {
+    strbuf_reset(sbuf);
+    strbuf_sprintf(sbuf, "sample_%zu", i);
+    ptrs[i] = strintern_buf(tbl, sbuf);
+    ASSERT(strintern_id(tbl, sbuf->b, sbuf->end) == n + i);
+  }
+  ASSERT(strintern_size(tbl) == n + 5000);
+  for(i = 0; i < 5000; i++) {
+    strbuf_reset(sbuf);
+    strbuf_sprintf(sbuf, "sample_%zu", i);
+    ASSERT(strintern_buf(tbl, sbuf) == ptrs[i]);
+    ASSERT(strintern_get(tbl, n + i) == ptrs[i]);
+  }
+  ASSERT(strintern_size(tbl) == n + 5000);
+  ASSERT(strintern_str(tbl, "chr1") == a);
+
+  // Hash
+  ASSERT(strintern_hash("abc", 3) == strintern_hash("abcd", 3));
+  ASSERT(strintern_hash("abc", 3) != strintern_hash("abd", 3));
+  ASSERT(strintern_hash("12345678abc", 11) != strintern_hash("12345678abd", 11));
+
+  strbuf_free(sbuf);
+  strintern_free(tbl);
+
+  SUITE_END();
+}
+
+void test_append_segs()
+{
+  SUITE_START("gather append");
+
+  StrBuf *sbuf = strbuf_new(10), *name = strbuf_create("sample1");
+  strbuf_append_all(sbuf, strbuf_seg_str("chr1"), strbuf_seg_char('\t'),
+                    strbuf_seg_long(-1234), strbuf_seg_char('\t'),
+                    strbuf_seg_ulong(0), strbuf_seg_char('\t'),
+                    strbuf_seg_buf(name), strbuf_seg_view(strview_str(" x")),
+                    strbuf_seg_strn("abc", 2), strbuf_seg_long(LONG_MAX),
+                    strbuf_seg_long(LONG_MIN), strbuf_seg_ulong(ULONG_MAX));
+  char expect[200];
+  sprintf(expect, "chr1\t-1234\t0\tsample1 xab%ld%ld%lu",
+          LONG_MAX, LONG_MIN, ULONG_MAX);
+  ASSERT(strcmp(sbuf->b, expect) == 0);
+  ASSERT_VALID(sbuf);
+
+  // Only one resize
+  strbuf_set(sbuf, "x");
+  strbuf_resize(sbuf, 1);
+  StrBufSeg segs[100];
+  size_t i;
+  for(i = 0; i < 100; i++) segs[i] = strbuf_seg_long((long)i);
+  char *prev = sbuf->b;
+  size_t prev_size = sbuf->size;
+  strbuf_append_segs(sbuf, segs, 100);
+  ASSERT(sbuf->b != prev || sbuf->size != prev_size);
+  ASSERT(sbuf->end == 1 + 10 + 90*2);
+  ASSERT(strncmp(sbuf->b, "x0123456789101112", 17) == 0);
+  ASSERT_VALID(sbuf);
+
+  // Segments pointing into the buffer itself
+  strbuf_set(sbuf, "abc");
+  strbuf_resize(sbuf, 3);
+  strbuf_append_all(sbuf, strbuf_seg_buf(sbuf), strbuf_seg_char('-'),
+                    strbuf_seg_strn(sbuf->b+1, 2));
+  ASSERT(strcmp(sbuf->b, "abcabc-bc") == 0);
+  ASSERT_VALID(sbuf);
+
+  // Nothing to append
+  strbuf_append_segs(sbuf, segs, 0);
+  ASSERT(strcmp(sbuf->b, "abcabc-bc") == 0);
+
+  strbuf_free(sbuf);
+  strbuf_free(name);
+
+  SUITE_END();
+}
+
 void test_get_set_char()
 {
   SUITE_START("get_char / set_char");
@@ -683,6 +1824,467 @@ void test_append_int()
   SUITE_END();
 }
 
+// Insert sep between groups of three digits of a printf'd integer
+static void _group_digits(char *dst, const char *src, char sep)
+{
+  if(*src == '-') *dst++ = *src++;
+  size_t i, len = strlen(src);
+  for(i = 0; i < len; i++) {
+    if(i > 0 && (len - i) % 3 == 0) *dst++ = sep;
+    *dst++ = src[i];
+  }
+  *dst = '\0';
+}
+
+static void _test_append_int64(StrBuf *sbuf, int64_t x)
+{
+  char truth[100], grouped[100];
+  uint64_t u = (uint64_t)x;
+  size_t start, width = rand() % 25;
+
+  strbuf_reset(sbuf);
+  strbuf_append_charn(sbuf, 'x', rand() & 0xff);
+  start = sbuf->end;
+
+  sprintf(truth, "%"PRId64, x);
+  strbuf_append_int64(sbuf, x);
+  ASSERT(strcmp(sbuf->b+start, truth) == 0);
+
+  sprintf(truth, "%"PRIu64, u);
+  strbuf_shrink(sbuf, start);
+  strbuf_append_uint64(sbuf, u);
+  ASSERT(strcmp(sbuf->b+start, truth) == 0);
+
+  sprintf(truth, "%0*"PRId64, (int)width, x);
+  strbuf_shrink(sbuf, start);
+  strbuf_append_int64_pad(sbuf, x, width, '0');
+  ASSERT(strcmp(sbuf->b+start, truth) == 0);
+
+  sprintf(truth, "%*"PRId64, (int)width, x);
+  strbuf_shrink(sbuf, start);
+  strbuf_append_int64_pad(sbuf, x, width, ' ');
+  ASSERT(strcmp(sbuf->b+start, truth) == 0);
+
+  sprintf(truth, "%0*"PRIu64, (int)width, u);
+  strbuf_shrink(sbuf, start);
+  strbuf_append_uint64_pad(sbuf, u, width, '0');
+  ASSERT(strcmp(sbuf->b+start, truth) == 0);
+
+  sprintf(truth, "%"PRId64, x);
+  _group_digits(grouped, truth, ',');
+  strbuf_shrink(sbuf, start);
+  strbuf_append_int64_sep(sbuf, x, ',');
+  ASSERT(strcmp(sbuf->b+start, grouped) == 0);
+
+  sprintf(truth, "%"PRIu64, u);
+  _group_digits(grouped, truth, '_');
+  strbuf_shrink(sbuf, start);
+  strbuf_append_uint64_sep(sbuf, u, '_');
+  ASSERT(strcmp(sbuf->b+start, grouped) == 0);
+  ASSERT_VALID(sbuf);
+}
+
+void test_append_int64()
+{
+  SUITE_START("using append_int64() / _pad / _sep / _array");
+  StrBuf *sbuf = strbuf_new(0), *truth = strbuf_new(0);
+  uint64_t p, vals[200];
+  unsigned long lvals[200];
+  size_t i, j, n;
+  int64_t x;
+
+  // Every digit boundary
+  for(p = 1, i = 0; i < 20; i++, p *= 10) {
+    for(x = -2; x <= 2; x++) {
+      _test_append_int64(sbuf, (int64_t)(p + x));
+      _test_append_int64(sbuf, -(int64_t)(p + x));
+    }
+  }
+  for(x = -1100; x <= 1100; x++) _test_append_int64(sbuf, x);
+  _test_append_int64(sbuf, INT64_MIN);
+  _test_append_int64(sbuf, INT64_MAX);
+  _test_append_int64(sbuf, INT64_MIN+1);
+
+  // Random magnitudes
+  for(i = 0; i < 10000; i++) {
+    p = ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ (uint64_t)rand();
+    _test_append_int64(sbuf, (int64_t)(p >> (rand() % 64)));
+  }
+
+  // Digits longer than the width
+  strbuf_set(sbuf, "");
+  strbuf_append_uint64_pad(sbuf, 123456, 3, '0');
+  ASSERT(strcmp(sbuf->b, "123456") == 0);
+  strbuf_append_size_t(sbuf, SIZE_MAX);
+  char expect[100];
+  sprintf(expect, "123456%zu", (size_t)SIZE_MAX);
+  ASSERT(strcmp(sbuf->b, expect) == 0);
+
+  // Arrays
+  for(i = 0; i < 100; i++) {
+    n = rand() % 200;
+    for(j = 0; j < n; j++) {
+      vals[j] = (uint64_t)rand() * (uint64_t)rand() >> (rand() % 64);
+      lvals[j] = (unsigned long)vals[j];
+    }
+    strbuf_set(sbuf, "x");
+    strbuf_set(truth, "x");
+    strbuf_append_uint64_array(sbuf, vals, n, '\t');
+    for(j = 0; j < n; j++) {
+      if(j) strbuf_append_char(truth, '\t');
+      strbuf_append_uint64(truth, vals[j]);
+    }
+    ASSERT(sbuf->end == truth->end && strcmp(sbuf->b, truth->b) == 0);
+    ASSERT_VALID(sbuf);
+
+    strbuf_set(sbuf, "");
+    strbuf_set(truth, "");
+    strbuf_append_ulong_array(sbuf, lvals, n, ',');
+    for(j = 0; j < n; j++) {
+      if(j) strbuf_append_char(truth, ',');
+      strbuf_append_ulong(truth, lvals[j]);
+    }
+    ASSERT(sbuf->end == truth->end && strcmp(sbuf->b, truth->b) == 0);
+  }
+
+  strbuf_free(sbuf);
+  strbuf_free(truth);
+  SUITE_END();
+}
+
+// Significant digits in a number written as [-]ddd.ddde+xx
+static size_t _sig_digits(const char *s)
+{
+  const char *first = NULL, *last = NULL;
+  for(; *s && *s != 'e'; s++) {
+    if(*s >= '1' && *s <= '9') { if(!first) first = s; last = s; }
+  }
+  if(!first) return 1;
+  size_t n = 0;
+  for(s = first; s <= last; s++) n += (*s != '.');
+  return n;
+}
+
+static double _dpow10(int n)
+{
+  double d = 1;
+  while(n-- > 0) d *= 10;
+  return d;
+}
+
+static uint64_t _rand64()
+{
+  return ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ (uint64_t)rand();
+}
+
+void test_append_double()
+{
+  SUITE_START("using append_double() / _float / _fixed / _sci");
+  StrBuf *sbuf = strbuf_new(0);
+  char truth[400];
+  size_t i, j, prec, longer = 0, total = 0;
+  uint64_t bits;
+  uint32_t b32;
+  double x;
+  float f;
+
+  const struct { double x; const char *s; } cases[] = {
+    {0.0, "0"}, {-0.0, "-0"}, {1.0, "1"}, {-1.5, "-1.5"}, {0.1, "0.1"},
+    {123.456, "123.456"}, {100.0, "100"}, {1e-4, "0.0001"}, {1e-5, "1e-05"},
+    {1.5e-7, "1.5e-07"}, {1e16, "10000000000000000"}, {1e17, "1e+17"},
+    {1e100, "1e+100"}, {1.0/3, "0.3333333333333333"}, {5e-324, "5e-324"},
+    {1.7976931348623157e308, "1.7976931348623157e+308"},
+    {2.2250738585072014e-308, "2.2250738585072014e-308"},
+    {INFINITY, "inf"}, {-INFINITY, "-inf"}, {NAN, "nan"}
+  };
+
+  for(i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+    strbuf_set(sbuf, "x");
+    strbuf_append_double(sbuf, cases[i].x);
+    ASSERT(strcmp(sbuf->b+1, cases[i].s) == 0);
+  }
+
+  strbuf_reset(sbuf);
+  strbuf_append_float(sbuf, 0.1f);
+  strbuf_append_char(sbuf, ' ');
+  strbuf_append_float(sbuf, 3.4028235e38f);
+  strbuf_append_char(sbuf, ' ');
+  strbuf_append_float(sbuf, -1e-45f);
+  ASSERT(strcmp(sbuf->b, "0.1 3.4028235e+38 -1e-45") == 0);
+
+  // Random doubles read back exactly and are (almost always) shortest
+  for(i = 0; i < 20000; i++) {
+    bits = _rand64();
+    if(i & 1) bits = (bits & ~(0x7FFULL << 52)) | ((uint64_t)(1003 + rand() % 40) << 52);
+    memcpy(&x, &bits, sizeof(x));
+    if(isnan(x) || isinf(x)) continue;
+    strbuf_reset(sbuf);
+    strbuf_append_double(sbuf, x);
+    ASSERT(strtod(sbuf->b, NULL) == x);
+    for(prec = 1; prec <= 17; prec++) {
+      sprintf(truth, "%.*g", (int)prec, x);
+      if(strtod(truth, NULL) == x) break;
+    }
+    longer += (_sig_digits(sbuf->b) > _sig_digits(truth));
+    total++;
+    ASSERT(_sig_digits(sbuf->b) <= 17);
+  }
+  ASSERT(longer * 100 < total);
+
+  for(i = 0; i < 20000; i++) {
+    b32 = (uint32_t)_rand64();
+    memcpy(&f, &b32, sizeof(f));
+    if(isnan(f) || isinf(f)) continue;
+    strbuf_reset(sbuf);
+    strbuf_append_float(sbuf, f);
+    ASSERT(strtof(sbuf->b, NULL) == f);
+    ASSERT(_sig_digits(sbuf->b) <= 9);
+  }
+
+  // Fixed and scientific notation match printf, including ties
+  const double ties[] = {0.5, 1.5, 2.5, 0.125, 0.375, 1.005, 2.675, 1e15+0.5,
+                         0.045, 999.9995, 9.5, 99.5, -0.0, -0.001, 1e300,
+                         1e-300, 5e-324, 123456789.0, INFINITY, -INFINITY};
+  for(i = 0; i < sizeof(ties)/sizeof(ties[0]); i++) {
+    for(prec = 0; prec < 25; prec++) {
+      strbuf_reset(sbuf);
+      strbuf_append_double_fixed(sbuf, ties[i], prec);
+      sprintf(truth, "%.*f", (int)prec, ties[i]);
+      ASSERT(strcmp(sbuf->b, truth) == 0);
+      strbuf_reset(sbuf);
+      strbuf_append_double_sci(sbuf, ties[i], prec);
+      sprintf(truth, "%.*e", (int)prec, ties[i]);
+      ASSERT(strcmp(sbuf->b, truth) == 0);
+    }
+  }
+
+  for(i = 0; i < 20000; i++) {
+    bits = _rand64();
+    j = rand() % 4;
+    if(j == 0) x = (double)(bits >> (rand() % 64)) / _dpow10(rand() % 20);
+    else if(j == 1) x = (double)(rand() % 100000) / 1000 + (rand() % 2) * 0.0005;
+    else { memcpy(&x, &bits, sizeof(x)); if(isnan(x)) continue; }
+    if(rand() & 1) x = -x;
+    prec = rand() % 20;
+    strbuf_reset(sbuf);
+    strbuf_append_double_fixed(sbuf, x, prec);
+    sprintf(truth, "%.*f", (int)prec, x);
+    ASSERT(strcmp(sbuf->b, truth) == 0);
+    strbuf_reset(sbuf);
+    strbuf_append_double_sci(sbuf, x, prec);
+    sprintf(truth, "%.*e", (int)prec, x);
+    ASSERT(strcmp(sbuf->b, truth) == 0);
+  }
+
+  ASSERT_VALID(sbuf);
+  strbuf_free(sbuf);
+  SUITE_END();
+}
+
+// Reference base-N conversion
+static void _base_str(char *dst, uint64_t v, unsigned base, size_t width)
+{
+  char tmp[80];
+  size_t n = 0;
+  do { tmp[n++] = "0123456789abcdefghijklmnopqrstuvwxyz"[v % base]; v /= base; }
+  while(v);
+  while(n < width) tmp[n++] = '0';
+  while(n) *dst++ = tmp[--n];
+  *dst = '\0';
+}
+
+void test_append_hex()
+{
+  SUITE_START("using append_hex() / _binary / _base / hex encode+decode");
+  StrBuf *sbuf = strbuf_new(0), *dec = strbuf_new(0);
+  char truth[200], bytes[300];
+  size_t i, j, len, width, n;
+  unsigned base;
+  uint64_t v;
+
+  for(i = 0; i < 10000; i++) {
+    v = _rand64() >> (rand() % 64);
+    width = rand() % 20;
+    strbuf_set(sbuf, "x");
+    strbuf_append_hex(sbuf, v, width, 0);
+    // printf writes no digits for zero with precision 0
+    sprintf(truth, "x%.*"PRIx64, (int)(width ? width : 1), v);
+    ASSERT(strcmp(sbuf->b, truth) == 0);
+
+    strbuf_reset(sbuf);
+    strbuf_append_hex(sbuf, v, width, 1);
+    sprintf(truth, "%.*"PRIX64, (int)(width ? width : 1), v);
+    ASSERT(strcmp(sbuf->b, truth) == 0);
+
+    width = rand() % 70;
+    strbuf_reset(sbuf);
+    strbuf_append_binary(sbuf, v, width);
+    _base_str(truth, v, 2, width);
+    ASSERT(strcmp(sbuf->b, truth) == 0);
+
+    base = 2 + rand() % 35;
+    strbuf_reset(sbuf);
+    strbuf_append_base(sbuf, v, base, width, 0);
+    _base_str(truth, v, base, width);
+    ASSERT(strcmp(sbuf->b, truth) == 0);
+  }
+
+  strbuf_reset(sbuf);
+  strbuf_append_hex(sbuf, 0, 0, 0);
+  strbuf_append_char(sbuf, ' ');
+  strbuf_append_base(sbuf, 35, 36, 0, 1);
+  strbuf_append_char(sbuf, ' ');
+  strbuf_append_binary(sbuf, 5, 0);
+  strbuf_append_char(sbuf, ' ');
+  strbuf_append_hex(sbuf, 0xdeadbeef, 16, 1);
+  ASSERT(strcmp(sbuf->b, "0 Z 101 00000000DEADBEEF") == 0);
+
+  // Encode / decode round trip
+  for(i = 0; i < 500; i++) {
+    len = rand() % sizeof(bytes);
+    for(j = 0; j < len; j++) bytes[j] = (char)rand();
+    strbuf_set(sbuf, "-");
+    strbuf_append_hex_encode(sbuf, bytes, len, i & 1);
+    ASSERT(sbuf->end == 1 + 2*len);
+    for(j = 0; j < len; j++) {
+      sprintf(truth, (i & 1) ? "%02X" : "%02x", (unsigned char)bytes[j]);
+      ASSERT(memcmp(sbuf->b + 1 + 2*j, truth, 2) == 0);
+    }
+    strbuf_reset(dec);
+    ASSERT(strbuf_append_hex_decode(dec, sbuf->b+1, 2*len) == 2*len);
+    ASSERT(dec->end == len && memcmp(dec->b, bytes, len) == 0);
+
+    // Stops at an invalid char, odd length decodes all but the last char
+    if(len > 0) {
+      j = rand() % (2*len);
+      sbuf->b[1+j] = "g/:@`G \xff"[rand() % 8];
+      strbuf_reset(dec);
+      n = strbuf_append_hex_decode(dec, sbuf->b+1, 2*len);
+      ASSERT(n == j - (j & 1));
+      ASSERT(dec->end == n/2 && memcmp(dec->b, bytes, n/2) == 0);
+      strbuf_reset(dec);
+      ASSERT(strbuf_append_hex_decode(dec, sbuf->b+1, j) == j - (j & 1));
+    }
+  }
+
+  // Encode from within the buffer
+  strbuf_set(sbuf, "AZ");
+  strbuf_append_hex_encode(sbuf, sbuf->b, 2, 0);
+  ASSERT(strcmp(sbuf->b, "AZ415a") == 0);
+  ASSERT(strbuf_append_hex_decode(sbuf, sbuf->b+2, 4) == 4);
+  ASSERT(strcmp(sbuf->b, "AZ415aAZ") == 0);
+
+  ASSERT_VALID(sbuf);
+  strbuf_free(sbuf);
+  strbuf_free(dec);
+  SUITE_END();
+}
+
+// Check strbuf_parse_double against strtod, which is exact in glibc
+static void _test_parse_double(const char *str)
+{
+  char *end;
+  double x = 0, truth = strtod(str, &end);
+  size_t n = strbuf_parse_double(str, strlen(str), &x);
+  ASSERT(n == (size_t)(end - str));
+  if(n > 0 && !isnan(truth)) {
+    ASSERT(memcmp(&x, &truth, sizeof(x)) == 0);
+  }
+}
+
+void test_parse_numbers()
+{
+  SUITE_START("using parse_u64() / parse_i64() / parse_double()");
+  char str[400];
+  size_t i, j, len;
+  uint64_t u = 0;
+  int64_t l = 0;
+  double x = 0;
+
+  // Integers against strtoull / strtoll
+  for(i = 0; i < 20000; i++) {
+    u = _rand64() >> (1 + rand() % 63); // fits in an int64_t
+    len = sprintf(str, "%s%0*"PRIu64"%s", i & 1 ? "-" : "", (int)(rand() % 25),
+                  u, i & 2 ? "x" : ", 12");
+    ASSERT(strbuf_parse_i64(str, len, &l) == strspn(str, "-0123456789"));
+    ASSERT(l == strtoll(str, NULL, 10));
+    ASSERT(strbuf_parse_u64(str+(i&1), len-(i&1), &u) == strspn(str+(i&1), "0123456789"));
+    ASSERT(u == strtoull(str+(i&1), NULL, 10));
+  }
+
+  const struct { const char *s; size_t nu, ni; uint64_t u; int64_t i; } ints[] = {
+    {"18446744073709551615", 20, 0, UINT64_MAX, 0},
+    {"18446744073709551616", 0, 0, 0, 0},
+    {"99999999999999999999", 0, 0, 0, 0},
+    {"00000000000000000000000000000042 ", 32, 32, 42, 42},
+    {"9223372036854775807", 19, 19, 9223372036854775807ULL, INT64_MAX},
+    {"9223372036854775808", 19, 0, 9223372036854775808ULL, 0},
+    {"-9223372036854775808", 0, 20, 0, INT64_MIN},
+    {"-9223372036854775809", 0, 0, 0, 0},
+    {"+7", 2, 2, 7, 7}, {"-0", 0, 2, 0, 0}, {"-", 0, 0, 0, 0},
+    {"+", 0, 0, 0, 0}, {"", 0, 0, 0, 0}, {"x1", 0, 0, 0, 0},
+    {"12345678901234567x", 17, 17, 12345678901234567ULL, 12345678901234567LL}
+  };
+  for(i = 0; i < sizeof(ints)/sizeof(ints[0]); i++) {
+    u = 1; l = 1;
+    ASSERT(strbuf_parse_u64(ints[i].s, strlen(ints[i].s), &u) == ints[i].nu);
+    ASSERT(strbuf_parse_i64(ints[i].s, strlen(ints[i].s), &l) == ints[i].ni);
+    ASSERT(u == (ints[i].nu ? ints[i].u : 1));
+    ASSERT(l == (ints[i].ni ? ints[i].i : 1));
+  }
+  // Not null terminated
+  ASSERT(strbuf_parse_u64("123456789", 4, &u) == 4 && u == 1234);
+
+  // Doubles printed in many ways
+  for(i = 0; i < 20000; i++) {
+    uint64_t bits = _rand64();
+    if(i & 1) bits = (bits & ~(0x7FFULL << 52)) | ((uint64_t)(1003 + rand() % 40) << 52);
+    memcpy(&x, &bits, sizeof(x));
+    switch(i % 4) {
+      case 0: sprintf(str, "%.17g", x); break;
+      case 1: sprintf(str, "%.*g", rand() % 17 + 1, x); break;
+      case 2: sprintf(str, "%.*e", rand() % 20, x); break;
+      default: sprintf(str, "%.*f;", rand() % 10, x); break;
+    }
+    _test_parse_double(str);
+  }
+
+  // Random decimal strings, including many digits and large exponents
+  for(i = 0; i < 20000; i++) {
+    char *p = str;
+    if(rand() % 3 == 0) *p++ = "+-"[rand() % 2];
+    len = rand() % (rand() % 4 ? 20 : 60);
+    for(j = 0; j < len; j++) *p++ = '0' + (rand() % 4 ? rand() % 10 : 0);
+    if(rand() % 2) {
+      *p++ = '.';
+      len = rand() % (rand() % 4 ? 20 : 60);
+      for(j = 0; j < len; j++) *p++ = '0' + rand() % 10;
+    }
+    if(rand() % 2) {
+      *p++ = "eE"[rand() % 2];
+      if(rand() % 2) *p++ = "+-"[rand() % 2];
+      p += sprintf(p, "%i", rand() % (rand() % 2 ? 30 : 400));
+    }
+    *p++ = " x.e"[rand() % 4];
+    *p = '\0';
+    _test_parse_double(str);
+  }
+
+  const char *specials[] = {"inf", "-Infinity", "INFINITE", "nan", "-NaN",
+                            "infx", "1e", "1e+", "1e-x", ".5", "5.", ".", "-.e1",
+                            "0", "-0", "0.0e0", "1e400", "1e-400", "-2e-320",
+                            "4.9406564584124654e-324", "2.2250738585072011e-308",
+                            "1.7976931348623157e308", "1.7976931348623159e308",
+                            "9007199254740993", "123456789012e30", "e5", ""};
+  for(i = 0; i < sizeof(specials)/sizeof(specials[0]); i++)
+    _test_parse_double(specials[i]);
+
+  // Not null terminated
+  ASSERT(strbuf_parse_double("1.2345", 3, &x) == 3 && x == 1.2);
+
+  SUITE_END();
+}
+
 void _test_chomp(const char *str)
 {
   size_t len = strlen(str);
@@ -758,6 +2360,68 @@ void _test_substr(const char *str, size_t start, size_t len)
   free(tmp);
   strbuf_free(sbuf);
 }
+static char _naive_comp(char c)
+{
+  switch(c) {
+    case 'A': return 'T'; case 'T': return 'A';
+    case 'C': return 'G'; case 'G': return 'C';
+    case 'a': return 't'; case 't': return 'a';
+    case 'c': return 'g'; case 'g': return 'c';
+    default: return c;
+  }
+}
+
+void test_revcomp()
+{
+  SUITE_START("reverse / reverse complement");
+
+  size_t i, len;
+  char src[300], rev[300], rc[300], out[300];
+  const char alphabet[] = "ACGTNacgtn-.xU\xe1\xc1";
+  memset(src, 0, sizeof(src));
+
+  // All lengths around the block sizes, in place and out of place
+  for(len = 0; len < 200; len++)
+  {
+    for(i = 0; i < len; i++)
+      src[i] = (rand() & 3) ? alphabet[rand() % (sizeof(alphabet)-1)]
+                            : (char)(rand() & 0xff);
+    for(i = 0; i < len; i++) {
+      rev[i] = src[len-1-i];
+      rc[i] = _naive_comp(src[len-1-i]);
+    }
+
+    out[len] = 'X';
+    string_revcomp(out, src, len);
+    ASSERT(memcmp(out, rc, len) == 0 && out[len] == 'X');
+    memcpy(out, src, len);
+    string_revcomp(out, out, len);
+    ASSERT(memcmp(out, rc, len) == 0);
+    memcpy(out, src, len);
+    string_reverse_region(out, len);
+    ASSERT(memcmp(out, rev, len) == 0 && out[len] == 'X');
+  }
+
+  StrBuf *sbuf = strbuf_create("ACGTTNacgtn");
+  strbuf_revcomp(sbuf);
+  ASSERT(strcmp(sbuf->b, "nacgtNAACGT") == 0);
+  ASSERT_VALID(sbuf);
+  strbuf_reverse(sbuf);
+  ASSERT(strcmp(sbuf->b, "TGCAANtgcan") == 0);
+
+  StrBuf *out_buf = strbuf_new(0);
+  strbuf_append_revcomp(out_buf, sbuf->b, sbuf->end);
+  ASSERT(strcmp(out_buf->b, "ntgcaNTTGCA") == 0);
+  strbuf_append_revcomp(out_buf, out_buf->b, 3);
+  ASSERT(strcmp(out_buf->b, "ntgcaNTTGCAcan") == 0);
+  ASSERT_VALID(out_buf);
+
+  strbuf_free(sbuf);
+  strbuf_free(out_buf);
+
+  SUITE_END();
+}
+
 void test_substr()
 {
   SUITE_START("substr");
@@ -840,6 +2504,61 @@ void _test_copy(StrBuf *sbuf, size_t pos, const char *from, size_t len)
   free(frmcpy);
   free(orig);
 }
+void test_change_case_ascii()
+{
+  SUITE_START("ASCII uppercase / lowercase");
+
+  size_t i, len, off;
+  char src[300], up[300], lo[300], out[300];
+
+  // Every byte value
+  for(i = 0; i < 256; i++) src[i] = (char)i;
+  for(i = 0; i < 256; i++) {
+    up[i] = (i >= 'a' && i <= 'z') ? (char)(i - 32) : (char)i;
+    lo[i] = (i >= 'A' && i <= 'Z') ? (char)(i + 32) : (char)i;
+  }
+  string_ascii_toupper(out, src, 256);
+  ASSERT(memcmp(out, up, 256) == 0);
+  string_ascii_tolower(out, src, 256);
+  ASSERT(memcmp(out, lo, 256) == 0);
+
+  // All lengths and alignments against a byte-at-a-time version
+  for(len = 0; len < 100; len++) {
+    for(off = 0; off < 8; off++) {
+      for(i = 0; i < len; i++) src[off+i] = (char)(rand() & 0xff);
+      for(i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)src[off+i];
+        up[i] = (c >= 'a' && c <= 'z') ? (char)(c - 32) : (char)c;
+        lo[i] = (c >= 'A' && c <= 'Z') ? (char)(c + 32) : (char)c;
+      }
+      out[off+len] = 'X';
+      string_ascii_toupper(out+off, src+off, len);
+      ASSERT(memcmp(out+off, up, len) == 0 && out[off+len] == 'X');
+      memcpy(out+off, src+off, len);
+      string_ascii_tolower(out+off, out+off, len);
+      ASSERT(memcmp(out+off, lo, len) == 0 && out[off+len] == 'X');
+    }
+  }
+
+  StrBuf *sbuf = strbuf_create("Hello World! 123 \xe9\xc9 abcdefghijklmnopqrstuvwxyz");
+  strbuf_to_uppercase_ascii(sbuf);
+  ASSERT(strcmp(sbuf->b, "HELLO WORLD! 123 \xe9\xc9 ABCDEFGHIJKLMNOPQRSTUVWXYZ") == 0);
+  strbuf_to_lowercase_ascii(sbuf);
+  ASSERT(strcmp(sbuf->b, "hello world! 123 \xe9\xc9 abcdefghijklmnopqrstuvwxyz") == 0);
+  ASSERT_VALID(sbuf);
+
+  strbuf_set(sbuf, "ab");
+  strbuf_append_strn_uc_ascii(sbuf, "cDeF", 4);
+  strbuf_append_strn_lc_ascii(sbuf, "GhIj", 3);
+  ASSERT(strcmp(sbuf->b, "abCDEFghi") == 0);
+  strbuf_append_strn_uc_ascii(sbuf, sbuf->b, sbuf->end);
+  ASSERT(strcmp(sbuf->b, "abCDEFghiABCDEFGHI") == 0);
+  ASSERT_VALID(sbuf);
+  strbuf_free(sbuf);
+
+  SUITE_END();
+}
+
 void test_copy()
 {
   SUITE_START("copy");
@@ -1369,6 +3088,440 @@ void test_trim()
   SUITE_END();
 }
 
+void test_trim_spans()
+{
+  SUITE_START("whitespace and character set spans");
+
+  const char ws[] = " \t\n\v\f\r", other[] = "ab\x08\x0e\x1f!\x80\xa0";
+  char str[200];
+  size_t len, lead, trail, i, j, k;
+  StrCharSet set;
+
+  // All whitespace in the C locale
+  for(i = 0; i < 256; i++)
+    ASSERT(strcharset_has(&strcharset_space, (char)i) == (isspace((int)i) != 0));
+
+  strcharset_init(&set, ",;|");
+  ASSERT(strcharset_has(&set, ',') && strcharset_has(&set, '|'));
+  ASSERT(!strcharset_has(&set, ' ') && !strcharset_has(&set, '\0'));
+
+  // Random lengths across vector block boundaries
+  for(i = 0; i < 2000; i++)
+  {
+    len = rand() % (sizeof(str)-1);
+    lead = len ? rand() % (len+1) : 0;
+    trail = len > lead ? rand() % (len-lead+1) : 0;
+    for(j = 0; j < len; j++) str[j] = ws[rand() % 6];
+    // non-space characters in the middle
+    for(j = lead; j < len-trail; j++)
+      if(j == lead || j+1 == len-trail || rand() % 4 == 0)
+        str[j] = other[rand() % 8];
+    str[len] = '\0';
+
+    k = lead + trail < len ? lead : len;
+    ASSERT(string_span_space(str, len) == k);
+    ASSERT(string_span_set(str, len, &strcharset_space) == k);
+    if(lead + trail < len) {
+      ASSERT(string_rspan_space(str, len) == trail);
+      ASSERT(string_rspan_set(str, len, &strcharset_space) == trail);
+      ASSERT(string_next_nonwhitespace(str) == str + lead);
+      ASSERT(!string_is_all_whitespace(str));
+    } else {
+      ASSERT(string_rspan_space(str, len) == len);
+      ASSERT(string_next_nonwhitespace(str) == NULL);
+      ASSERT(string_is_all_whitespace(str));
+    }
+
+    // All whitespace trims to an empty string at offset 0
+    if(lead + trail == len) k = 0;
+
+    StrView v = strview_trim(strview_strn(str, len));
+    ASSERT(v.p == str + k && v.len == (lead + trail < len ? len-lead-trail : 0));
+
+    StrBuf *sbuf = strbuf_create(str);
+    size_t off = strbuf_trim_offset(sbuf);
+    ASSERT(off == k);
+    ASSERT(sbuf->end == (lead + trail < len ? len - trail : 0));
+    ASSERT(sbuf->b[sbuf->end] == '\0');
+    strbuf_free(sbuf);
+
+    char *t = string_trim(str);
+    ASSERT(t == str + k && strlen(t) == v.len);
+  }
+
+  // Trim an arbitrary set
+  StrBuf *sbuf = strbuf_create(",;a|b;|,");
+  strbuf_trim_set(sbuf, &set);
+  ASSERT(strcmp(sbuf->b, "a|b") == 0);
+  ASSERT_VALID(sbuf);
+  strbuf_set(sbuf, ",;;|");
+  ASSERT(strbuf_trim_set_offset(sbuf, &set) == 0 && sbuf->end == 0);
+  strbuf_set(sbuf, "|x");
+  ASSERT(strbuf_trim_set_offset(sbuf, &set) == 1 && sbuf->end == 2);
+  strbuf_free(sbuf);
+
+  StrView v = strview_trim_set(strview_str("||x,y;"), &set);
+  ASSERT(v.len == 3 && strncmp(v.p, "x,y", 3) == 0);
+
+  SUITE_END();
+}
+
+void test_count_replace()
+{
+  SUITE_START("count and replace characters");
+
+  char str[600], cpy[600];
+  size_t i, j, len, n;
+  int c;
+  StrCharSet set;
+
+  ASSERT(string_count_char("", 'a') == 0);
+  ASSERT(string_count_char("abcabca", 'a') == 3);
+  ASSERT(string_count_char("abc", '\0') == 0);
+  strcpy(str, "a,b;c,,d");
+  ASSERT(string_char_replace(str, ',', '\t') == 3);
+  ASSERT(strcmp(str, "a\tb;c\t\td") == 0);
+
+  // Random strings using every byte value, across vector block sizes
+  for(i = 0; i < 500; i++)
+  {
+    len = rand() % sizeof(str);
+    for(j = 0; j < len; j++)
+      str[j] = (char)(rand() % 4 ? "ab,\t"[rand() % 4] : rand() % 256);
+
+    c = rand() % 4 ? "ab,\t"[rand() % 4] : rand() % 256;
+    for(n = j = 0; j < len; j++) n += (str[j] == (char)c);
+    ASSERT(string_count_charn(str, len, (char)c) == n);
+
+    memcpy(cpy, str, len);
+    ASSERT(string_replace_charn(cpy, len, (char)c, 'X') == n);
+    for(j = 0; j < len; j++)
+      ASSERT(cpy[j] == (str[j] == (char)c ? 'X' : str[j]));
+
+    // Random set including bytes >= 0x80
+    memset(&set, 0, sizeof(set));
+    for(j = 0; j < 6; j++) strcharset_add(&set, (char)(rand() % 256));
+    strcharset_add(&set, ',');
+    for(n = j = 0; j < len; j++) n += strcharset_has(&set, str[j]);
+    ASSERT(string_count_set(str, len, &set) == n);
+
+    memcpy(cpy, str, len);
+    ASSERT(string_replace_set(cpy, len, &set, '\n') == n);
+    for(j = 0; j < len; j++)
+      ASSERT(cpy[j] == (strcharset_has(&set, str[j]) ? '\n' : str[j]));
+  }
+
+  // StrBuf versions, including a shared clone
+  StrBuf *sbuf = strbuf_create("chr1\t100\t200;chr2\t5\t6|chr3\t7\t8 and a bit more");
+  StrBuf *clone = strbuf_clone(sbuf);
+  ASSERT(strbuf_count_char(sbuf, '\t') == 6);
+  strcharset_init(&set, ";|");
+  ASSERT(strbuf_count_set(sbuf, &set) == 2);
+  ASSERT(strbuf_replace_set(sbuf, &set, '\n') == 2);
+  ASSERT(strbuf_replace_char(sbuf, '\t', ',') == 6);
+  ASSERT(strcmp(sbuf->b, "chr1,100,200\nchr2,5,6\nchr3,7,8 and a bit more") == 0);
+  ASSERT(strcmp(clone->b, "chr1\t100\t200;chr2\t5\t6|chr3\t7\t8 and a bit more") == 0);
+  ASSERT_VALID(sbuf);
+  ASSERT_VALID(clone);
+  strbuf_free(sbuf);
+  strbuf_free(clone);
+
+  SUITE_END();
+}
+
+// Run each string kernel on str, writing results to out
+static void _simd_kernels_run(const char *str, size_t len, char *out,
+                              size_t *counts, size_t *offsets)
+{
+  StrCharSet set;
+  strcharset_init(&set, "\t,\xff");
+  string_ascii_toupper(out, str, len);
+  string_ascii_tolower(out+len, str, len);
+  string_revcomp(out+2*len, str, len);
+  memcpy(out+3*len, str, len);
+  string_reverse_region(out+3*len, len);
+  memcpy(out+4*len, str, len);
+  counts[0] = string_replace_charn(out+4*len, len, 'a', '_');
+  memcpy(out+5*len, str, len);
+  counts[1] = string_replace_set(out+5*len, len, &set, ' ');
+  counts[2] = string_count_charn(str, len, '\t');
+  counts[3] = string_count_set(str, len, &set);
+  counts[4] = string_span_space(str, len);
+  counts[5] = string_rspan_space(str, len);
+  counts[6] = string_cspan_set(str, len, &set);
+  memset(offsets, 0, len * sizeof(size_t));
+  counts[7] = string_char_offsets(str, len, ',', offsets, len/2);
+  counts[8] = string_find(str, len, "acg", 3);
+  counts[9] = string_rfind(str, len, "ta", 2);
+  counts[10] = string_find(str, len, str + len/2, len/4);
+  counts[11] = string_rfind(str, len, str + len/3, len/3);
+  string_hex_encode(out+6*len, str, len, 1);
+  counts[12] = string_hex_decode(out+8*len, out+6*len, 2*len);
+  // Decode a copy with a bad digit part way through
+  char hex[600];
+  memcpy(hex, out+6*len, 2*len);
+  if(len) hex[len + len/2] = 'x';
+  counts[13] = string_hex_decode(out+8*len, hex, 2*len);
+  strcharset_init(&set, " \r");
+  counts[14] = string_span_set(str, len, &set);
+  counts[15] = string_rspan_set(str, len, &set);
+}
+
+void test_simd_dispatch()
+{
+  SUITE_START("runtime kernel selection");
+
+  const char *names[] = {"scalar", "sse2", "avx2"};
+  const char *start = strbuf_simd_name();
+  char str[300], expout[9*300], out[9*300];
+  size_t i, j, k, len, expcounts[16], counts[16], expoffs[300], offs[300];
+
+  ASSERT(strcmp(start,"scalar") == 0 || strcmp(start,"sse2") == 0 ||
+         strcmp(start,"avx2") == 0);
+  ASSERT(strbuf_simd_select("bogus") == -1);
+  ASSERT(strcmp(strbuf_simd_name(), start) == 0);
+  ASSERT(strbuf_simd_select("scalar") == 0);
+  ASSERT(strcmp(strbuf_simd_name(), "scalar") == 0);
+
+  // Every kernel set available gives the same results as scalar
+  for(i = 0; i < 200; i++)
+  {
+    len = rand() % sizeof(str);
+    for(j = 0; j < len; j++)
+      str[j] = (char)(rand() % 2 ? "acgtACGTN \t\n,"[rand() % 14] : rand() % 256);
+    // whitespace at the ends
+    for(j = 0; j < len && rand() % 8; j++) str[j] = ' ';
+    for(j = len; j > 0 && rand() % 8; j--) str[j-1] = '\r';
+    if(i % 4 == 0) {
+      memset(str, ' ', len/3);
+      memset(str + len - len/3, '\r', len/3);
+    }
+
+    strbuf_simd_select("scalar");
+    _simd_kernels_run(str, len, expout, expcounts, expoffs);
+
+    for(k = 1; k < sizeof(names)/sizeof(names[0]); k++) {
+      if(strbuf_simd_select(names[k]) != 0) continue;
+      _simd_kernels_run(str, len, out, counts, offs);
+      ASSERT(memcmp(out, expout, 9*len) == 0);
+      ASSERT(memcmp(offs, expoffs, len * sizeof(size_t)) == 0);
+      ASSERT(memcmp(counts, expcounts, sizeof(counts)) == 0);
+    }
+  }
+
+  ASSERT(strbuf_simd_select(start) == 0);
+  ASSERT(strcmp(strbuf_simd_name(), start) == 0);
+
+  SUITE_END();
+}
+
+// Check fields from a StrSplit against a list of expected fields
+static void _check_split(StrSplit *it, const char **ans, size_t n)
+{
+  StrView field;
+  size_t i;
+  for(i = 0; i < n; i++) {
+    ASSERT(strsplit_next(it, &field) == 1);
+    ASSERT(field.len == strlen(ans[i]) && memcmp(field.p, ans[i], field.len) == 0);
+  }
+  ASSERT(strsplit_next(it, &field) == 0);
+  ASSERT(strsplit_next(it, &field) == 0);
+}
+
+void test_tokenizer()
+{
+  SUITE_START("tokenizer (StrSplit)");
+
+  StrSplit it;
+  StrView field;
+  StrCharSet set;
+  strcharset_init(&set, ",;");
+
+  const char *ans0[] = {""};
+  const char *ans1[] = {"a", "", "b", ""};
+  const char *ans2[] = {"chr1", "100", "", "+"};
+  const char *ans3[] = {"x", "y", "", "z"};
+  const char *ans4[] = {"a", "b::c", "", "d"};
+
+  strsplit_char(&it, "", 0, ',');
+  _check_split(&it, ans0, 1);
+  strsplit_char(&it, "a,,b,", 5, ',');
+  _check_split(&it, ans1, 4);
+  StrBuf *sbuf = strbuf_create("chr1\t100\t\t+");
+  strsplit_buf_char(&it, sbuf, '\t');
+  _check_split(&it, ans2, 4);
+  strsplit_set(&it, "x;y,;z", 6, &set);
+  _check_split(&it, ans3, 4);
+  strsplit_set(&it, "", 0, &set);
+  _check_split(&it, ans0, 1);
+  strsplit_str(&it, "a::=b::c::=::=d", 15, "::=", 3);
+  _check_split(&it, ans4, 4);
+  strsplit_str(&it, "abc", 3, "", 0);
+  ASSERT(strsplit_next(&it, &field) && field.len == 3);
+  ASSERT(!strsplit_next(&it, &field));
+
+  // Offsets of fields
+  strsplit_buf_char(&it, sbuf, '\t');
+  strsplit_next(&it, &field);
+  strsplit_next(&it, &field);
+  ASSERT(strsplit_offset(&it, field) == 5);
+  strbuf_free(sbuf);
+
+  // Random strings against a simple split, long enough for vector kernels
+  char str[400], sep[4];
+  size_t offsets[400], offsets2[400], i, j, k, len, n, start, nsep;
+
+  for(i = 0; i < 300; i++)
+  {
+    len = rand() % sizeof(str);
+    for(j = 0; j < len; j++) str[j] = "ab,;\xf0"[rand() % 5];
+
+    // Expected offsets of ','
+    for(n = j = 0; j < len; j++) if(str[j] == ',') offsets2[n++] = j;
+    k = rand() % (n+1);
+    ASSERT(string_char_offsets(str, len, ',', offsets, k) == n);
+    ASSERT(k == 0 || memcmp(offsets, offsets2, k * sizeof(size_t)) == 0);
+    ASSERT(string_char_offsets(str, len, ',', offsets, n) == n);
+
+    // Fields between those offsets
+    strsplit_char(&it, str, len, ',');
+    for(start = j = 0; j <= n; j++) {
+      ASSERT(strsplit_next(&it, &field));
+      ASSERT(field.p == str + start);
+      ASSERT(field.len == (j < n ? offsets[j] : len) - start);
+      if(j < n) start = offsets[j] + 1;
+    }
+    ASSERT(!strsplit_next(&it, &field));
+
+    // Set of two separators
+    for(n = j = 0; j < len; j++) if(str[j] == ',' || str[j] == ';') offsets2[n++] = j;
+    ASSERT(string_set_offsets(str, len, &set, offsets, len) == n);
+    ASSERT(n == 0 || memcmp(offsets, offsets2, n * sizeof(size_t)) == 0);
+    ASSERT(string_cspan_set(str, len, &set) == (n ? offsets2[0] : len));
+    strsplit_set(&it, str, len, &set);
+    for(j = 0; strsplit_next(&it, &field); j++)
+      ASSERT(strsplit_offset(&it, field) == (j ? offsets2[j-1]+1 : 0));
+    ASSERT(j == n+1);
+
+    // Multi-byte separator
+    nsep = 1 + rand() % 3;
+    for(j = 0; j < nsep; j++) sep[j] = "ab,"[rand() % 3];
+    strsplit_str(&it, str, len, sep, nsep);
+    for(start = 0; strsplit_next(&it, &field); start += field.len + nsep) {
+      ASSERT(field.p == str + start);
+      // no separator within the field
+      for(j = 0; j + nsep <= field.len; j++) ASSERT(memcmp(field.p+j, sep, nsep) != 0);
+      if(start + field.len < len) ASSERT(memcmp(field.p+field.len, sep, nsep) == 0);
+    }
+    ASSERT(start == len + nsep);
+  }
+
+  SUITE_END();
+}
+
+// Simple first / last match for checking
+static size_t _naive_find(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+  size_t i;
+  for(i = 0; i + nlen <= hlen; i++) if(memcmp(h+i, n, nlen) == 0) return i;
+  return STRBUF_NPOS;
+}
+
+static size_t _naive_rfind(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+  size_t i;
+  if(nlen > hlen) return STRBUF_NPOS;
+  for(i = hlen - nlen + 1; i > 0; i--) if(memcmp(h+i-1, n, nlen) == 0) return i-1;
+  return STRBUF_NPOS;
+}
+
+void test_find()
+{
+  SUITE_START("find / rfind / find_all / replace_all");
+
+  StrBuf *sbuf = strbuf_create("the cat sat on the mat with the hat");
+  size_t offsets[10];
+
+  ASSERT(strbuf_find_str(sbuf, 0, "the") == 0);
+  ASSERT(strbuf_find_str(sbuf, 1, "the") == 15);
+  ASSERT(strbuf_find_str(sbuf, 0, "dog") == STRBUF_NPOS);
+  ASSERT(strbuf_find_str(sbuf, sbuf->end, "") == sbuf->end);
+  ASSERT(strbuf_rfind_str(sbuf, STRBUF_NPOS, "the") == 28);
+  ASSERT(strbuf_rfind_str(sbuf, 27, "the") == 15);
+  ASSERT(strbuf_rfind_str(sbuf, 0, "the") == 0);
+  ASSERT(strbuf_rfind_str(sbuf, 0, "cat") == STRBUF_NPOS);
+  ASSERT(strbuf_find_all(sbuf, "at", 2, offsets, 10) == 4);
+  ASSERT(offsets[0] == 5 && offsets[1] == 9 && offsets[3] == 33);
+  ASSERT(strbuf_find_all(sbuf, "at", 2, offsets, 2) == 4);
+  ASSERT(strbuf_find_all(sbuf, "", 0, offsets, 10) == 0);
+
+  ASSERT(strbuf_replace_all(sbuf, "the", 3, "a", 1) == 3);
+  ASSERT(strcmp(sbuf->b, "a cat sat on a mat with a hat") == 0);
+  ASSERT(strbuf_replace_all(sbuf, "at", 2, "og", 2) == 4);
+  ASSERT(strcmp(sbuf->b, "a cog sog on a mog with a hog") == 0);
+  ASSERT(strbuf_replace_all(sbuf, "a ", 2, "the big ", 8) == 3);
+  ASSERT(strcmp(sbuf->b, "the big cog sog on the big mog with the big hog") == 0);
+  ASSERT(strbuf_replace_all(sbuf, " ", 1, "", 0) == 11);
+  ASSERT(strcmp(sbuf->b, "thebigcogsogonthebigmogwiththebighog") == 0);
+  ASSERT(strbuf_replace_all(sbuf, "", 0, "x", 1) == 0);
+  ASSERT(strbuf_replace_all(sbuf, "xyz", 3, "x", 1) == 0);
+  ASSERT_VALID(sbuf);
+
+  // Overlapping matches are replaced left to right
+  strbuf_set(sbuf, "aaaaa");
+  ASSERT(strbuf_replace_all(sbuf, "aa", 2, "b", 1) == 2);
+  ASSERT(strcmp(sbuf->b, "bba") == 0);
+
+  // Replace in a shared clone leaves the original
+  strbuf_set(sbuf, "xx--xx--xx--xx--xx--xx--xx--xx--xx--xx--");
+  StrBuf *clone = strbuf_clone(sbuf);
+  ASSERT(strbuf_replace_all(clone, "--", 2, "<=>", 3) == 10);
+  ASSERT(strcmp(sbuf->b, "xx--xx--xx--xx--xx--xx--xx--xx--xx--xx--") == 0);
+  ASSERT(strncmp(clone->b, "xx<=>xx<=>", 10) == 0 && clone->end == 50);
+  ASSERT_VALID(clone);
+  strbuf_free(clone);
+
+  // Random haystacks over a small alphabet against the simple search, with
+  // needles either side of the filter / Horspool cutoff
+  char hay[500], needle[80], exp[1500];
+  size_t i, j, k, hlen, nlen, n, pos;
+
+  for(i = 0; i < 1000; i++)
+  {
+    hlen = rand() % sizeof(hay);
+    nlen = 1 + (rand() % 3 ? rand() % 6 : rand() % (int)sizeof(needle));
+    for(j = 0; j < hlen; j++) hay[j] = "aab"[rand() % 3];
+    // Take the needle from the haystack half the time
+    if(nlen <= hlen && rand() % 2) {
+      pos = rand() % (hlen - nlen + 1);
+      memcpy(needle, hay + pos, nlen);
+    } else {
+      for(j = 0; j < nlen; j++) needle[j] = "aab"[rand() % 3];
+    }
+
+    ASSERT(string_find(hay, hlen, needle, nlen) == _naive_find(hay, hlen, needle, nlen));
+    ASSERT(string_rfind(hay, hlen, needle, nlen) == _naive_rfind(hay, hlen, needle, nlen));
+
+    // replace_all matches a simple rebuild
+    strbuf_set(sbuf, "");
+    strbuf_append_strn(sbuf, hay, hlen);
+    for(k = n = j = 0; j < hlen; ) {
+      if(j + nlen <= hlen && memcmp(hay+j, needle, nlen) == 0) {
+        memcpy(exp+k, "<->", 3); k += 3; j += nlen; n++;
+      }
+      else exp[k++] = hay[j++];
+    }
+    ASSERT(strbuf_find_all(sbuf, needle, nlen, NULL, 0) == n);
+    ASSERT(strbuf_replace_all(sbuf, needle, nlen, "<->", 3) == n);
+    ASSERT(sbuf->end == k && memcmp(sbuf->b, exp, k) == 0);
+    ASSERT_VALID(sbuf);
+  }
+
+  strbuf_free(sbuf);
+
+  SUITE_END();
+}
+
 void test_safe_ncpy()
 {
   SUITE_START("using string_safe_ncpy()");
@@ -1498,6 +3651,70 @@ void test_split_str()
   SUITE_END();
 }
 
+void test_readint_buf()
+{
+  SUITE_START("buffered reading of integers (freadint_buf/gzreadint_buf)");
+
+  int64_t vals[2000], x;
+  size_t i, n = sizeof(vals)/sizeof(vals[0]);
+  StrBuf *sbuf = strbuf_new(0);
+
+  for(i = 0; i < n; i++) {
+    vals[i] = (int64_t)(_rand64() >> (rand() % 64));
+    if(rand() & 1) vals[i] = -vals[i];
+    strbuf_append_str(sbuf, i % 3 ? "+" : "");
+    if(vals[i] < 0) sbuf->end -= (i % 3 != 0); // no '+' before '-'
+    strbuf_append_int64(sbuf, vals[i]);
+    strbuf_append_str(sbuf, i % 7 ? " " : "\t\r\n  ");
+  }
+  strbuf_append_str(sbuf, "9223372036854775808 -x 12");
+
+  FILE *file = fopen(tmp_file1, "w");
+  fputs2(file, sbuf->b);
+  fclose(file);
+  gzFile gzfile = gzopen(tmp_gzfile1, "w");
+  gzputs(gzfile, sbuf->b);
+  gzclose(gzfile);
+
+  file = fopen(tmp_file1, "r");
+  gzfile = gzopen(tmp_gzfile1, "r");
+
+  // Small buffers so numbers are split across refills
+  StreamBuffer *fbuf = strm_buf_new(7), *gzbuf = strm_buf_new(13);
+
+  for(i = 0; i < n; i++) {
+    x = 0;
+    ASSERT(freadint_buf(file, fbuf, &x) == 1);
+    ASSERT(x == vals[i]);
+    x = 0;
+    ASSERT(gzreadint_buf(gzfile, gzbuf, &x) == 1);
+    ASSERT(x == vals[i]);
+  }
+
+  // Overflow, then a sign without digits is left unread
+  ASSERT(freadint_buf(file, fbuf, &x) == -1);
+  ASSERT(freadint_buf(file, fbuf, &x) == 0);
+  ASSERT(fgetc_buf(file, fbuf) == '-');
+  ASSERT(fgetc_buf(file, fbuf) == 'x');
+  ASSERT(freadint_buf(file, fbuf, &x) == 1 && x == 12);
+  ASSERT(freadint_buf(file, fbuf, &x) == 0);
+
+  ASSERT(gzreadint_buf(gzfile, gzbuf, &x) == -1);
+  ASSERT(gzreadint_buf(gzfile, gzbuf, &x) == 0);
+  ASSERT(gzgetc_buf(gzfile, gzbuf) == '-');
+  ASSERT(gzgetc_buf(gzfile, gzbuf) == 'x');
+  ASSERT(gzreadint_buf(gzfile, gzbuf, &x) == 1 && x == 12);
+  ASSERT(gzreadint_buf(gzfile, gzbuf, &x) == 0);
+
+  fclose(file);
+  gzclose(gzfile);
+  strm_buf_free(fbuf);
+  strm_buf_free(gzbuf);
+  strbuf_free(sbuf);
+
+  SUITE_END();
+}
+
 /* Non-function tests */
 
 void test_sscanf()
@@ -1576,17 +3793,42 @@ int main()
   test_clone();
   test_reset();
   test_resize();
+  test_sso();
+  test_allocator();
+  test_arena();
+  test_pool();
+  test_mmap_growth();
+  test_growth_policy();
+  test_stats();
+  test_rope();
+  test_gap_buffer();
+  test_copy_on_write();
+  test_strview();
+  test_tokenizer();
+  test_find();
+  test_intern();
+  test_aho();
+  test_append_segs();
 
   test_get_set_char();
   test_set();
   test_as_str();
   test_append();
   test_append_int();
+  test_append_int64();
+  test_append_double();
+  test_append_hex();
+  test_parse_numbers();
   test_chomp();
   test_trim();
+  test_trim_spans();
+  test_count_replace();
+  test_simd_dispatch();
   test_reverse();
+  test_revcomp();
   test_substr();
   test_change_case();
+  test_change_case_ascii();
 
   test_copy();
   test_insert();
@@ -1600,6 +3842,7 @@ int main()
   test_read_gzfile();
   test_read_file();
   test_read_nonempty();
+  test_readint_buf();
 
   test_sscanf();
 
@@ -15,6 +15,7 @@
 #include <string.h>
 #include <zlib.h>
 #include <limits.h>
+#include <stdint.h>
 
 /*
    Generic string buffer functions
@@ -29,18 +30,87 @@
   }
 #endif
 
-static inline void cbuf_capacity(char **buf, size_t *sizeptr, size_t len)
+/*
+   Statistics
+
+   Build with -DSTRBUF_STATS=1 to count allocations, copies and refills in
+   per-thread counters (see strbuf_stats_get() in string_buffer.h).
+   Otherwise STRBUF_STAT_ADD() compiles to nothing.
+*/
+
+typedef struct
+{
+  size_t allocs; // new blocks of memory for buffers
+  size_t grows; // capacity increases (realloc, mremap, moving to the heap)
+  size_t memmove_bytes; // bytes shifted by insert/overwrite/delete/trim
+  size_t sprintf_retries; // vsnprintf calls that had to grow and print again
+  size_t refills; // StreamBuffer reads from the underlying file
+} StrBufStats;
+
+#if defined(STRBUF_STATS) && STRBUF_STATS
+  extern __thread StrBufStats strbuf_stats_tls;
+  #define STRBUF_STAT_ADD(field,n) (strbuf_stats_tls.field += (n))
+#else
+  #define STRBUF_STAT_ADD(field,n) ((void)0)
+#endif
+
+/*
+   Allocators
+*/
+
+// Function table plus context used to get memory for a buffer.
+// A NULL allocator means malloc/realloc/free.
+// Sizes are passed back in so that allocators (e.g. an arena) don't need to
+// store them. Functions return NULL if out of memory.
+typedef struct
+{
+  void* (*alloc)(void *ctx, size_t size);
+  void* (*resize)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+  void  (*dealloc)(void *ctx, void *ptr, size_t size);
+  void *ctx;
+} BufAllocator;
+
+static inline void* bufalloc_malloc(const BufAllocator *a, size_t size)
+{
+  return a ? a->alloc(a->ctx, size) : malloc(size);
+}
+
+static inline void* bufalloc_realloc(const BufAllocator *a, void *ptr,
+                                     size_t old_size, size_t new_size)
+{
+  return a ? a->resize(a->ctx, ptr, old_size, new_size)
+           : realloc(ptr, new_size);
+}
+
+static inline void bufalloc_free(const BufAllocator *a, void *ptr, size_t size)
+{
+  if(a) a->dealloc(a->ctx, ptr, size);
+  else free(ptr);
+}
+
+// Ensure capacity for len bytes plus '\0', getting memory from allocator `a`
+// Exits on failure
+static inline void cbuf_capacity_alloc(char **buf, size_t *sizeptr, size_t len,
+                                       const BufAllocator *a)
 {
   len++; // for nul byte
   if(*sizeptr < len) {
-    *sizeptr = ROUNDUP2POW(len);
-    if((*buf = realloc(*buf, *sizeptr)) == NULL) {
+    size_t newsize = ROUNDUP2POW(len);
+    if(*buf == NULL) STRBUF_STAT_ADD(allocs, 1);
+    else if(*sizeptr) STRBUF_STAT_ADD(grows, 1);
+    if((*buf = bufalloc_realloc(a, *buf, *sizeptr, newsize)) == NULL) {
       fprintf(stderr, "[%s:%i] Out of memory\n", __FILE__, __LINE__);
       exit(EXIT_FAILURE);
     }
+    *sizeptr = newsize;
   }
 }
 
+static inline void cbuf_capacity(char **buf, size_t *sizeptr, size_t len)
+{
+  cbuf_capacity_alloc(buf, sizeptr, len, NULL);
+}
+
 static inline void cbuf_append_char(char **buf, size_t *lenptr, size_t *sizeptr,
                                     char c)
 {
@@ -77,48 +147,66 @@ typedef struct
   // size should be >= end+1 to allow for \0
   // (end-begin) is the number of bytes in buffer
   size_t begin, end, size;
+  const BufAllocator *alloc; // NULL => malloc/realloc/free
 } StreamBuffer;
 
 
-#define strm_buf_init {.b = NULL, .begin = 0, .end = 0, .size = 0}
+#define strm_buf_init {.b = NULL, .begin = 0, .end = 0, .size = 0, .alloc = NULL}
 
 #define strm_buf_reset(sb) do { (b)->begin = (b)->end = 1; } while(0)
 
+// Get memory from allocator `a` (NULL for malloc)
 // Returns NULL if out of memory, @b otherwise
-static inline StreamBuffer* strm_buf_alloc(StreamBuffer *b, size_t s)
+static inline StreamBuffer* strm_buf_alloc_with(StreamBuffer *b, size_t s,
+                                                const BufAllocator *a)
 {
+  b->alloc = a;
   b->size = (s < 16 ? 16 : s) + 1;
-  if((b->b = malloc(b->size)) == NULL) return NULL;
+  STRBUF_STAT_ADD(allocs, 1);
+  if((b->b = (char*)bufalloc_malloc(a, b->size)) == NULL) return NULL;
   b->begin = b->end = 1;
   b->b[b->end] = b->b[b->size-1] = 0;
   return b;
 }
 
+// Returns NULL if out of memory, @b otherwise
+static inline StreamBuffer* strm_buf_alloc(StreamBuffer *b, size_t s)
+{
+  return strm_buf_alloc_with(b, s, NULL);
+}
+
 static inline void strm_buf_dealloc(StreamBuffer *b)
 {
-  free(b->b);
+  bufalloc_free(b->alloc, b->b, b->size);
   memset(b, 0, sizeof(StreamBuffer));
 }
 
-static inline StreamBuffer* strm_buf_new(size_t s)
+// Struct and buffer both come from allocator `a` (NULL for malloc)
+static inline StreamBuffer* strm_buf_new_with(size_t s, const BufAllocator *a)
 {
-  StreamBuffer *b = (StreamBuffer*)malloc(sizeof(StreamBuffer));
+  StreamBuffer *b = (StreamBuffer*)bufalloc_malloc(a, sizeof(StreamBuffer));
   if(b == NULL) return NULL;
-  else if(strm_buf_alloc(b,s)) return b;
-  else { free(b); return NULL; } /* couldn't malloc */
+  else if(strm_buf_alloc_with(b,s,a)) return b;
+  else { bufalloc_free(a, b, sizeof(StreamBuffer)); return NULL; }
+}
+
+static inline StreamBuffer* strm_buf_new(size_t s)
+{
+  return strm_buf_new_with(s, NULL);
 }
 
 static inline void strm_buf_free(StreamBuffer *cbuf)
 {
-  free(cbuf->b);
-  free(cbuf);
+  const BufAllocator *a = cbuf->alloc;
+  bufalloc_free(a, cbuf->b, cbuf->size);
+  bufalloc_free(a, cbuf, sizeof(StreamBuffer));
 }
 
 // len is the number of bytes you want to be able to store
 // Adds one to len for NULL terminating byte
 static inline void strm_buf_ensure_capacity(StreamBuffer *cbuf, size_t len)
 {
-  cbuf_capacity(&cbuf->b, &cbuf->size, len);
+  cbuf_capacity_alloc(&cbuf->b, &cbuf->size, len, cbuf->alloc);
 }
 
 
@@ -170,22 +258,32 @@ static inline size_t gzread2(gzFile gz, void *ptr, size_t len)
 
 #define fungetc(c,f) ungetc(c,f)
 
+// Body of readline for gzFile and FILE (unbuffered), shared with the StrBuf
+// readers in string_buffer.c. _b, _len and _size are lvalues for the output
+// char array, its length and capacity; __cap(__VA_ARGS__, n) must grow it to
+// hold n chars plus '\0'
+#define _READLINE_BODY(file,__gets,_b,_len,_size,__cap,...) do                 \
+{                                                                              \
+  if((_len)+1 >= (_size)) __cap(__VA_ARGS__, (_len)+1);                        \
+  /* Don't read more than 2^32 bytes at once (gzgets limit) */                 \
+  size_t r = (_size)-(_len) > UINT_MAX ? UINT_MAX : (_size)-(_len);            \
+  size_t origlen = (_len);                                                     \
+  while(__gets(file, (_b)+(_len), r) != NULL)                                  \
+  {                                                                            \
+    (_len) += strlen((_b)+(_len));                                             \
+    if((_b)[(_len)-1] == '\n') return (_len)-origlen;                          \
+    else __cap(__VA_ARGS__, (_size));                                          \
+    r = (_size)-(_len) > UINT_MAX ? UINT_MAX : (_size)-(_len);                 \
+  }                                                                            \
+  return (_len)-origlen;                                                       \
+} while(0)
+
 // Define readline for gzFile and FILE (unbuffered)
 // Check ferror/gzerror on return for error
 #define _func_readline(name,type_t,__gets) \
   static inline size_t name(type_t file, char **buf, size_t *len, size_t *size)\
   {                                                                            \
-    if(*len+1 >= *size) cbuf_capacity(buf, size, *len+1);                      \
-    /* Don't read more than 2^32 bytes at once (gzgets limit) */               \
-    size_t r = *size-*len > UINT_MAX ? UINT_MAX : *size-*len, origlen = *len;  \
-    while(__gets(file, *buf+*len, r) != NULL)                                  \
-    {                                                                          \
-      *len += strlen(*buf+*len);                                               \
-      if((*buf)[*len-1] == '\n') return *len-origlen;                          \
-      else *buf = realloc(*buf, *size *= 2);                                   \
-      r = *size-*len > UINT_MAX ? UINT_MAX : *size-*len;                       \
-    }                                                                          \
-    return *len-origlen;                                                       \
+    _READLINE_BODY(file,__gets,*buf,*len,*size,cbuf_capacity,buf,size);        \
   }
 
 _func_readline(gzreadline,gzFile,gzgets2)
@@ -217,6 +315,8 @@ fread_buf(f,ptr,len,in)
 gzread_buf(f,ptr,len,in)
 gzreadline_buf(gz,in,out)
 freadline_buf(f,in,out)
+freadint_buf(f,in,val)
+gzreadint_buf(gz,in,val)
 */
 
 // __read is either gzread2 or fread2
@@ -225,6 +325,7 @@ freadline_buf(f,in,out)
 // Returns fail on error
 #define _READ_BUFFER(file,in,__read) do                                        \
 {                                                                              \
+  STRBUF_STAT_ADD(refills, 1);                                                 \
   (in)->end = 1+__read(file,(in)->b+1,(in)->size-1);                           \
   (in)->begin = 1;                                                             \
 } while(0)
@@ -295,28 +396,43 @@ static inline int ungetc_buf(int c, StreamBuffer *in)
 _func_read_buf(gzread_buf,gzFile,gzread2)
 _func_read_buf(fread_buf,FILE*,fread2)
 
+// Index after the first '\n' in b[begin..end-1], or end if there isn't one.
+// memchr is vectorised by the C library so this runs at memory bandwidth.
+static inline size_t _strm_line_end(const char *b, size_t begin, size_t end)
+{
+  const char *nl = memchr(b+begin, '\n', end-begin);
+  return nl == NULL ? end : (size_t)(nl - b) + 1;
+}
+
+// Body of readline for gzFile and FILE (buffered), arguments as for
+// _READLINE_BODY
+#define _READLINE_BUF_BODY(file,in,__read,_b,_len,_size,__cap,...) do          \
+{                                                                              \
+  if((in)->begin >= (in)->end) { _READ_BUFFER(file,in,__read); }               \
+  size_t offset, buffered, total_read = 0;                                     \
+  while((in)->end > (in)->begin)                                               \
+  {                                                                            \
+    offset = _strm_line_end((in)->b, (in)->begin, (in)->end);                  \
+    buffered = offset - (in)->begin;                                           \
+    __cap(__VA_ARGS__, (_len)+buffered);                                       \
+    memcpy((_b)+(_len), (in)->b+(in)->begin, buffered);                        \
+    (_len) += buffered;                                                        \
+    (in)->begin = offset;                                                      \
+    total_read += buffered;                                                    \
+    if((_b)[(_len)-1] == '\n') break;                                          \
+    _READ_BUFFER(file,in,__read);                                              \
+  }                                                                            \
+  (_b)[(_len)] = 0;                                                            \
+  return total_read;                                                           \
+} while(0)
+
 // Define readline for gzFile and FILE (buffered)
 // Check ferror/gzerror on return for error
 #define _func_readline_buf(fname,type_t,__read)                                \
   static inline size_t fname(type_t file, StreamBuffer *in,                    \
                              char **buf, size_t *len, size_t *size)            \
   {                                                                            \
-    if(in->begin >= in->end) { _READ_BUFFER(file,in,__read); }                 \
-    size_t offset, buffered, total_read = 0;                                   \
-    while(in->end > in->begin)                                                 \
-    {                                                                          \
-      for(offset = in->begin; offset < in->end && in->b[offset++] != '\n'; ){} \
-      buffered = offset - in->begin;                                           \
-      cbuf_capacity(buf, size, (*len)+buffered);                               \
-      memcpy((*buf)+(*len), in->b+in->begin, buffered);                        \
-      *len += buffered;                                                        \
-      in->begin = offset;                                                      \
-      total_read += buffered;                                                  \
-      if((*buf)[*len-1] == '\n') break;                                        \
-      _READ_BUFFER(file,in,__read);                                            \
-    }                                                                          \
-    (*buf)[*len] = 0;                                                          \
-    return total_read;                                                         \
+    _READLINE_BUF_BODY(file,in,__read,*buf,*len,*size,cbuf_capacity,buf,size); \
   }
 
 _func_readline_buf(gzreadline_buf,gzFile,gzread2)
@@ -331,7 +447,7 @@ _func_readline_buf(freadline_buf,FILE*,fread2)
     size_t offset, skipped_bytes = 0;                                          \
     while(in->end > in->begin)                                                 \
     {                                                                          \
-      for(offset = in->begin; offset < in->end && in->b[offset++] != '\n'; )   \
+      offset = _strm_line_end(in->b, in->begin, in->end);                      \
       skipped_bytes += offset - in->begin;                                     \
       in->begin = offset;                                                      \
       if(in->b[offset-1] == '\n') break;                                       \
@@ -359,7 +475,7 @@ _func_skipline_buf(fskipline_buf,FILE*,fread2)
     while(in->end > in->begin)                                                 \
     {                                                                          \
       limit = (in->begin+remaining < in->end ? in->begin+remaining : in->end); \
-      for(i = in->begin; i < limit && in->b[i++] != '\n'; );                   \
+      i = _strm_line_end(in->b, in->begin, limit);                             \
       buffered = i - in->begin;                                                \
       memcpy(str+total_read, in->b+in->begin, buffered);                       \
       in->begin += buffered;                                                   \
@@ -375,6 +491,59 @@ _func_skipline_buf(fskipline_buf,FILE*,fread2)
 _func_gets_buf(gzgets_buf,gzFile,gzread2)
 _func_gets_buf(fgets_buf,FILE*,fread2)
 
+// Define buffered freadint_buf, gzreadint_buf
+
+// Skips whitespace then reads a decimal integer with an optional sign straight
+// from the buffer, without copying the line.
+// Returns 1 and sets *val on success, 0 at EOF or if the next char does not
+// start an integer (it is left unread), -1 if it does not fit in an int64_t
+// (the digits are consumed).
+// Check ferror/gzerror on return for error
+#define _strm_isspace(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+#define _strm_isdigit(c) ((c) >= '0' && (c) <= '9')
+
+#define _func_readint_buf(fname,type_t,__read)                                 \
+  static inline int fname(type_t file, StreamBuffer *in, int64_t *val)         \
+  {                                                                            \
+    char sign = 0;                                                             \
+    int overflow = 0;                                                          \
+    uint64_t v = 0;                                                            \
+    unsigned d;                                                                \
+    while(1) {                                                                 \
+      while(in->begin < in->end && _strm_isspace(in->b[in->begin]))            \
+        in->begin++;                                                           \
+      if(in->begin < in->end) break;                                           \
+      _READ_BUFFER(file,in,__read);                                            \
+      if(in->begin >= in->end) return 0;                                       \
+    }                                                                          \
+    if(in->b[in->begin] == '-' || in->b[in->begin] == '+') {                   \
+      sign = in->b[in->begin++];                                               \
+      if(in->begin >= in->end) { _READ_BUFFER(file,in,__read); }               \
+    }                                                                          \
+    if(in->begin >= in->end || !_strm_isdigit(in->b[in->begin])) {             \
+      if(sign) ungetc_buf(sign,in);                                            \
+      return 0;                                                                \
+    }                                                                          \
+    while(1) {                                                                 \
+      for(; in->begin < in->end &&                                             \
+            (d = (unsigned char)in->b[in->begin] - '0') < 10; in->begin++) {   \
+        if(v >= UINT64_MAX / 10 &&                                             \
+           (v > UINT64_MAX / 10 || d > UINT64_MAX % 10)) overflow = 1;         \
+        v = v * 10 + d;                                                        \
+      }                                                                        \
+      if(in->begin < in->end) break;                                           \
+      _READ_BUFFER(file,in,__read);                                            \
+      if(in->begin >= in->end) break;                                          \
+    }                                                                          \
+    if(overflow || v > (uint64_t)INT64_MAX + (sign == '-')) return -1;         \
+    if(sign != '-') *val = (int64_t)v;                                         \
+    else *val = v > (uint64_t)INT64_MAX ? INT64_MIN : -(int64_t)v;             \
+    return 1;                                                                  \
+  }
+
+_func_readint_buf(gzreadint_buf,gzFile,gzread2)
+_func_readint_buf(freadint_buf,FILE*,fread2)
+
 
 // Buffered ftell/gztell, fseek/gzseek
 
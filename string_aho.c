@@ -0,0 +1,284 @@
+/*
+ string_aho.c
+ project: string_buffer
+ url: https://github.com/noporpoise/StringBuffer
+ author: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "string_aho.h"
+
+// The automaton is a full DFA over byte classes: bytes that appear in no
+// pattern share class 0, every other byte gets its own class. Each node has a
+// row of ncls transitions, so matching is one table lookup per byte.
+// Node 0 is the root. Patterns ending at a node are a linked list from
+// first[node] through next[id]; dict[node] is the nearest proper suffix node
+// that has patterns (0 for none).
+
+#define AHO_NONE UINT32_MAX
+
+struct StrAho
+{
+  // Patterns as added
+  StrBuf *text; // all patterns concatenated
+  size_t *pat_start, *pat_len;
+  size_t npats, pats_cap;
+
+  // Compiled automaton
+  int compiled, prefilter;
+  uint16_t cls[256];
+  size_t ncls, nnodes, nodes_cap;
+  uint32_t *delta; // nnodes x ncls transitions
+  uint32_t *first, *dict, *next;
+  uint8_t *out; // node has any patterns ending at it or its suffixes
+  StrCharSet starts; // first bytes of patterns
+};
+
+static void _aho_oom(const char *file, int line)
+{
+  fprintf(stderr, "[%s:%i] Out of memory\n", file, line);
+  exit(EXIT_FAILURE);
+}
+
+static void* _aho_realloc(void *ptr, size_t size)
+{
+  void *p = realloc(ptr, size);
+  if(p == NULL) _aho_oom(__FILE__, __LINE__);
+  return p;
+}
+
+/******************************/
+/*  Constructors/Destructors  */
+/******************************/
+
+StrAho* straho_new(void)
+{
+  StrAho *ac = calloc(1, sizeof(StrAho));
+  if(ac == NULL) return NULL;
+  if((ac->text = strbuf_new(0)) == NULL) { free(ac); return NULL; }
+  return ac;
+}
+
+void straho_free(StrAho *ac)
+{
+  strbuf_free(ac->text);
+  free(ac->pat_start);
+  free(ac->pat_len);
+  free(ac->delta);
+  free(ac->first);
+  free(ac->dict);
+  free(ac->next);
+  free(ac->out);
+  free(ac);
+}
+
+size_t straho_add(StrAho *ac, const char *pattern, size_t len)
+{
+  if(ac->compiled) {
+    fprintf(stderr, "[%s:%i] Pattern added after straho_compile()\n",
+            __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+  if(ac->npats + 1 >= AHO_NONE) {
+    fprintf(stderr, "[%s:%i] Too many patterns\n", __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+  if(ac->npats == ac->pats_cap) {
+    ac->pats_cap = ac->pats_cap ? ac->pats_cap * 2 : 16;
+    ac->pat_start = _aho_realloc(ac->pat_start, ac->pats_cap * sizeof(size_t));
+    ac->pat_len = _aho_realloc(ac->pat_len, ac->pats_cap * sizeof(size_t));
+  }
+  ac->pat_start[ac->npats] = ac->text->end;
+  ac->pat_len[ac->npats] = len;
+  strbuf_append_strn(ac->text, pattern, len);
+  return ac->npats++;
+}
+
+size_t straho_num_patterns(const StrAho *ac)
+{
+  return ac->npats;
+}
+
+size_t straho_pattern_len(const StrAho *ac, size_t id)
+{
+  return ac->pat_len[id];
+}
+
+/*************/
+/*  Compile  */
+/*************/
+
+static uint32_t _aho_new_node(StrAho *ac)
+{
+  if(ac->nnodes == ac->nodes_cap) {
+    if(ac->nodes_cap >= AHO_NONE / 2) {
+      fprintf(stderr, "[%s:%i] Too many nodes\n", __FILE__, __LINE__);
+      exit(EXIT_FAILURE);
+    }
+    ac->nodes_cap = ac->nodes_cap ? ac->nodes_cap * 2 : 64;
+    ac->delta = _aho_realloc(ac->delta, ac->nodes_cap * ac->ncls * sizeof(uint32_t));
+    ac->first = _aho_realloc(ac->first, ac->nodes_cap * sizeof(uint32_t));
+    ac->dict = _aho_realloc(ac->dict, ac->nodes_cap * sizeof(uint32_t));
+  }
+  uint32_t node = (uint32_t)ac->nnodes++;
+  memset(ac->delta + node * ac->ncls, 0, ac->ncls * sizeof(uint32_t));
+  ac->first[node] = AHO_NONE;
+  ac->dict[node] = 0;
+  return node;
+}
+
+void straho_compile(StrAho *ac, int flags)
+{
+  if(ac->compiled) {
+    fprintf(stderr, "[%s:%i] Automaton already compiled\n", __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+
+  const unsigned char *text = (const unsigned char*)ac->text->b;
+  size_t i, j, c, ncls;
+  uint32_t node, child, *row;
+
+  // Byte classes and first bytes
+  memset(ac->cls, 0, sizeof(ac->cls));
+  memset(&ac->starts, 0, sizeof(ac->starts));
+  for(ncls = 1, i = 0; i < ac->text->end; i++)
+    if(ac->cls[text[i]] == 0) ac->cls[text[i]] = (uint16_t)ncls++;
+  ac->ncls = ncls;
+
+  ac->next = _aho_realloc(NULL, (ac->npats ? ac->npats : 1) * sizeof(uint32_t));
+
+  // Trie, with 0 meaning no edge (the root is never a child)
+  _aho_new_node(ac);
+  for(i = 0; i < ac->npats; i++) {
+    const unsigned char *p = text + ac->pat_start[i];
+    if(ac->pat_len[i] == 0) { ac->next[i] = AHO_NONE; continue; }
+    strcharset_add(&ac->starts, (char)p[0]);
+    for(node = 0, j = 0; j < ac->pat_len[i]; j++) {
+      c = ac->cls[p[j]];
+      if(ac->delta[node * ncls + c] == 0) {
+        child = _aho_new_node(ac); // may move delta
+        ac->delta[node * ncls + c] = child;
+      }
+      node = ac->delta[node * ncls + c];
+    }
+    ac->next[i] = ac->first[node];
+    ac->first[node] = (uint32_t)i;
+  }
+
+  // Breadth first: set suffix links and fill in missing edges from the
+  // suffix node, which is always nearer the root so already complete
+  uint32_t *fail = _aho_realloc(NULL, ac->nnodes * sizeof(uint32_t));
+  uint32_t *queue = _aho_realloc(NULL, ac->nnodes * sizeof(uint32_t));
+  size_t qhead = 0, qtail = 0;
+
+  for(c = 0; c < ncls; c++) {
+    if((child = ac->delta[c]) != 0) { fail[child] = 0; queue[qtail++] = child; }
+  }
+
+  while(qhead < qtail) {
+    node = queue[qhead++];
+    row = ac->delta + node * ncls;
+    const uint32_t *frow = ac->delta + fail[node] * ncls;
+    for(c = 0; c < ncls; c++) {
+      if((child = row[c]) != 0) {
+        uint32_t f = frow[c];
+        fail[child] = f;
+        ac->dict[child] = ac->first[f] != AHO_NONE ? f : ac->dict[f];
+        queue[qtail++] = child;
+      }
+      else row[c] = frow[c];
+    }
+  }
+
+  free(fail);
+  free(queue);
+
+  ac->out = _aho_realloc(NULL, ac->nnodes);
+  for(i = 0; i < ac->nnodes; i++)
+    ac->out[i] = (ac->first[i] != AHO_NONE || ac->dict[i] != 0);
+
+  ac->prefilter = (flags & STRAHO_PREFILTER) != 0;
+  ac->compiled = 1;
+}
+
+/**************/
+/*  Matching  */
+/**************/
+
+// Report all patterns ending at `end` (exclusive) in the current node
+static size_t _aho_report(const StrAho *ac, uint32_t node, size_t end,
+                          StrAhoMatch *hits, size_t max, size_t n)
+{
+  uint32_t id;
+  for(; node != 0; node = ac->dict[node]) {
+    for(id = ac->first[node]; id != AHO_NONE; id = ac->next[id], n++) {
+      if(n < max) {
+        hits[n].id = id;
+        hits[n].offset = end - ac->pat_len[id];
+      }
+    }
+  }
+  return n;
+}
+
+size_t straho_feed(const StrAho *ac, StrAhoState *st,
+                   const char *str, size_t len,
+                   StrAhoMatch *hits, size_t max)
+{
+  if(!ac->compiled) {
+    fprintf(stderr, "[%s:%i] Automaton not compiled\n", __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+
+  const uint32_t *delta = ac->delta;
+  const uint16_t *cls = ac->cls;
+  const size_t ncls = ac->ncls;
+  uint32_t node = st->node;
+  size_t i, n = 0;
+
+  for(i = 0; i < len; i++) {
+    // At the root nothing is partly matched, so skip to a possible start
+    if(node == 0 && ac->prefilter && !strcharset_has(&ac->starts, str[i])) {
+      i += string_cspan_set(str+i, len-i, &ac->starts);
+      if(i == len) break;
+    }
+    node = delta[node * ncls + cls[(unsigned char)str[i]]];
+    if(ac->out[node])
+      n = _aho_report(ac, node, st->offset + i + 1, hits, max, n);
+  }
+
+  st->node = node;
+  st->offset += len;
+  return n;
+}
+
+size_t straho_search(const StrAho *ac, const char *str, size_t len,
+                     StrAhoMatch *hits, size_t max)
+{
+  StrAhoState st;
+  straho_state_init(&st);
+  return straho_feed(ac, &st, str, len, hits, max);
+}
+
+// Feed everything buffered, refill, repeat until EOF
+#define _func_straho_scan_buf(fname,type_t,__read)                             \
+  size_t fname(const StrAho *ac, StrAhoState *st, type_t file,                 \
+               StreamBuffer *in, StrAhoMatch *hits, size_t max)                \
+  {                                                                            \
+    size_t n = 0;                                                              \
+    if(in->begin >= in->end) { _READ_BUFFER(file,in,__read); }                 \
+    while(in->end > in->begin)                                                 \
+    {                                                                          \
+      n += straho_feed(ac, st, in->b+in->begin, in->end-in->begin,             \
+                       n < max ? hits+n : NULL, n < max ? max-n : 0);          \
+      in->begin = in->end;                                                     \
+      _READ_BUFFER(file,in,__read);                                            \
+    }                                                                          \
+    return n;                                                                  \
+  }
+
+_func_straho_scan_buf(straho_gzscan_buf,gzFile,gzread2)
+_func_straho_scan_buf(straho_fscan_buf,FILE*,fread2)
@@ -0,0 +1,90 @@
+/*
+ string_aho.h
+ project: string_buffer
+ url: https://github.com/noporpoise/StringBuffer
+ author: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain
+*/
+
+#ifndef STRING_AHO_FILE_SEEN
+#define STRING_AHO_FILE_SEEN
+
+#include "string_buffer.h"
+
+// Find many fixed patterns at once with an Aho-Corasick automaton: one pass
+// over the text whatever the number of patterns. Add the patterns, compile,
+// then search any number of strings or streams. A compiled automaton is read
+// only so can be shared between threads. Example:
+//   StrAho *ac = straho_new();
+//   straho_add_str(ac, "chr1");
+//   straho_add_str(ac, "chrX");
+//   straho_compile(ac, STRAHO_PREFILTER);
+//   StrAhoMatch hits[100];
+//   size_t i, n = straho_search_buf(ac, sb, hits, 100);
+//   for(i = 0; i < n && i < 100; i++) ... hits[i].id, hits[i].offset
+//   straho_free(ac);
+
+typedef struct StrAho StrAho;
+
+typedef struct
+{
+  size_t id; // pattern ID: 0, 1, 2, ... in the order added
+  size_t offset; // where the match starts
+} StrAhoMatch;
+
+// Search state carried between calls when feeding a stream in pieces, so
+// matches can span pieces. Offsets are from the start of the stream.
+typedef struct
+{
+  uint32_t node;
+  size_t offset; // bytes fed so far
+} StrAhoState;
+
+#define straho_state_init(st) do { (st)->node = 0; (st)->offset = 0; } while(0)
+
+// Compile flag: skip quickly (SSE2/AVX2) over bytes that cannot start a match.
+// Pays off when patterns start with only a few distinct bytes.
+#define STRAHO_PREFILTER 1
+
+// Returns NULL if out of memory
+StrAho* straho_new(void);
+void straho_free(StrAho *ac);
+
+// Add a pattern before compiling. Returns its ID. Empty patterns never match.
+// Exits if out of memory or called after straho_compile().
+size_t straho_add(StrAho *ac, const char *pattern, size_t len);
+#define straho_add_str(ac,str) straho_add(ac, str, strlen(str))
+
+// Build the automaton. flags is 0 or STRAHO_PREFILTER. Exits if out of memory.
+void straho_compile(StrAho *ac, int flags);
+
+size_t straho_num_patterns(const StrAho *ac);
+size_t straho_pattern_len(const StrAho *ac, size_t id);
+
+//
+// Searching - all matches are reported, including overlapping ones, in order
+// of where they end (longest first for the same end). The first `max` are
+// stored in `hits` and the total number is returned.
+//
+
+size_t straho_search(const StrAho *ac, const char *str, size_t len,
+                     StrAhoMatch *hits, size_t max);
+
+#define straho_search_buf(ac,sb,hits,max) \
+        straho_search(ac, (sb)->b, (sb)->end, hits, max)
+
+// Search the next piece of a stream
+size_t straho_feed(const StrAho *ac, StrAhoState *st,
+                   const char *str, size_t len,
+                   StrAhoMatch *hits, size_t max);
+
+// Search the rest of a file through a StreamBuffer, refilling as needed.
+// Check ferror/gzerror on return for error
+size_t straho_fscan_buf(const StrAho *ac, StrAhoState *st,
+                        FILE *fh, StreamBuffer *in,
+                        StrAhoMatch *hits, size_t max);
+size_t straho_gzscan_buf(const StrAho *ac, StrAhoState *st,
+                         gzFile gz, StreamBuffer *in,
+                         StrAhoMatch *hits, size_t max);
+
+#endif /* STRING_AHO_FILE_SEEN */
@@ -10,11 +10,36 @@
 // POSIX required for kill signal to work
 #define _XOPEN_SOURCE 700
 
+// mremap() is Linux only
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+  #define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h> // kill on error
 #include <ctype.h> // toupper() and tolower()
+#include <pthread.h> // buffer pool
+#include <unistd.h> // sysconf()
+#include <sys/mman.h> // mmap() for large buffers
+#include <stdint.h>
+#include <locale.h> // localeconv()
+#include <math.h> // INFINITY, NAN
+#include <float.h> // FLT_EVAL_METHOD
+
+// SSE2/AVX2 kernels are built with per-function target attributes and chosen
+// at run time, so they don't need -msse2/-mavx2. Define STRBUF_NO_SIMD to
+// build with only the portable SWAR kernels.
+#if !defined(STRBUF_NO_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+  #define STRBUF_SIMD_X86 1
+  #include <immintrin.h>
+  #define STRBUF_SSE2 __attribute__((target("sse2")))
+  #define STRBUF_AVX2 __attribute__((target("avx2")))
+#else
+  #define STRBUF_SIMD_X86 0
+#endif
 
 #include "string_buffer.h"
 
@@ -27,6 +52,10 @@
 
 #define exit_on_error() do { abort(); exit(EXIT_FAILURE); } while(0)
 
+#if defined(__linux__) && defined(MREMAP_MAYMOVE)
+  #define STRBUF_HAVE_MREMAP 1
+#endif
+
 /*********************/
 /*  Bounds checking  */
 /*********************/
@@ -67,715 +96,4183 @@ void _call_bounds_check_read_range(const StrBuf *sbuf, size_t start, size_t len,
   }
 }
 
-/******************************/
-/*  Constructors/Destructors  */
-/******************************/
+/*****************/
+/*  SIMD kernels */
+/*****************/
 
-StrBuf* strbuf_new(size_t len)
+// Byte-at-a-time loops over long strings are done 8 bytes at a time in a
+// uint64_t (SWAR), or 16/32 at a time with SSE2/AVX2. Which set of kernels is
+// used is picked at load time from the CPU, see "Kernel dispatch" below.
+
+#define SWAR_ONES  0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+
+static inline uint64_t _swar_load(const char *p) {
+  uint64_t w; memcpy(&w, p, 8); return w;
+}
+static inline void _swar_store(char *p, uint64_t w) { memcpy(p, &w, 8); }
+
+// ASCII case conversion: flip case (xor 0x20) of bytes in [lo,hi], where lo..hi
+// is 'a'..'z' or 'A'..'Z'. Bytes >= 0x80 are never changed. dst may equal src.
+
+static inline void _ascii_case_bytes(char *dst, const char *src, size_t len,
+                                     char lo, char hi)
 {
-  StrBuf *sbuf = calloc(1, sizeof(StrBuf));
-  if(!sbuf) return NULL;
-  if(!strbuf_alloc(sbuf, len)) { free(sbuf); return NULL; }
-  return sbuf;
+  size_t i;
+  for(i = 0; i < len; i++)
+    dst[i] = (src[i] >= lo && src[i] <= hi) ? (char)(src[i] ^ 0x20) : src[i];
 }
 
-StrBuf* strbuf_alloc(StrBuf *sbuf, size_t len)
+static void _ascii_case_swar(char *dst, const char *src, size_t len,
+                             char lo, char hi)
 {
-  sbuf->end  = 0;
-  sbuf->size = ROUNDUP2POW(len+1);
-  sbuf->b    = malloc(sbuf->size);
-  if(!sbuf->b) return NULL;
-  sbuf->b[0] = '\0';
-  return sbuf;
+  const uint64_t add_lo = SWAR_ONES * (uint64_t)(0x80 - lo);
+  const uint64_t add_hi = SWAR_ONES * (uint64_t)(0x7f - hi);
+  uint64_t w, a, mask;
+  for(; len >= 8; src += 8, dst += 8, len -= 8) {
+    w = _swar_load(src);
+    a = w & ~SWAR_HIGHS;
+    // high bit set in bytes >= lo, and in bytes > hi
+    mask = ((a + add_lo) ^ (a + add_hi)) & ~w & SWAR_HIGHS;
+    _swar_store(dst, w ^ (mask >> 2));
+  }
+  _ascii_case_bytes(dst, src, len, lo, hi);
 }
 
-StrBuf* strbuf_create(const char *str)
+#if STRBUF_SIMD_X86
+static STRBUF_SSE2
+void _ascii_case_sse2(char *dst, const char *src, size_t len,
+                      char lo, char hi)
 {
-  size_t str_len = strlen(str);
-  StrBuf *sbuf = strbuf_new(str_len+1);
-  if(!sbuf) return NULL;
-  memcpy(sbuf->b, str, str_len);
-  sbuf->b[sbuf->end = str_len] = '\0';
-  return sbuf;
+  // Signed compare: bytes >= 0x80 are negative so are never in range
+  const __m128i vlo = _mm_set1_epi8((char)(lo-1)), vhi = _mm_set1_epi8((char)(hi+1));
+  const __m128i flip = _mm_set1_epi8(0x20);
+  __m128i x, m;
+  for(; len >= 16; src += 16, dst += 16, len -= 16) {
+    x = _mm_loadu_si128((const __m128i*)src);
+    m = _mm_and_si128(_mm_cmpgt_epi8(x, vlo), _mm_cmplt_epi8(x, vhi));
+    _mm_storeu_si128((__m128i*)dst, _mm_xor_si128(x, _mm_and_si128(m, flip)));
+  }
+  _ascii_case_swar(dst, src, len, lo, hi);
 }
 
-StrBuf* strbuf_clone(const StrBuf *sbuf)
+static STRBUF_AVX2
+void _ascii_case_avx2(char *dst, const char *src, size_t len,
+                      char lo, char hi)
 {
-  // One byte for the string end / null char \0
-  StrBuf *cpy = strbuf_new(sbuf->end+1);
-  if(!cpy) return NULL;
-  memcpy(cpy->b, sbuf->b, sbuf->end);
-  cpy->b[cpy->end = sbuf->end] = '\0';
-  return cpy;
+  const __m256i vlo = _mm256_set1_epi8((char)(lo-1)), vhi = _mm256_set1_epi8((char)(hi+1));
+  const __m256i flip = _mm256_set1_epi8(0x20);
+  __m256i x, m;
+  for(; len >= 32; src += 32, dst += 32, len -= 32) {
+    x = _mm256_loadu_si256((const __m256i*)src);
+    m = _mm256_and_si256(_mm256_cmpgt_epi8(x, vlo), _mm256_cmpgt_epi8(vhi, x));
+    _mm256_storeu_si256((__m256i*)dst, _mm256_xor_si256(x, _mm256_and_si256(m, flip)));
+  }
+  _ascii_case_sse2(dst, src, len, lo, hi);
 }
+#endif
 
-/******************************/
-/*  Resize Buffer Functions   */
-/******************************/
+// Reverse / reverse complement: dst[i] = f(src[len-1-i]) for i in [lo,hi),
+// where lo+hi == len and f is the identity or the DNA complement.
+// Blocks are taken from both ends at once so dst may equal src.
 
-// Resize the buffer to have capacity to hold a string of length new_len
-// (+ a null terminating character).  Can also be used to downsize the buffer's
-// memory usage.  Returns 1 on success, 0 on failure.
-char strbuf_resize(StrBuf *sbuf, size_t new_len)
+// A<->T, C<->G (case preserving), everything else unchanged
+static inline char _comp_byte(char c)
 {
-  size_t capacity = ROUNDUP2POW(new_len+1);
-  char *new_buff = realloc(sbuf->b, capacity * sizeof(char));
-  if(new_buff == NULL) return 0;
-
-  sbuf->b    = new_buff;
-  sbuf->size = capacity;
+  char y = (char)(c | 0x20);
+  if(y == 'a' || y == 't') return (char)(c ^ ('A' ^ 'T'));
+  if(y == 'c' || y == 'g') return (char)(c ^ ('C' ^ 'G'));
+  return c;
+}
 
-  if(sbuf->end > new_len)
-  {
-    // Buffer was shrunk - re-add null byte
-    sbuf->end = new_len;
-    sbuf->b[sbuf->end] = '\0';
+static inline void _reverse_bytes(char *dst, const char *src,
+                                  size_t lo, size_t hi, int comp)
+{
+  char a, b;
+  for(; lo + 1 < hi; lo++, hi--) {
+    a = src[lo]; b = src[hi-1];
+    dst[lo] = comp ? _comp_byte(b) : b;
+    dst[hi-1] = comp ? _comp_byte(a) : a;
   }
-
-  return 1;
+  if(lo + 1 == hi) dst[lo] = comp ? _comp_byte(src[lo]) : src[lo];
 }
 
-void strbuf_ensure_capacity_update_ptr(StrBuf *sbuf, size_t size, const char **ptr)
+// high bit set in each byte of w equal to c
+static inline uint64_t _swar_eq(uint64_t w, unsigned char c)
 {
-  if(sbuf->size <= size+1)
-  {
-    size_t oldcap = sbuf->size;
-    char *oldbuf  = sbuf->b;
+  uint64_t t = w ^ (SWAR_ONES * c);
+  return ~(((t & ~SWAR_HIGHS) + ~SWAR_HIGHS) | t) & SWAR_HIGHS;
+}
 
-    if(!strbuf_resize(sbuf, size))
-    {
-      fprintf(stderr, "%s:%i:Error: _ensure_capacity_update_ptr couldn't resize "
-                      "buffer. [requested %zu bytes; capacity: %zu bytes]\n",
-              __FILE__, __LINE__, size, sbuf->size);
-      exit_on_error();
-    }
+static inline uint64_t _swar_comp(uint64_t w)
+{
+  uint64_t y = w | (SWAR_ONES * 0x20);
+  uint64_t at = _swar_eq(y, 'a') | _swar_eq(y, 't');
+  uint64_t cg = _swar_eq(y, 'c') | _swar_eq(y, 'g');
+  return w ^ ((at >> 7) * ('A' ^ 'T')) ^ ((cg >> 7) * ('C' ^ 'G'));
+}
 
-    // ptr may have pointed to sbuf, which has now moved
-    if(*ptr >= oldbuf && *ptr < oldbuf + oldcap) {
-      *ptr = sbuf->b + (*ptr - oldbuf);
-    }
+static void _reverse_swar(char *dst, const char *src,
+                          size_t lo, size_t hi, int comp)
+{
+  uint64_t a, b;
+  for(; lo + 16 <= hi; lo += 8, hi -= 8) {
+    a = __builtin_bswap64(_swar_load(src+lo));
+    b = __builtin_bswap64(_swar_load(src+hi-8));
+    if(comp) { a = _swar_comp(a); b = _swar_comp(b); }
+    _swar_store(dst+lo, b);
+    _swar_store(dst+hi-8, a);
   }
+  _reverse_bytes(dst, src, lo, hi, comp);
 }
 
-/*******************/
-/* Append Integers */
-/*******************/
-
-/*
- * Integer to string functions adapted from:
- *   https://www.facebook.com/notes/facebook-engineering/three-optimization-tips-for-c/10151361643253920
- */
+#if STRBUF_SIMD_X86
+static inline STRBUF_SSE2
+__m128i _sse2_bswap(__m128i x)
+{
+  x = _mm_shuffle_epi32(x, _MM_SHUFFLE(0,1,2,3));
+  x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2,3,0,1));
+  x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2,3,0,1));
+  return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
 
-#define P01 10
-#define P02 100
-#define P03 1000
-#define P04 10000
-#define P05 100000
-#define P06 1000000
-#define P07 10000000
-#define P08 100000000
-#define P09 1000000000
-#define P10 10000000000
-#define P11 100000000000
-#define P12 1000000000000
+static inline STRBUF_SSE2
+__m128i _sse2_comp(__m128i x)
+{
+  __m128i y = _mm_or_si128(x, _mm_set1_epi8(0x20));
+  __m128i at = _mm_or_si128(_mm_cmpeq_epi8(y, _mm_set1_epi8('a')),
+                            _mm_cmpeq_epi8(y, _mm_set1_epi8('t')));
+  __m128i cg = _mm_or_si128(_mm_cmpeq_epi8(y, _mm_set1_epi8('c')),
+                            _mm_cmpeq_epi8(y, _mm_set1_epi8('g')));
+  x = _mm_xor_si128(x, _mm_and_si128(at, _mm_set1_epi8('A' ^ 'T')));
+  return _mm_xor_si128(x, _mm_and_si128(cg, _mm_set1_epi8('C' ^ 'G')));
+}
 
-/**
- * Return number of digits required to represent `num` in base 10.
- * Uses binary search to find number.
- * Examples:
- *   num_of_digits(0)   = 1
- *   num_of_digits(1)   = 1
- *   num_of_digits(10)  = 2
- *   num_of_digits(123) = 3
- */
-static inline size_t num_of_digits(unsigned long v)
+static STRBUF_SSE2
+void _reverse_sse2(char *dst, const char *src,
+                   size_t lo, size_t hi, int comp)
 {
-  if(v < P01) return 1;
-  if(v < P02) return 2;
-  if(v < P03) return 3;
-  if(v < P12) {
-    if(v < P08) {
-      if(v < P06) {
-        if(v < P04) return 4;
-        return 5 + (v >= P05);
-      }
-      return 7 + (v >= P07);
-    }
-    if(v < P10) {
-      return 9 + (v >= P09);
-    }
-    return 11 + (v >= P11);
+  __m128i a, b;
+  for(; lo + 32 <= hi; lo += 16, hi -= 16) {
+    a = _sse2_bswap(_mm_loadu_si128((const __m128i*)(src+lo)));
+    b = _sse2_bswap(_mm_loadu_si128((const __m128i*)(src+hi-16)));
+    if(comp) { a = _sse2_comp(a); b = _sse2_comp(b); }
+    _mm_storeu_si128((__m128i*)(dst+lo), b);
+    _mm_storeu_si128((__m128i*)(dst+hi-16), a);
   }
-  return 12 + num_of_digits(v / P12);
+  _reverse_swar(dst, src, lo, hi, comp);
 }
 
-void strbuf_append_ulong(StrBuf *buf, unsigned long value)
+static inline STRBUF_AVX2
+__m256i _avx2_bswap(__m256i x)
 {
-  // Append two digits at a time
-  static const char digits[201] =
-    "0001020304050607080910111213141516171819"
-    "2021222324252627282930313233343536373839"
-    "4041424344454647484950515253545556575859"
-    "6061626364656667686970717273747576777879"
-    "8081828384858687888990919293949596979899";
-
-  size_t num_digits = num_of_digits(value);
-  size_t pos = num_digits - 1;
+  const __m256i idx = _mm256_setr_epi8(15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0,
+                                       15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0);
+  return _mm256_permute4x64_epi64(_mm256_shuffle_epi8(x, idx), 0x4e);
+}
 
-  strbuf_ensure_capacity(buf, buf->end+num_digits);
-  char *dst = buf->b + buf->end;
+static inline STRBUF_AVX2
+__m256i _avx2_comp(__m256i x)
+{
+  __m256i y = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+  __m256i at = _mm256_or_si256(_mm256_cmpeq_epi8(y, _mm256_set1_epi8('a')),
+                               _mm256_cmpeq_epi8(y, _mm256_set1_epi8('t')));
+  __m256i cg = _mm256_or_si256(_mm256_cmpeq_epi8(y, _mm256_set1_epi8('c')),
+                               _mm256_cmpeq_epi8(y, _mm256_set1_epi8('g')));
+  x = _mm256_xor_si256(x, _mm256_and_si256(at, _mm256_set1_epi8('A' ^ 'T')));
+  return _mm256_xor_si256(x, _mm256_and_si256(cg, _mm256_set1_epi8('C' ^ 'G')));
+}
 
-  while(value >= 100)
-  {
-    size_t v = value % 100;
-    value /= 100;
-    dst[pos] = digits[v * 2 + 1];
-    dst[pos - 1] = digits[v * 2];
-    pos -= 2;
+static STRBUF_AVX2
+void _reverse_avx2(char *dst, const char *src,
+                   size_t lo, size_t hi, int comp)
+{
+  __m256i a, b;
+  for(; lo + 64 <= hi; lo += 32, hi -= 32) {
+    a = _avx2_bswap(_mm256_loadu_si256((const __m256i*)(src+lo)));
+    b = _avx2_bswap(_mm256_loadu_si256((const __m256i*)(src+hi-32)));
+    if(comp) { a = _avx2_comp(a); b = _avx2_comp(b); }
+    _mm256_storeu_si256((__m256i*)(dst+lo), b);
+    _mm256_storeu_si256((__m256i*)(dst+hi-32), a);
   }
+  _reverse_sse2(dst, src, lo, hi, comp);
+}
+#endif
 
-  // Handle last 1-2 digits
-  if(value < 10) {
-    dst[pos] = '0' + value;
-  } else {
-    dst[pos] = digits[value * 2 + 1];
-    dst[pos - 1] = digits[value * 2];
-  }
+// Whitespace spans: number of leading / trailing bytes that are whitespace in
+// the C locale (' ', \t, \n, \v, \f, \r), i.e. ' ' or 9..13.
+// Vector versions compare a block at a time and locate the first byte that is
+// not whitespace from the movemask.
 
-  buf->end += num_digits;
-  buf->b[buf->end] = '\0';
+static inline int _is_space(char c)
+{
+  return c == ' ' || (unsigned char)(c - 9) < 5;
 }
 
-void strbuf_append_int(StrBuf *buf, int value)
+static inline size_t _span_space_bytes(const char *s, size_t len)
 {
-  // strbuf_sprintf(buf, "%i", value);
-  strbuf_append_long(buf, value);
+  size_t i = 0;
+  while(i < len && _is_space(s[i])) i++;
+  return i;
 }
 
-void strbuf_append_long(StrBuf *buf, long value)
+static inline size_t _rspan_space_bytes(const char *s, size_t len)
 {
-  // strbuf_sprintf(buf, "%li", value);
-  if(value < 0) { strbuf_append_char(buf, '-'); value = -value; }
-  strbuf_append_ulong(buf, value);
+  size_t i = len;
+  while(i > 0 && _is_space(s[i-1])) i--;
+  return len - i;
 }
 
-
-/*
-size_t strbuf_num_of_digits(unsigned long num)
+// high bit set in each byte of w that is whitespace
+static inline uint64_t _swar_space(uint64_t w)
 {
-  size_t digits = 1;
-  while(1) {
-    if(num < 10) return digits;
-    if(num < 100) return digits+1;
-    if(num < 1000) return digits+2;
-    if(num < 10000) return digits+3;
-    num /= 10000;
-    digits += 4;
-  }
-  return digits;
+  const uint64_t add_lo = SWAR_ONES * (0x80 - 9), add_hi = SWAR_ONES * (0x7f - 13);
+  uint64_t a = w & ~SWAR_HIGHS;
+  uint64_t range = ((a + add_lo) ^ (a + add_hi)) & ~w & SWAR_HIGHS;
+  return range | _swar_eq(w, ' ');
 }
 
-void strbuf_append_ulong(StrBuf *buf, unsigned long value)
+// Stop at the first word containing a non-space and finish bytewise, so this
+// doesn't depend on byte order
+static size_t _span_space_swar(const char *s, size_t len)
 {
-  // strbuf_sprintf(buf, "%lu", value);
-
-  size_t i, num_digits = strbuf_num_of_digits(value);
-  strbuf_ensure_capacity(buf, buf->end + num_digits);
-  buf->end += num_digits;
-  buf->b[buf->end] = '\0';
-
-  for(i = 1; i <= num_digits; i++) {
-    buf->b[buf->end - i] = '0' + (value % 10);
-    value /= 10;
-  }
+  size_t i = 0;
+  for(; i + 8 <= len && _swar_space(_swar_load(s+i)) == SWAR_HIGHS; i += 8) {}
+  return i + _span_space_bytes(s+i, len-i);
 }
-*/
 
-/********************/
-/* Append functions */
-/********************/
+static size_t _rspan_space_swar(const char *s, size_t len)
+{
+  size_t i = len;
+  for(; i >= 8 && _swar_space(_swar_load(s+i-8)) == SWAR_HIGHS; i -= 8) {}
+  return len - i + _rspan_space_bytes(s, i);
+}
 
-// Append string converted to lowercase
-void strbuf_append_strn_lc(StrBuf *buf, const char *str, size_t len)
+#if STRBUF_SIMD_X86
+// bit i set if byte i of s[0..15] is whitespace
+static inline STRBUF_SSE2
+unsigned _sse2_space_mask(const char *s)
 {
-  strbuf_ensure_capacity(buf, buf->end + len);
-  char *to = buf->b + buf->end;
-  const char *end = str + len;
-  for(; str < end; str++, to++) *to = tolower(*str);
-  buf->end += len;
-  buf->b[buf->end] = '\0';
+  __m128i x = _mm_loadu_si128((const __m128i*)s);
+  __m128i t = _mm_sub_epi8(x, _mm_set1_epi8(9));
+  __m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+                           _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t));
+  return (unsigned)_mm_movemask_epi8(m);
 }
 
-// Append string converted to uppercase
-void strbuf_append_strn_uc(StrBuf *buf, const char *str, size_t len)
+static STRBUF_SSE2
+size_t _span_space_sse2(const char *s, size_t len)
 {
-  strbuf_ensure_capacity(buf, buf->end + len);
-  char *to = buf->b + buf->end;
-  const char *end = str + len;
-  for(; str < end; str++, to++) *to = toupper(*str);
-  buf->end += len;
-  buf->b[buf->end] = '\0';
+  size_t i;
+  unsigned m;
+  for(i = 0; i + 16 <= len; i += 16)
+    if((m = _sse2_space_mask(s+i)) != 0xffff)
+      return i + __builtin_ctz(~m);
+  return i + _span_space_swar(s+i, len-i);
 }
 
-// Append char `c` `n` times
-void strbuf_append_charn(StrBuf *buf, char c, size_t n)
+static STRBUF_SSE2
+size_t _rspan_space_sse2(const char *s, size_t len)
 {
-  strbuf_ensure_capacity(buf, buf->end + n);
-  memset(buf->b+buf->end, c, n);
-  buf->end += n;
-  buf->b[buf->end] = '\0';
+  size_t i;
+  unsigned m;
+  for(i = len; i >= 16; i -= 16)
+    if((m = _sse2_space_mask(s+i-16)) != 0xffff)
+      return len - i + __builtin_clz((~m & 0xffff) << 16);
+  return len - i + _rspan_space_swar(s, i);
 }
 
-// Remove \r and \n characters from the end of this StrBuf
-// Returns the number of characters removed
-size_t strbuf_chomp(StrBuf *sbuf)
+static inline STRBUF_AVX2
+unsigned _avx2_space_mask(const char *s)
 {
-  size_t old_len = sbuf->end;
-  sbuf->end = string_chomp(sbuf->b, sbuf->end);
-  return old_len - sbuf->end;
+  __m256i x = _mm256_loadu_si256((const __m256i*)s);
+  __m256i t = _mm256_sub_epi8(x, _mm256_set1_epi8(9));
+  __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')),
+                              _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(4)), t));
+  return (unsigned)_mm256_movemask_epi8(m);
 }
 
-// Reverse a string
-void strbuf_reverse(StrBuf *sbuf)
+static STRBUF_AVX2
+size_t _span_space_avx2(const char *s, size_t len)
 {
-  string_reverse_region(sbuf->b, sbuf->end);
+  size_t i;
+  unsigned m;
+  for(i = 0; i + 32 <= len; i += 32)
+    if((m = _avx2_space_mask(s+i)) != 0xffffffffU)
+      return i + __builtin_ctz(~m);
+  return i + _span_space_sse2(s+i, len-i);
 }
 
-char* strbuf_substr(const StrBuf *sbuf, size_t start, size_t len)
+static STRBUF_AVX2
+size_t _rspan_space_avx2(const char *s, size_t len)
 {
-  _bounds_check_read_range(sbuf, start, len);
+  size_t i;
+  unsigned m;
+  for(i = len; i >= 32; i -= 32)
+    if((m = _avx2_space_mask(s+i-32)) != 0xffffffffU)
+      return len - i + __builtin_clz(~m);
+  return len - i + _rspan_space_sse2(s, i);
+}
+#endif
 
-  char *new_string = malloc((len+1) * sizeof(char));
-  strncpy(new_string, sbuf->b + start, len);
-  new_string[len] = '\0';
+// Count / replace occurrences of a char. Vector versions accumulate compare
+// results bytewise (at most 255 blocks) then sum them with psadbw.
 
-  return new_string;
+static inline size_t _count_char_bytes(const char *s, size_t len, char c)
+{
+  size_t i, n = 0;
+  for(i = 0; i < len; i++) n += (s[i] == c);
+  return n;
 }
 
-void strbuf_to_uppercase(StrBuf *sbuf)
+static size_t _count_char_swar(const char *s, size_t len, char c)
 {
-  char *pos, *end = sbuf->b + sbuf->end;
-  for(pos = sbuf->b; pos < end; pos++) *pos = (char)toupper(*pos);
+  size_t n = 0;
+  for(; len >= 8; s += 8, len -= 8)
+    n += __builtin_popcountll(_swar_eq(_swar_load(s), (unsigned char)c));
+  return n + _count_char_bytes(s, len, c);
 }
 
-void strbuf_to_lowercase(StrBuf *sbuf)
+static inline size_t _replace_char_bytes(char *s, size_t len, char from, char to)
 {
-  char *pos, *end = sbuf->b + sbuf->end;
-  for(pos = sbuf->b; pos < end; pos++) *pos = (char)tolower(*pos);
+  size_t i, n = 0;
+  for(i = 0; i < len; i++)
+    if(s[i] == from) { s[i] = to; n++; }
+  return n;
 }
 
-// Copy a string to this StrBuf, overwriting any existing characters
-// Note: dst_pos + len can be longer the the current dst StrBuf
-void strbuf_copy(StrBuf *dst, size_t dst_pos, const char *src, size_t len)
+static size_t _replace_char_swar(char *s, size_t len, char from, char to)
 {
-  if(src == NULL || len == 0) return;
-
-  _bounds_check_insert(dst, dst_pos);
-
-  // Check if dst buffer can handle string
-  // src may have pointed to dst, which has now moved
-  size_t newlen = MAX(dst_pos + len, dst->end);
-  strbuf_ensure_capacity_update_ptr(dst, newlen, &src);
-
-  // memmove instead of strncpy, as it can handle overlapping regions
-  memmove(dst->b+dst_pos, src, len * sizeof(char));
+  const uint64_t vto = SWAR_ONES * (unsigned char)to;
+  uint64_t w, m, full;
+  size_t n = 0;
+  for(; len >= 8; s += 8, len -= 8) {
+    w = _swar_load(s);
+    if((m = _swar_eq(w, (unsigned char)from)) != 0) {
+      full = (m >> 7) * 0xff;
+      _swar_store(s, (w & ~full) | (vto & full));
+      n += __builtin_popcountll(m);
+    }
+  }
+  return n + _replace_char_bytes(s, len, from, to);
+}
 
-  if(dst_pos + len > dst->end)
-  {
-    // Extended string - add '\0' char
-    dst->end = dst_pos + len;
-    dst->b[dst->end] = '\0';
+#if STRBUF_SIMD_X86
+static STRBUF_SSE2
+size_t _count_char_sse2(const char *s, size_t len, char c)
+{
+  const __m128i vc = _mm_set1_epi8(c), zero = _mm_setzero_si128();
+  __m128i acc, sum;
+  size_t n = 0, blocks, k;
+  while(len >= 16) {
+    blocks = MIN(len / 16, 255);
+    acc = zero;
+    for(k = 0; k < blocks; k++, s += 16)
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)s), vc));
+    len -= blocks * 16;
+    sum = _mm_sad_epu8(acc, zero);
+    n += (size_t)_mm_cvtsi128_si32(sum) +
+         (size_t)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
   }
+  return n + _count_char_swar(s, len, c);
 }
 
-// Insert: copy to a StrBuf, shifting any existing characters along
-void strbuf_insert(StrBuf *dst, size_t dst_pos, const char *src, size_t len)
+static STRBUF_SSE2
+size_t _replace_char_sse2(char *s, size_t len, char from, char to)
 {
-  if(src == NULL || len == 0) return;
+  const __m128i vfrom = _mm_set1_epi8(from), vto = _mm_set1_epi8(to);
+  __m128i x, m;
+  unsigned bits;
+  size_t n = 0;
+  for(; len >= 16; s += 16, len -= 16) {
+    x = _mm_loadu_si128((const __m128i*)s);
+    m = _mm_cmpeq_epi8(x, vfrom);
+    if((bits = (unsigned)_mm_movemask_epi8(m)) != 0) {
+      x = _mm_or_si128(_mm_andnot_si128(m, x), _mm_and_si128(m, vto));
+      _mm_storeu_si128((__m128i*)s, x);
+      n += __builtin_popcount(bits);
+    }
+  }
+  return n + _replace_char_swar(s, len, from, to);
+}
 
-  _bounds_check_insert(dst, dst_pos);
+static inline STRBUF_AVX2
+size_t _avx2_sum_bytes(__m256i acc)
+{
+  __m256i sum = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+  __m128i s2 = _mm_add_epi64(_mm256_castsi256_si128(sum),
+                             _mm256_extracti128_si256(sum, 1));
+  return (size_t)_mm_cvtsi128_si32(s2) +
+         (size_t)_mm_cvtsi128_si32(_mm_srli_si128(s2, 8));
+}
 
-  // Check if dst buffer has capacity for inserted string plus \0
-  // src may have pointed to dst, which will be moved in realloc when
-  // calling ensure capacity
-  strbuf_ensure_capacity_update_ptr(dst, dst->end + len, &src);
+static STRBUF_AVX2
+size_t _count_char_avx2(const char *s, size_t len, char c)
+{
+  const __m256i vc = _mm256_set1_epi8(c);
+  __m256i acc;
+  size_t n = 0, blocks, k;
+  while(len >= 32) {
+    blocks = MIN(len / 32, 255);
+    acc = _mm256_setzero_si256();
+    for(k = 0; k < blocks; k++, s += 32)
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)s), vc));
+    len -= blocks * 32;
+    n += _avx2_sum_bytes(acc);
+  }
+  return n + _count_char_sse2(s, len, c);
+}
 
-  char *insert = dst->b+dst_pos;
+static STRBUF_AVX2
+size_t _replace_char_avx2(char *s, size_t len, char from, char to)
+{
+  const __m256i vfrom = _mm256_set1_epi8(from), vto = _mm256_set1_epi8(to);
+  __m256i x, m;
+  unsigned bits;
+  size_t n = 0;
+  for(; len >= 32; s += 32, len -= 32) {
+    x = _mm256_loadu_si256((const __m256i*)s);
+    m = _mm256_cmpeq_epi8(x, vfrom);
+    if((bits = (unsigned)_mm256_movemask_epi8(m)) != 0) {
+      _mm256_storeu_si256((__m256i*)s, _mm256_blendv_epi8(x, vto, m));
+      n += __builtin_popcount(bits);
+    }
+  }
+  return n + _replace_char_sse2(s, len, from, to);
+}
+#endif
 
-  // dst_pos could be at the end (== dst->end)
-  if(dst_pos < dst->end)
-  {
-    // Shift some characters up
-    memmove(insert + len, insert, (dst->end - dst_pos) * sizeof(char));
+// Count / replace members of a StrCharSet. With AVX2 the 256-bit bitmap is
+// turned into two 16-entry tables indexed by the low nibble (one for bytes
+// < 0x80, one for >= 0x80), giving a byte with bit (hi nibble & 7) set for
+// each member. Otherwise one bitmap lookup per byte.
 
-    if(src >= dst->b && src < dst->b + dst->size)
-    {
-      // src/dst strings point to the same string in memory
-      if(src < insert) memmove(insert, src, len * sizeof(char));
-      else if(src > insert) memmove(insert, src+len, len * sizeof(char));
+static size_t _count_set_bytes(const char *s, size_t len,
+                               const StrCharSet *set)
+{
+  size_t i, n = 0;
+  for(i = 0; i < len; i++) n += strcharset_has(set, s[i]);
+  return n;
+}
+
+static size_t _replace_set_bytes(char *s, size_t len,
+                                 const StrCharSet *set, char to)
+{
+  size_t i, n = 0;
+  for(i = 0; i < len; i++)
+    if(strcharset_has(set, s[i])) { s[i] = to; n++; }
+  return n;
+}
+
+#if STRBUF_SIMD_X86
+typedef struct { __m256i lo_tbl, hi_tbl; } SetTables;
+
+static inline STRBUF_AVX2
+SetTables _avx2_set_tables(const StrCharSet *set)
+{
+  uint8_t lo[16] = {0}, hi[16] = {0};
+  uint64_t w;
+  int i, c;
+  // Visit set members only so this is cheap for small sets
+  for(i = 0; i < 4; i++) {
+    for(w = set->bits[i]; w; w &= w - 1) {
+      c = i * 64 + __builtin_ctzll(w);
+      if(c < 0x80) lo[c & 15] |= (uint8_t)(1 << (c >> 4));
+      else         hi[c & 15] |= (uint8_t)(1 << ((c >> 4) & 7));
     }
-    else memmove(insert, src, len * sizeof(char));
   }
-  else memmove(insert, src, len * sizeof(char));
+  SetTables t;
+  t.lo_tbl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lo));
+  t.hi_tbl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)hi));
+  return t;
+}
 
-  // Update size
-  dst->end += len;
-  dst->b[dst->end] = '\0';
+// 0xff in each byte of x that is in the set
+static inline STRBUF_AVX2
+__m256i _avx2_set_mask(__m256i x, const SetTables *t)
+{
+  const __m256i nib = _mm256_set1_epi8(0x0f);
+  const __m256i bits = _mm256_setr_epi8(1,2,4,8,16,32,64,-128,1,2,4,8,16,32,64,-128,
+                                        1,2,4,8,16,32,64,-128,1,2,4,8,16,32,64,-128);
+  __m256i lo = _mm256_and_si256(x, nib);
+  __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nib);
+  __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(t->lo_tbl, lo),
+                                   _mm256_shuffle_epi8(t->hi_tbl, lo), x);
+  __m256i bit = _mm256_shuffle_epi8(bits, hi);
+  return _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit);
 }
 
-// Overwrite dst_pos..(dst_pos+dst_len-1) with src_len chars from src
-// if dst_len != src_len, content to the right of dst_len is shifted
-// Example:
-//   strbuf_set(sbuf, "aaabbccc");
-//   char *data = "xxx";
-//   strbuf_overwrite(sbuf,3,2,data,strlen(data));
-//   // sbuf is now "aaaxxxccc"
-//   strbuf_overwrite(sbuf,3,2,"_",1);
-//   // sbuf is now "aaa_ccc"
-void strbuf_overwrite(StrBuf *dst, size_t dst_pos, size_t dst_len,
-                      const char *src, size_t src_len)
+static STRBUF_AVX2
+size_t _count_set_avx2(const char *s, size_t len, const StrCharSet *set)
 {
-  _bounds_check_read_range(dst, dst_pos, dst_len);
+  size_t n = 0, blocks, k;
+  __m256i acc;
+  SetTables t = _avx2_set_tables(set);
+  while(len >= 32) {
+    blocks = MIN(len / 32, 255);
+    acc = _mm256_setzero_si256();
+    for(k = 0; k < blocks; k++, s += 32)
+      acc = _mm256_sub_epi8(acc, _avx2_set_mask(_mm256_loadu_si256((const __m256i*)s), &t));
+    len -= blocks * 32;
+    n += _avx2_sum_bytes(acc);
+  }
+  return n + _count_set_bytes(s, len, set);
+}
 
-  if(src == NULL) return;
-  if(dst_len == src_len) strbuf_copy(dst, dst_pos, src, src_len);
-  size_t newlen = dst->end + src_len - dst_len;
+static STRBUF_AVX2
+size_t _replace_set_avx2(char *s, size_t len, const StrCharSet *set, char to)
+{
+  SetTables t = _avx2_set_tables(set);
+  const __m256i vto = _mm256_set1_epi8(to);
+  __m256i x, m;
+  unsigned bits;
+  size_t n = 0;
+  for(; len >= 32; s += 32, len -= 32) {
+    x = _mm256_loadu_si256((const __m256i*)s);
+    m = _avx2_set_mask(x, &t);
+    if((bits = (unsigned)_mm256_movemask_epi8(m)) != 0) {
+      _mm256_storeu_si256((__m256i*)s, _mm256_blendv_epi8(x, vto, m));
+      n += __builtin_popcount(bits);
+    }
+  }
+  return n + _replace_set_bytes(s, len, set, to);
+}
+#endif
 
-  strbuf_ensure_capacity_update_ptr(dst, newlen, &src);
+// Offsets of each byte equal to c / in a set, for splitting in one pass.
+// Kernels scan s[i..len-1] having already found n matches, and return the
+// total found. Only the first max are stored.
 
-  if(src >= dst->b && src < dst->b + dst->size)
-  {
-    if(src_len < dst_len) {
-      // copy
-      memmove(dst->b+dst_pos, src, src_len * sizeof(char));
-      // resize (shrink)
-      memmove(dst->b+dst_pos+src_len, dst->b+dst_pos+dst_len,
-              (dst->end-dst_pos-dst_len) * sizeof(char));
-    }
-    else
-    {
-      // Buffer is going to grow and src points to this buffer
+static inline size_t _add_offset(size_t *offsets, size_t max, size_t n, size_t i)
+{
+  if(n < max) offsets[n] = i;
+  return n + 1;
+}
 
-      // resize (grow)
-      memmove(dst->b+dst_pos+src_len, dst->b+dst_pos+dst_len,
-              (dst->end-dst_pos-dst_len) * sizeof(char));
+static size_t _char_offsets_bytes(const char *s, size_t i, size_t len, char c,
+                                  size_t *offsets, size_t max, size_t n)
+{
+  for(; i < len; i++)
+    if(s[i] == c) n = _add_offset(offsets, max, n, i);
+  return n;
+}
 
-      char *tgt = dst->b + dst_pos;
-      char *end = dst->b + dst_pos + src_len;
+static size_t _char_offsets_swar(const char *s, size_t i, size_t len, char c,
+                                 size_t *offsets, size_t max, size_t n)
+{
+  for(; i + 8 <= len; i += 8)
+    if(_swar_eq(_swar_load(s+i), (unsigned char)c))
+      n = _char_offsets_bytes(s, i, i+8, c, offsets, max, n);
+  return _char_offsets_bytes(s, i, len, c, offsets, max, n);
+}
 
-      if(src < tgt + dst_len)
-      {
-        size_t len = MIN((size_t)(end - src), src_len);
-        memmove(tgt, src, len);
-        tgt += len;
-        src += len;
-        src_len -= len;
-      }
+static size_t _set_offsets_bytes(const char *s, size_t i, size_t len,
+                                 const StrCharSet *set,
+                                 size_t *offsets, size_t max, size_t n)
+{
+  for(; i < len; i++)
+    if(strcharset_has(set, s[i])) n = _add_offset(offsets, max, n, i);
+  return n;
+}
 
-      if(src >= tgt + dst_len)
-      {
-        // shift to account for resizing
-        src += src_len - dst_len;
-        memmove(tgt, src, src_len);
-      }
+// Number of leading bytes not in the set
+static size_t _cspan_set_bytes(const char *s, size_t len, const StrCharSet *set)
+{
+  size_t i = 0;
+  while(i < len && !strcharset_has(set, s[i])) i++;
+  return i;
+}
+
+// Number of leading / trailing bytes in the set
+static size_t _span_set_bytes(const char *s, size_t len, const StrCharSet *set)
+{
+  size_t i = 0;
+  while(i < len && strcharset_has(set, s[i])) i++;
+  return i;
+}
+
+static size_t _rspan_set_bytes(const char *s, size_t len, const StrCharSet *set)
+{
+  size_t i = len;
+  while(i > 0 && strcharset_has(set, s[i-1])) i--;
+  return len - i;
+}
+
+#if STRBUF_SIMD_X86
+static STRBUF_SSE2
+size_t _char_offsets_sse2(const char *s, size_t i, size_t len, char c,
+                          size_t *offsets, size_t max, size_t n)
+{
+  const __m128i vc = _mm_set1_epi8(c);
+  unsigned m;
+  for(; i + 16 <= len; i += 16) {
+    m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(s+i)), vc));
+    for(; m; m &= m - 1) n = _add_offset(offsets, max, n, i + __builtin_ctz(m));
+  }
+  return _char_offsets_swar(s, i, len, c, offsets, max, n);
+}
+
+static STRBUF_AVX2
+size_t _char_offsets_avx2(const char *s, size_t i, size_t len, char c,
+                          size_t *offsets, size_t max, size_t n)
+{
+  const __m256i vc = _mm256_set1_epi8(c);
+  unsigned m;
+  for(; i + 32 <= len; i += 32) {
+    m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(s+i)), vc));
+    for(; m; m &= m - 1) n = _add_offset(offsets, max, n, i + __builtin_ctz(m));
+  }
+  return _char_offsets_sse2(s, i, len, c, offsets, max, n);
+}
+
+static STRBUF_AVX2
+size_t _set_offsets_avx2(const char *s, size_t i, size_t len,
+                         const StrCharSet *set,
+                         size_t *offsets, size_t max, size_t n)
+{
+  if(i + 32 <= len) {
+    SetTables t = _avx2_set_tables(set);
+    unsigned m;
+    for(; i + 32 <= len; i += 32) {
+      m = (unsigned)_mm256_movemask_epi8(_avx2_set_mask(_mm256_loadu_si256((const __m256i*)(s+i)), &t));
+      for(; m; m &= m - 1) n = _add_offset(offsets, max, n, i + __builtin_ctz(m));
     }
   }
-  else
-  {
-    // resize
-    memmove(dst->b+dst_pos+src_len, dst->b+dst_pos+dst_len,
-            (dst->end-dst_pos-dst_len) * sizeof(char));
-    // copy
-    memcpy(dst->b+dst_pos, src, src_len * sizeof(char));
+  return _set_offsets_bytes(s, i, len, set, offsets, max, n);
+}
+
+static STRBUF_AVX2
+size_t _cspan_set_avx2(const char *s, size_t len, const StrCharSet *set)
+{
+  size_t i = 0;
+  // Building the tables isn't worth it for short strings
+  if(len >= 64) {
+    SetTables t = _avx2_set_tables(set);
+    unsigned m;
+    for(; i + 32 <= len; i += 32) {
+      m = (unsigned)_mm256_movemask_epi8(_avx2_set_mask(_mm256_loadu_si256((const __m256i*)(s+i)), &t));
+      if(m) return i + __builtin_ctz(m);
+    }
   }
+  return i + _cspan_set_bytes(s+i, len-i, set);
+}
 
-  dst->end = newlen;
-  dst->b[dst->end] = '\0';
+static STRBUF_AVX2
+size_t _span_set_avx2(const char *s, size_t len, const StrCharSet *set)
+{
+  size_t i = 0;
+  // Trims usually stop at the first byte, before the tables are worth building
+  if(len >= 64 && strcharset_has(set, s[0])) {
+    SetTables t = _avx2_set_tables(set);
+    unsigned m;
+    for(; i + 32 <= len; i += 32) {
+      m = ~(unsigned)_mm256_movemask_epi8(_avx2_set_mask(_mm256_loadu_si256((const __m256i*)(s+i)), &t));
+      if(m) return i + __builtin_ctz(m);
+    }
+  }
+  return i + _span_set_bytes(s+i, len-i, set);
 }
 
-void strbuf_delete(StrBuf *sbuf, size_t pos, size_t len)
+static STRBUF_AVX2
+size_t _rspan_set_avx2(const char *s, size_t len, const StrCharSet *set)
 {
-  _bounds_check_read_range(sbuf, pos, len);
-  memmove(sbuf->b+pos, sbuf->b+pos+len, sbuf->end-pos-len);
-  sbuf->end -= len;
-  sbuf->b[sbuf->end] = '\0';
+  size_t i = len;
+  if(len >= 64 && strcharset_has(set, s[len-1])) {
+    SetTables t = _avx2_set_tables(set);
+    unsigned m;
+    for(; i >= 32; i -= 32) {
+      m = ~(unsigned)_mm256_movemask_epi8(_avx2_set_mask(_mm256_loadu_si256((const __m256i*)(s+i-32)), &t));
+      if(m) return len - i + __builtin_clz(m);
+    }
+  }
+  return len - i + _rspan_set_bytes(s, i, set);
 }
+#endif
 
-/**************************/
-/*         sprintf        */
-/**************************/
+// Substring search. Needles of up to FIND_FILTER_MAX bytes use a filter on the
+// first and last bytes of the needle: compare a block of candidate start
+// positions at once and only memcmp() where both match. Longer needles use
+// Horspool, which can skip up to the needle length per step.
+// Needles here are not empty and not longer than the haystack.
 
-int strbuf_vsprintf(StrBuf *sbuf, size_t pos, const char *fmt, va_list argptr)
+#define FIND_FILTER_MAX 32
+
+// Compare the middle of the needle once the first and last bytes match
+static inline int _find_mid(const char *h, const char *n, size_t nlen)
 {
-  _bounds_check_insert(sbuf, pos);
+  return nlen <= 2 || memcmp(h+1, n+1, nlen-2) == 0;
+}
 
-  // Length of remaining buffer
-  size_t buf_len = sbuf->size - pos;
-  if(buf_len == 0 && !strbuf_resize(sbuf, sbuf->size << 1)) {
-    fprintf(stderr, "%s:%i:Error: Out of memory\n", __FILE__, __LINE__);
-    exit_on_error();
+static inline int _find_match(const char *h, const char *n, size_t nlen)
+{
+  return h[0] == n[0] && h[nlen-1] == n[nlen-1] && _find_mid(h, n, nlen);
+}
+
+// First match starting in [i, hlen-nlen]
+static size_t _find_bytes(const char *h, size_t i, size_t hlen,
+                          const char *n, size_t nlen)
+{
+  const char *hit;
+  while(i + nlen <= hlen) {
+    if((hit = memchr(h+i, n[0], hlen - nlen + 1 - i)) == NULL) break;
+    i = (size_t)(hit - h);
+    if(_find_match(h+i, n, nlen)) return i;
+    i++;
   }
+  return STRBUF_NPOS;
+}
 
-  // Make a copy of the list of args incase we need to resize buff and try again
-  va_list argptr_cpy;
-  va_copy(argptr_cpy, argptr);
+// Last match starting in [0, i)
+static size_t _rfind_bytes(const char *h, size_t i, const char *n, size_t nlen)
+{
+  while(i > 0) {
+    i--;
+    if(_find_match(h+i, n, nlen)) return i;
+  }
+  return STRBUF_NPOS;
+}
 
-  int num_chars = vsnprintf(sbuf->b+pos, buf_len, fmt, argptr);
-  va_end(argptr);
+static size_t _find_horspool(const char *h, size_t hlen,
+                             const char *n, size_t nlen)
+{
+  size_t skip[256], i, last = nlen - 1;
+  for(i = 0; i < 256; i++) skip[i] = nlen;
+  for(i = 0; i < last; i++) skip[(unsigned char)n[i]] = last - i;
 
-  // num_chars is the number of chars that would be written (not including '\0')
-  // num_chars < 0 => failure
-  if(num_chars < 0) {
-    fprintf(stderr, "Warning: strbuf_sprintf something went wrong..\n");
-    exit_on_error();
+  for(i = 0; i + nlen <= hlen; i += skip[(unsigned char)h[i+last]])
+    if(h[i+last] == n[last] && memcmp(h+i, n, last) == 0) return i;
+  return STRBUF_NPOS;
+}
+
+// Mirror image of the above: slide the needle right to left, skipping on the
+// byte under its first char
+static size_t _rfind_horspool(const char *h, size_t hlen,
+                              const char *n, size_t nlen)
+{
+  size_t skip[256], i;
+  for(i = 0; i < 256; i++) skip[i] = nlen;
+  for(i = nlen - 1; i > 0; i--) skip[(unsigned char)n[i]] = i;
+
+  for(i = hlen - nlen; ; i -= skip[(unsigned char)h[i]]) {
+    if(h[i] == n[0] && memcmp(h+i+1, n+1, nlen-1) == 0) return i;
+    if(i < skip[(unsigned char)h[i]]) return STRBUF_NPOS;
   }
+}
 
-  // num_chars does not include the null terminating byte
-  if((size_t)num_chars+1 > buf_len)
-  {
-    strbuf_ensure_capacity(sbuf, pos+(size_t)num_chars);
+static size_t _find_scalar(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+  if(nlen > FIND_FILTER_MAX) return _find_horspool(h, hlen, n, nlen);
+  return _find_bytes(h, 0, hlen, n, nlen);
+}
 
-    // now use the argptr copy we made earlier
-    // Don't need to use vsnprintf now, vsprintf will do since we know it'll fit
-    num_chars = vsprintf(sbuf->b+pos, fmt, argptr_cpy);
-    if(num_chars < 0) {
-      fprintf(stderr, "Warning: strbuf_sprintf something went wrong..\n");
-      exit_on_error();
+static size_t _rfind_scalar(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+  if(nlen > FIND_FILTER_MAX) return _rfind_horspool(h, hlen, n, nlen);
+  return _rfind_bytes(h, hlen - nlen + 1, n, nlen);
+}
+
+#if STRBUF_SIMD_X86
+// Bit j set if a match may start at h[j], for j in 0..15
+static inline STRBUF_SSE2
+unsigned _sse2_find_mask(const char *h, size_t nlen, __m128i first, __m128i last)
+{
+  __m128i a = _mm_loadu_si128((const __m128i*)h);
+  __m128i b = _mm_loadu_si128((const __m128i*)(h + nlen - 1));
+  return (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                   _mm_cmpeq_epi8(b, last)));
+}
+
+static STRBUF_SSE2
+size_t _find_sse2(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+  if(nlen > FIND_FILTER_MAX) return _find_horspool(h, hlen, n, nlen);
+  const __m128i first = _mm_set1_epi8(n[0]), last = _mm_set1_epi8(n[nlen-1]);
+  size_t i;
+  unsigned m;
+  for(i = 0; i + nlen - 1 + 16 <= hlen; i += 16) {
+    m = _sse2_find_mask(h+i, nlen, first, last);
+    for(; m; m &= m - 1) {
+      size_t p = i + __builtin_ctz(m);
+      if(_find_mid(h+p, n, nlen)) return p;
     }
   }
-  va_end(argptr_cpy);
+  return _find_bytes(h, i, hlen, n, nlen);
+}
 
-  // Don't need to NUL terminate, vsprintf/vnsprintf does that for us
+static STRBUF_SSE2
+size_t _rfind_sse2(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+  if(nlen > FIND_FILTER_MAX) return _rfind_horspool(h, hlen, n, nlen);
+  const __m128i first = _mm_set1_epi8(n[0]), last = _mm_set1_epi8(n[nlen-1]);
+  size_t i = hlen - nlen + 1; // one past the last possible start
+  unsigned m, bit;
+  for(; i >= 16; i -= 16) {
+    m = _sse2_find_mask(h+i-16, nlen, first, last);
+    for(; m; m ^= 1U << bit) {
+      bit = 31 - __builtin_clz(m);
+      if(_find_mid(h+i-16+bit, n, nlen)) return i-16+bit;
+    }
+  }
+  return _rfind_bytes(h, i, n, nlen);
+}
 
-  // Update length
-  sbuf->end = pos + (size_t)num_chars;
+static inline STRBUF_AVX2
+unsigned _avx2_find_mask(const char *h, size_t nlen, __m256i first, __m256i last)
+{
+  __m256i a = _mm256_loadu_si256((const __m256i*)h);
+  __m256i b = _mm256_loadu_si256((const __m256i*)(h + nlen - 1));
+  return (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                         _mm256_cmpeq_epi8(b, last)));
+}
 
-  return num_chars;
+static STRBUF_AVX2
+size_t _find_avx2(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+  if(nlen > FIND_FILTER_MAX) return _find_horspool(h, hlen, n, nlen);
+  const __m256i first = _mm256_set1_epi8(n[0]), last = _mm256_set1_epi8(n[nlen-1]);
+  size_t i;
+  unsigned m;
+  for(i = 0; i + nlen - 1 + 32 <= hlen; i += 32) {
+    m = _avx2_find_mask(h+i, nlen, first, last);
+    for(; m; m &= m - 1) {
+      size_t p = i + __builtin_ctz(m);
+      if(_find_mid(h+p, n, nlen)) return p;
+    }
+  }
+  return _find_bytes(h, i, hlen, n, nlen);
 }
 
-// Appends sprintf
-int strbuf_sprintf(StrBuf *sbuf, const char *fmt, ...)
+static STRBUF_AVX2
+size_t _rfind_avx2(const char *h, size_t hlen, const char *n, size_t nlen)
 {
-  va_list argptr;
-  va_start(argptr, fmt);
-  int num_chars = strbuf_vsprintf(sbuf, sbuf->end, fmt, argptr);
-  va_end(argptr);
+  if(nlen > FIND_FILTER_MAX) return _rfind_horspool(h, hlen, n, nlen);
+  const __m256i first = _mm256_set1_epi8(n[0]), last = _mm256_set1_epi8(n[nlen-1]);
+  size_t i = hlen - nlen + 1;
+  unsigned m, bit;
+  for(; i >= 32; i -= 32) {
+    m = _avx2_find_mask(h+i-32, nlen, first, last);
+    for(; m; m ^= 1U << bit) {
+      bit = 31 - __builtin_clz(m);
+      if(_find_mid(h+i-32+bit, n, nlen)) return i-32+bit;
+    }
+  }
+  return _rfind_bytes(h, i, n, nlen);
+}
+#endif
+
+// Hex encoding: each byte becomes two hex digits, high nibble first.
+// Decoding reads len chars, stops at the first pair that is not two hex digits
+// (either case) and returns the number of bytes written.
+
+#define _HEXL(x) x"0" x"1" x"2" x"3" x"4" x"5" x"6" x"7" \
+                 x"8" x"9" x"a" x"b" x"c" x"d" x"e" x"f"
+#define _HEXU(x) x"0" x"1" x"2" x"3" x"4" x"5" x"6" x"7" \
+                 x"8" x"9" x"A" x"B" x"C" x"D" x"E" x"F"
+
+// Two digits of each byte value, so hex_pairs[2*b+1] is the digit of b < 16
+static const char _hex_pairs_lc[513] =
+  _HEXL("0") _HEXL("1") _HEXL("2") _HEXL("3") _HEXL("4") _HEXL("5")
+  _HEXL("6") _HEXL("7") _HEXL("8") _HEXL("9") _HEXL("a") _HEXL("b")
+  _HEXL("c") _HEXL("d") _HEXL("e") _HEXL("f");
+static const char _hex_pairs_uc[513] =
+  _HEXU("0") _HEXU("1") _HEXU("2") _HEXU("3") _HEXU("4") _HEXU("5")
+  _HEXU("6") _HEXU("7") _HEXU("8") _HEXU("9") _HEXU("A") _HEXU("B")
+  _HEXU("C") _HEXU("D") _HEXU("E") _HEXU("F");
+
+static void _hex_encode_bytes(char *dst, const char *src, size_t len, int upper)
+{
+  const char *pairs = upper ? _hex_pairs_uc : _hex_pairs_lc;
+  size_t i;
+  for(i = 0; i < len; i++)
+    memcpy(dst + 2*i, pairs + 2*(unsigned char)src[i], 2);
+}
+
+// Value of a hex digit, or 16 or more if not one
+static inline unsigned _hex_digit(char c)
+{
+  unsigned d = (unsigned char)c - '0', l = ((unsigned char)c | 0x20) - 'a';
+  return d < 10 ? d : (l < 6 ? l + 10 : 16);
+}
+
+static size_t _hex_decode_bytes(char *dst, const char *src, size_t len)
+{
+  size_t i;
+  unsigned hi, lo;
+  for(i = 0; 2*i + 1 < len; i++) {
+    hi = _hex_digit(src[2*i]);
+    lo = _hex_digit(src[2*i+1]);
+    if((hi | lo) >= 16) break;
+    dst[i] = (char)(hi << 4 | lo);
+  }
+  return i;
+}
+
+#if STRBUF_SIMD_X86
+static STRBUF_SSE2
+void _hex_encode_sse2(char *dst, const char *src, size_t len, int upper)
+{
+  const __m128i nibble = _mm_set1_epi8(0x0f), nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i letter = _mm_set1_epi8((char)((upper ? 'A' : 'a') - '0' - 10));
+  __m128i x, hi, lo, a, b;
+  for(; len >= 16; src += 16, dst += 32, len -= 16) {
+    x = _mm_loadu_si128((const __m128i*)src);
+    hi = _mm_and_si128(_mm_srli_epi16(x, 4), nibble);
+    lo = _mm_and_si128(x, nibble);
+    a = _mm_unpacklo_epi8(hi, lo);
+    b = _mm_unpackhi_epi8(hi, lo);
+    a = _mm_add_epi8(_mm_add_epi8(a, zero), _mm_and_si128(_mm_cmpgt_epi8(a, nine), letter));
+    b = _mm_add_epi8(_mm_add_epi8(b, zero), _mm_and_si128(_mm_cmpgt_epi8(b, nine), letter));
+    _mm_storeu_si128((__m128i*)dst, a);
+    _mm_storeu_si128((__m128i*)(dst + 16), b);
+  }
+  _hex_encode_bytes(dst, src, len, upper);
+}
+
+// Digit values of 16 chars, and a mask of which chars are hex digits
+static inline STRBUF_SSE2
+__m128i _sse2_hex_values(__m128i x, int *valid)
+{
+  __m128i d = _mm_sub_epi8(x, _mm_set1_epi8('0'));
+  __m128i l = _mm_sub_epi8(_mm_or_si128(x, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+  __m128i isd = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+  __m128i isl = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+  *valid = _mm_movemask_epi8(_mm_or_si128(isd, isl)) == 0xffff;
+  return _mm_or_si128(_mm_and_si128(isd, d),
+                      _mm_andnot_si128(isd, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+// Pairs of digit values (as 16 bit lanes) to bytes: first << 4 | second
+static inline STRBUF_SSE2
+__m128i _sse2_hex_pairs(__m128i v)
+{
+  return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xff)), 4),
+                      _mm_srli_epi16(v, 8));
+}
+
+static STRBUF_SSE2
+size_t _hex_decode_sse2(char *dst, const char *src, size_t len)
+{
+  size_t n = 0;
+  int valid;
+  __m128i v;
+  for(; len >= 16; src += 16, dst += 8, len -= 16, n += 8) {
+    v = _sse2_hex_values(_mm_loadu_si128((const __m128i*)src), &valid);
+    if(!valid) break;
+    v = _sse2_hex_pairs(v);
+    _mm_storel_epi64((__m128i*)dst, _mm_packus_epi16(v, v));
+  }
+  return n + _hex_decode_bytes(dst, src, len);
+}
+
+static STRBUF_AVX2
+void _hex_encode_avx2(char *dst, const char *src, size_t len, int upper)
+{
+  const __m256i nibble = _mm256_set1_epi8(0x0f), nine = _mm256_set1_epi8(9);
+  const __m256i zero = _mm256_set1_epi8('0');
+  const __m256i letter = _mm256_set1_epi8((char)((upper ? 'A' : 'a') - '0' - 10));
+  __m256i x, hi, lo, a, b;
+  for(; len >= 32; src += 32, dst += 64, len -= 32) {
+    x = _mm256_loadu_si256((const __m256i*)src);
+    hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble);
+    lo = _mm256_and_si256(x, nibble);
+    // unpack works within 128 bit lanes: a = bytes 0-7,16-23; b = 8-15,24-31
+    a = _mm256_unpacklo_epi8(hi, lo);
+    b = _mm256_unpackhi_epi8(hi, lo);
+    a = _mm256_add_epi8(_mm256_add_epi8(a, zero),
+                        _mm256_and_si256(_mm256_cmpgt_epi8(a, nine), letter));
+    b = _mm256_add_epi8(_mm256_add_epi8(b, zero),
+                        _mm256_and_si256(_mm256_cmpgt_epi8(b, nine), letter));
+    _mm256_storeu_si256((__m256i*)dst, _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i*)(dst + 32), _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  _hex_encode_sse2(dst, src, len, upper);
+}
+
+static STRBUF_AVX2
+size_t _hex_decode_avx2(char *dst, const char *src, size_t len)
+{
+  const __m256i zero = _mm256_set1_epi8('0'), lower = _mm256_set1_epi8(0x20);
+  const __m256i a = _mm256_set1_epi8('a'), nine = _mm256_set1_epi8(9);
+  const __m256i five = _mm256_set1_epi8(5), ten = _mm256_set1_epi8(10);
+  __m256i x, d, l, isd, isl, v;
+  size_t n = 0;
+  for(; len >= 32; src += 32, dst += 16, len -= 32, n += 16) {
+    x = _mm256_loadu_si256((const __m256i*)src);
+    d = _mm256_sub_epi8(x, zero);
+    l = _mm256_sub_epi8(_mm256_or_si256(x, lower), a);
+    isd = _mm256_cmpeq_epi8(_mm256_min_epu8(d, nine), d);
+    isl = _mm256_cmpeq_epi8(_mm256_min_epu8(l, five), l);
+    if((unsigned)_mm256_movemask_epi8(_mm256_or_si256(isd, isl)) != 0xffffffffU)
+      break;
+    v = _mm256_blendv_epi8(_mm256_add_epi8(l, ten), d, isd);
+    v = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0xff)), 4),
+                        _mm256_srli_epi16(v, 8));
+    // pack works within lanes, bring the two low halves together
+    v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+    _mm_storeu_si128((__m128i*)dst, _mm256_castsi256_si128(v));
+  }
+  return n + _hex_decode_sse2(dst, src, len);
+}
+#endif
+
+/*********************/
+/*  Kernel dispatch  */
+/*********************/
+
+typedef struct
+{
+  const char *name;
+  void (*ascii_case)(char *dst, const char *src, size_t len, char lo, char hi);
+  void (*reverse)(char *dst, const char *src, size_t lo, size_t hi, int comp);
+  size_t (*span_space)(const char *s, size_t len);
+  size_t (*rspan_space)(const char *s, size_t len);
+  size_t (*count_char)(const char *s, size_t len, char c);
+  size_t (*replace_char)(char *s, size_t len, char from, char to);
+  size_t (*count_set)(const char *s, size_t len, const StrCharSet *set);
+  size_t (*replace_set)(char *s, size_t len, const StrCharSet *set, char to);
+  size_t (*span_set)(const char *s, size_t len, const StrCharSet *set);
+  size_t (*rspan_set)(const char *s, size_t len, const StrCharSet *set);
+  size_t (*cspan_set)(const char *s, size_t len, const StrCharSet *set);
+  size_t (*char_offsets)(const char *s, size_t i, size_t len, char c,
+                         size_t *offsets, size_t max, size_t n);
+  size_t (*set_offsets)(const char *s, size_t i, size_t len,
+                        const StrCharSet *set,
+                        size_t *offsets, size_t max, size_t n);
+  size_t (*find)(const char *h, size_t hlen, const char *n, size_t nlen);
+  size_t (*rfind)(const char *h, size_t hlen, const char *n, size_t nlen);
+  void (*hex_encode)(char *dst, const char *src, size_t len, int upper);
+  size_t (*hex_decode)(char *dst, const char *src, size_t len);
+} SimdKernels;
+
+// Ordered from slowest to fastest
+static const SimdKernels simd_kernels[] = {
+  {"scalar", _ascii_case_swar, _reverse_swar, _span_space_swar,
+   _rspan_space_swar, _count_char_swar, _replace_char_swar,
+   _count_set_bytes, _replace_set_bytes, _span_set_bytes, _rspan_set_bytes,
+   _cspan_set_bytes,
+   _char_offsets_swar, _set_offsets_bytes, _find_scalar, _rfind_scalar,
+   _hex_encode_bytes, _hex_decode_bytes},
+#if STRBUF_SIMD_X86
+  {"sse2", _ascii_case_sse2, _reverse_sse2, _span_space_sse2,
+   _rspan_space_sse2, _count_char_sse2, _replace_char_sse2,
+   _count_set_bytes, _replace_set_bytes, _span_set_bytes, _rspan_set_bytes,
+   _cspan_set_bytes,
+   _char_offsets_sse2, _set_offsets_bytes, _find_sse2, _rfind_sse2,
+   _hex_encode_sse2, _hex_decode_sse2},
+  {"avx2", _ascii_case_avx2, _reverse_avx2, _span_space_avx2,
+   _rspan_space_avx2, _count_char_avx2, _replace_char_avx2,
+   _count_set_avx2, _replace_set_avx2, _span_set_avx2, _rspan_set_avx2,
+   _cspan_set_avx2,
+   _char_offsets_avx2, _set_offsets_avx2, _find_avx2, _rfind_avx2,
+   _hex_encode_avx2, _hex_decode_avx2},
+#endif
+};
+
+#define NUM_SIMD_KERNELS (sizeof(simd_kernels) / sizeof(simd_kernels[0]))
+
+// Kernels in use. Starts as scalar so is valid before _strbuf_simd_init() runs
+static const SimdKernels *simd = &simd_kernels[0];
+
+// Number of kernel sets the CPU supports (always includes scalar)
+static size_t _simd_supported(void)
+{
+#if STRBUF_SIMD_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) return 3;
+  if(__builtin_cpu_supports("sse2")) return 2;
+#endif
+  return 1;
+}
+
+static const SimdKernels* _simd_find(const char *name)
+{
+  size_t i, n = _simd_supported();
+  for(i = 0; i < n; i++)
+    if(strcmp(simd_kernels[i].name, name) == 0)
+      return &simd_kernels[i];
+  return NULL;
+}
+
+// Pick the fastest kernels on this CPU, unless STRBUF_SIMD in the environment
+// names a slower set
+#if defined(__GNUC__)
+__attribute__((constructor))
+#endif
+static void _strbuf_simd_init(void)
+{
+  const char *env = getenv("STRBUF_SIMD");
+  const SimdKernels *k = NULL;
+  if(env != NULL && (k = _simd_find(env)) == NULL)
+    fprintf(stderr, "[%s:%i] Warning: STRBUF_SIMD=%s is not available\n",
+            __FILE__, __LINE__, env);
+  simd = k ? k : &simd_kernels[_simd_supported()-1];
+}
+
+const char* strbuf_simd_name(void)
+{
+  return simd->name;
+}
+
+int strbuf_simd_select(const char *name)
+{
+  const SimdKernels *k = _simd_find(name);
+  if(k == NULL) return -1;
+  simd = k;
+  return 0;
+}
+
+static inline void _ascii_case(char *dst, const char *src, size_t len,
+                               char lo, char hi)
+{
+  simd->ascii_case(dst, src, len, lo, hi);
+}
+
+static inline void _reverse(char *dst, const char *src, size_t len, int comp)
+{
+  simd->reverse(dst, src, 0, len, comp);
+}
+
+static inline size_t _span_space(const char *s, size_t len)
+{
+  return simd->span_space(s, len);
+}
+
+static inline size_t _rspan_space(const char *s, size_t len)
+{
+  return simd->rspan_space(s, len);
+}
+
+static inline size_t _count_char(const char *s, size_t len, char c)
+{
+  return simd->count_char(s, len, c);
+}
+
+static inline size_t _replace_char(char *s, size_t len, char from, char to)
+{
+  return simd->replace_char(s, len, from, to);
+}
+
+static inline size_t _count_set(const char *s, size_t len, const StrCharSet *set)
+{
+  return simd->count_set(s, len, set);
+}
+
+static inline size_t _replace_set(char *s, size_t len, const StrCharSet *set,
+                                  char to)
+{
+  return simd->replace_set(s, len, set, to);
+}
+
+static inline size_t _span_set(const char *s, size_t len, const StrCharSet *set)
+{
+  return simd->span_set(s, len, set);
+}
+
+static inline size_t _rspan_set(const char *s, size_t len, const StrCharSet *set)
+{
+  return simd->rspan_set(s, len, set);
+}
+
+static inline size_t _cspan_set(const char *s, size_t len, const StrCharSet *set)
+{
+  return simd->cspan_set(s, len, set);
+}
+
+static inline size_t _find(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+  if(nlen == 0) return 0;
+  if(nlen > hlen) return STRBUF_NPOS;
+  if(nlen == 1) {
+    const char *hit = memchr(h, n[0], hlen);
+    return hit ? (size_t)(hit - h) : STRBUF_NPOS;
+  }
+  return simd->find(h, hlen, n, nlen);
+}
+
+static inline size_t _rfind(const char *h, size_t hlen, const char *n, size_t nlen)
+{
+  if(nlen == 0) return hlen;
+  if(nlen > hlen) return STRBUF_NPOS;
+  return simd->rfind(h, hlen, n, nlen);
+}
+
+static inline void _hex_encode(char *dst, const char *src, size_t len, int upper)
+{
+  simd->hex_encode(dst, src, len, upper);
+}
+
+static inline size_t _hex_decode(char *dst, const char *src, size_t len)
+{
+  return simd->hex_decode(dst, src, len);
+}
+
+/******************************/
+/*  Constructors/Destructors  */
+/******************************/
+
+// Large buffers are backed by mmap - see strbuf_set_mmap_threshold()
+static size_t strbuf_mmap_threshold = 1UL<<26, strbuf_mmap_step = 1UL<<24;
+
+// Process-wide defaults - see strbuf_set_default_growth()
+static unsigned char strbuf_default_growth = STRBUF_GROW_POW2;
+static unsigned char strbuf_default_flags = 0;
+
+void strbuf_set_mmap_threshold(size_t threshold, size_t step)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  strbuf_mmap_threshold = threshold;
+  strbuf_mmap_step = step < page ? page : (step + page - 1) / page * page;
+}
+
+// Free the memory holding the string (but not the struct)
+// If the string is shared, just drop this buffer's reference to it
+static void _strbuf_release(StrBuf *sbuf)
+{
+  if(strbuf_is_inline(sbuf) || sbuf->b == NULL) return;
+  if(strbuf_is_shared(sbuf)) {
+    sbuf->flags &= ~STRBUF_SHARED;
+    size_t *refs = sbuf->refs;
+    sbuf->refs = NULL;
+    if(__atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL) > 0) {
+      sbuf->flags &= ~STRBUF_MMAP;
+      return;
+    }
+    bufalloc_free(sbuf->alloc, refs, sizeof(size_t));
+  }
+#ifdef STRBUF_HAVE_MREMAP
+  if(strbuf_is_mmap(sbuf)) {
+    munmap(sbuf->b, sbuf->size);
+    sbuf->flags &= ~STRBUF_MMAP;
+    return;
+  }
+#endif
+  bufalloc_free(sbuf->alloc, sbuf->b, sbuf->size);
+}
+
+StrBuf* strbuf_new_with(size_t len, const BufAllocator *a)
+{
+  StrBuf *sbuf = bufalloc_malloc(a, sizeof(StrBuf));
+  if(!sbuf) return NULL;
+  STRBUF_STAT_ADD(allocs, 1);
+  if(!strbuf_alloc_with(sbuf, len, a)) {
+    bufalloc_free(a, sbuf, sizeof(StrBuf));
+    return NULL;
+  }
+  return sbuf;
+}
+
+StrBuf* strbuf_new(size_t len)
+{
+  return strbuf_new_with(len, NULL);
+}
+
+StrBuf* strbuf_alloc_with(StrBuf *sbuf, size_t len, const BufAllocator *a)
+{
+  sbuf->b     = NULL;
+  sbuf->end   = 0;
+  sbuf->size  = 0;
+  sbuf->alloc = a;
+  sbuf->refs  = NULL;
+  sbuf->flags = strbuf_default_flags;
+  sbuf->growth = STRBUF_GROW_DEFAULT;
+  sbuf->nsmall = 0;
+  return strbuf_resize(sbuf, len) ? sbuf : NULL;
+}
+
+StrBuf* strbuf_alloc(StrBuf *sbuf, size_t len)
+{
+  return strbuf_alloc_with(sbuf, len, NULL);
+}
+
+void strbuf_free(StrBuf *sbuf)
+{
+  const BufAllocator *a = sbuf->alloc;
+  _strbuf_release(sbuf);
+  bufalloc_free(a, sbuf, sizeof(StrBuf));
+}
+
+void strbuf_dealloc(StrBuf *sbuf)
+{
+  _strbuf_release(sbuf);
+  memset(sbuf, 0, sizeof(*sbuf));
+}
+
+StrBuf* strbuf_create(const char *str)
+{
+  size_t str_len = strlen(str);
+  StrBuf *sbuf = strbuf_new(str_len+1);
+  if(!sbuf) return NULL;
+  memcpy(sbuf->b, str, str_len);
+  sbuf->b[sbuf->end = str_len] = '\0';
+  return sbuf;
+}
+
+StrBuf* strbuf_clone(StrBuf *sbuf)
+{
+  // Strings that fit inline are cheaper to copy than to share
+  if(sbuf->end < STRBUF_SSO_SIZE || sbuf->b == NULL) {
+    // One byte for the string end / null char \0
+    StrBuf *cpy = strbuf_new_with(sbuf->end+1, sbuf->alloc);
+    if(!cpy) return NULL;
+    memcpy(cpy->b, sbuf->b, sbuf->end);
+    cpy->b[cpy->end = sbuf->end] = '\0';
+    return cpy;
+  }
+
+  // Share the string: sbuf is marked shared and gains a reference
+  if(!strbuf_is_shared(sbuf)) {
+    size_t *refs = bufalloc_malloc(sbuf->alloc, sizeof(size_t));
+    if(!refs) return NULL;
+    *refs = 1;
+    sbuf->refs = refs;
+    sbuf->flags |= STRBUF_SHARED;
+  }
+
+  StrBuf *cpy = bufalloc_malloc(sbuf->alloc, sizeof(StrBuf));
+  if(!cpy) return NULL;
+  STRBUF_STAT_ADD(allocs, 1);
+  __atomic_add_fetch(sbuf->refs, 1, __ATOMIC_RELAXED);
+  *cpy = *sbuf; // safe since b does not point into sbuf
+  cpy->nsmall = 0;
+  return cpy;
+}
+
+/******************************/
+/*  Resize Buffer Functions   */
+/******************************/
+
+// Set the growth policy (STRBUF_GROW_*) used when this buffer grows
+void strbuf_set_growth(StrBuf *sbuf, int policy)
+{
+  sbuf->growth = (unsigned char)policy;
+}
+
+void strbuf_set_default_growth(int policy)
+{
+  strbuf_default_growth = policy ? (unsigned char)policy : STRBUF_GROW_POW2;
+}
+
+// Capacity to allocate for `req` bytes (including '\0') under the buffer's
+// growth policy. If `grow` is set, also add the policy's extra space over the
+// current capacity.
+static size_t _strbuf_capacity_for(const StrBuf *sbuf, size_t req, char grow)
+{
+  size_t page;
+  switch(sbuf->growth ? sbuf->growth : strbuf_default_growth)
+  {
+    case STRBUF_GROW_1_5X:
+      if(grow) req = MAX(req, sbuf->size + sbuf->size / 2);
+      return (req + 15) & ~(size_t)15;
+    case STRBUF_GROW_PAGE:
+      page = (size_t)sysconf(_SC_PAGESIZE);
+      return req < page ? ROUNDUP2POW(req) : (req + page - 1) / page * page;
+    case STRBUF_GROW_EXACT:
+      return req;
+    default:
+      return ROUNDUP2POW(req);
+  }
+}
+
+// If we hold the only reference to a shared string, take it back as our own.
+// Returns 1 if the buffer is no longer shared.
+static char _strbuf_claim(StrBuf *sbuf)
+{
+  if(__atomic_load_n(sbuf->refs, __ATOMIC_ACQUIRE) != 1) return 0;
+  bufalloc_free(sbuf->alloc, sbuf->refs, sizeof(size_t));
+  sbuf->refs = NULL;
+  sbuf->flags &= ~STRBUF_SHARED;
+  return 1;
+}
+
+static char _strbuf_realloc(StrBuf *sbuf, size_t new_len, size_t capacity);
+
+// Copy a shared string into new memory of our own, then drop the reference
+// Returns 1 on success, 0 on failure (buffer is unchanged).
+static char _strbuf_unshare_to(StrBuf *sbuf, size_t new_len, size_t capacity)
+{
+  StrBuf shared = *sbuf; // b does not point into sbuf
+
+  sbuf->b = NULL;
+  sbuf->size = 0;
+  sbuf->refs = NULL;
+  sbuf->flags &= ~(STRBUF_SHARED | STRBUF_MMAP);
+
+  if(!_strbuf_realloc(sbuf, new_len, capacity)) {
+    sbuf->b = shared.b;
+    sbuf->size = shared.size;
+    sbuf->refs = shared.refs;
+    sbuf->flags = shared.flags;
+    return 0;
+  }
+
+  memcpy(sbuf->b, shared.b, sbuf->end);
+  sbuf->b[sbuf->end] = '\0';
+  _strbuf_release(&shared);
+  return 1;
+}
+
+// Move the string into memory with the given capacity, which must be at least
+// new_len+1. Returns 1 on success, 0 on failure.
+static char _strbuf_realloc(StrBuf *sbuf, size_t new_len, size_t capacity)
+{
+  if(strbuf_is_shared(sbuf) && !_strbuf_claim(sbuf))
+    return _strbuf_unshare_to(sbuf, new_len, capacity);
+
+  size_t ncopy = MIN(sbuf->end, new_len);
+  unsigned char mmapped = 0;
+  char *new_buff;
+
+  if(capacity <= STRBUF_SSO_SIZE)
+  {
+    // Fits inside the struct
+    if(!strbuf_is_inline(sbuf) && sbuf->b) {
+      memcpy(sbuf->sso, sbuf->b, ncopy);
+      _strbuf_release(sbuf);
+    }
+    new_buff = sbuf->sso;
+    capacity = STRBUF_SSO_SIZE;
+  }
+#ifdef STRBUF_HAVE_MREMAP
+  else if(sbuf->alloc == NULL && strbuf_mmap_threshold &&
+          new_len+1 >= strbuf_mmap_threshold)
+  {
+    // Large buffer: grow in steps, remapping pages rather than copying
+    size_t step = strbuf_mmap_step;
+    capacity = (new_len + step) / step * step;
+    if(strbuf_is_mmap(sbuf)) {
+      new_buff = mremap(sbuf->b, sbuf->size, capacity, MREMAP_MAYMOVE);
+      if(new_buff == MAP_FAILED) return 0;
+    } else {
+      new_buff = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(new_buff == MAP_FAILED) return 0;
+      STRBUF_STAT_ADD(allocs, 1);
+      if(sbuf->b) memcpy(new_buff, sbuf->b, ncopy);
+      _strbuf_release(sbuf);
+    }
+    mmapped = STRBUF_MMAP;
+  }
+  else if(strbuf_is_mmap(sbuf))
+  {
+    // Shrunk below the threshold: move back to the heap
+    if((new_buff = malloc(capacity * sizeof(char))) == NULL) return 0;
+    STRBUF_STAT_ADD(allocs, 1);
+    memcpy(new_buff, sbuf->b, ncopy);
+    _strbuf_release(sbuf);
+  }
+#endif
+  else if(strbuf_is_inline(sbuf))
+  {
+    // Spill to the heap
+    new_buff = bufalloc_malloc(sbuf->alloc, capacity * sizeof(char));
+    if(new_buff == NULL) return 0;
+    STRBUF_STAT_ADD(allocs, 1);
+    memcpy(new_buff, sbuf->sso, ncopy);
+  }
+  else
+  {
+    new_buff = bufalloc_realloc(sbuf->alloc, sbuf->b, sbuf->size,
+                                capacity * sizeof(char));
+    if(new_buff == NULL) return 0;
+    if(sbuf->b == NULL) STRBUF_STAT_ADD(allocs, 1);
+  }
+
+  if(sbuf->size && capacity > sbuf->size) STRBUF_STAT_ADD(grows, 1);
+
+  sbuf->b     = new_buff;
+  sbuf->size  = capacity;
+  sbuf->flags = (unsigned char)((sbuf->flags & ~STRBUF_MMAP) | mmapped);
+
+  // Buffer may have been shrunk or newly allocated - re-add null byte
+  if(sbuf->end > new_len) sbuf->end = new_len;
+  sbuf->b[sbuf->end] = '\0';
+
+  return 1;
+}
+
+// Resize the buffer to have capacity to hold a string of length new_len
+// (+ a null terminating character).  Can also be used to downsize the buffer's
+// memory usage (moves the string back inline if it fits).
+// Returns 1 on success, 0 on failure.
+char strbuf_resize(StrBuf *sbuf, size_t new_len)
+{
+  return _strbuf_realloc(sbuf, new_len, _strbuf_capacity_for(sbuf, new_len+1, 0));
+}
+
+// Grow to hold len chars (+ '\0'), adding space according to the growth policy
+static inline char _strbuf_grow_to(StrBuf *sbuf, size_t len)
+{
+  return _strbuf_realloc(sbuf, len, _strbuf_capacity_for(sbuf, len+1, 1));
+}
+
+// Give the buffer its own copy of a shared string (same capacity)
+// Returns 1 on success, 0 on failure.
+static char _strbuf_make_unique(StrBuf *sbuf)
+{
+  return !strbuf_is_shared(sbuf) || _strbuf_claim(sbuf) ||
+         _strbuf_unshare_to(sbuf, sbuf->end, sbuf->size);
+}
+
+// Slow path of strbuf_unshare() - exits on failure
+void _strbuf_unshare(StrBuf *sbuf)
+{
+  if(!_strbuf_make_unique(sbuf)) {
+    fprintf(stderr, "[%s:%i] Out of memory\n", __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Slow path of strbuf_ensure_capacity() - exits on failure
+void _strbuf_grow(StrBuf *sbuf, size_t len)
+{
+  if(sbuf->size > len) { _strbuf_unshare(sbuf); return; }
+  if(!_strbuf_grow_to(sbuf, len)) {
+    fprintf(stderr, "[%s:%i] Out of memory\n", __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Move the string into a malloc'd block of its own, so that realloc/free may be
+// called on sbuf->b directly. Exits on failure.
+char** strbuf_heap_ptr(StrBuf *sbuf)
+{
+  if(sbuf->alloc != NULL) {
+    fprintf(stderr, "[%s:%i] Buffer is not from malloc (has an allocator)\n",
+            __FILE__, __LINE__);
+    errno = EDOM;
+    exit_on_error();
+  }
+
+  strbuf_unshare(sbuf);
+
+  if(strbuf_is_inline(sbuf) || strbuf_is_mmap(sbuf))
+  {
+    char *new_buff = malloc(sbuf->size * sizeof(char));
+    if(new_buff == NULL) {
+      fprintf(stderr, "[%s:%i] Out of memory\n", __FILE__, __LINE__);
+      exit(EXIT_FAILURE);
+    }
+    STRBUF_STAT_ADD(allocs, 1);
+    memcpy(new_buff, sbuf->b, sbuf->end+1);
+    _strbuf_release(sbuf);
+    sbuf->b = new_buff;
+    sbuf->flags &= ~STRBUF_MMAP;
+  }
+
+  return &sbuf->b;
+}
+
+#define STRBUF_SHRINK_MIN (1UL<<16)
+#define STRBUF_SHRINK_RESETS 8
+
+void strbuf_set_shrink_on_reset(StrBuf *sbuf, char enable)
+{
+  if(enable) sbuf->flags |= STRBUF_SHRINK;
+  else sbuf->flags &= ~STRBUF_SHRINK;
+  sbuf->nsmall = 0;
+}
+
+void strbuf_set_default_shrink_on_reset(char enable)
+{
+  strbuf_default_flags = enable ? STRBUF_SHRINK : 0;
+}
+
+// Called by strbuf_reset() before the content is cleared
+void _strbuf_reset_slow(StrBuf *sbuf)
+{
+  if(strbuf_is_shared(sbuf) && !_strbuf_claim(sbuf)) {
+    // Detach from the clones, no need to copy a string we're about to clear
+    _strbuf_release(sbuf);
+    sbuf->b = sbuf->sso;
+    sbuf->size = STRBUF_SSO_SIZE;
+    sbuf->end = 0;
+    sbuf->nsmall = 0;
+    return;
+  }
+  if(!(sbuf->flags & STRBUF_SHRINK)) return;
+
+  if(sbuf->size > STRBUF_SHRINK_MIN && sbuf->end < sbuf->size / 4) {
+    if(++sbuf->nsmall >= STRBUF_SHRINK_RESETS) {
+      sbuf->nsmall = 0;
+      // Halve the capacity - failure is harmless, we just keep the memory
+      _strbuf_realloc(sbuf, sbuf->end,
+                      _strbuf_capacity_for(sbuf, MAX(sbuf->size / 2, sbuf->end+1), 0));
+    }
+  }
+  else sbuf->nsmall = 0;
+}
+
+void strbuf_ensure_capacity_update_ptr(StrBuf *sbuf, size_t size, const char **ptr)
+{
+  if(sbuf->size <= size+1 || strbuf_is_shared(sbuf))
+  {
+    size_t oldcap = sbuf->size;
+    char *oldbuf  = sbuf->b;
+
+    if(sbuf->size > size+1 ? !_strbuf_make_unique(sbuf)
+                           : !_strbuf_grow_to(sbuf, size))
+    {
+      fprintf(stderr, "%s:%i:Error: _ensure_capacity_update_ptr couldn't resize "
+                      "buffer. [requested %zu bytes; capacity: %zu bytes]\n",
+              __FILE__, __LINE__, size, sbuf->size);
+      exit_on_error();
+    }
+
+    // ptr may have pointed to sbuf, which has now moved
+    if(*ptr >= oldbuf && *ptr < oldbuf + oldcap) {
+      *ptr = sbuf->b + (*ptr - oldbuf);
+    }
+  }
+}
+
+/*******************/
+/* Append Integers */
+/*******************/
+
+/*
+ * Integer to string functions adapted from:
+ *   https://www.facebook.com/notes/facebook-engineering/three-optimization-tips-for-c/10151361643253920
+ */
+
+#define P01 10
+#define P02 100
+#define P03 1000
+#define P04 10000
+#define P05 100000
+#define P06 1000000
+#define P07 10000000
+#define P08 100000000
+#define P09 1000000000
+#define P10 10000000000
+#define P11 100000000000
+#define P12 1000000000000
+
+// Smallest number with i+1 digits, except [0] which is 0 so that 0 has 1 digit
+static const uint64_t _digits_threshold[20] = {
+  0ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+  100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+  1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+  1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+  1000000000000000000ULL, 10000000000000000000ULL
+};
+
+/**
+ * Return number of digits required to represent `num` in base 10.
+ * The bit length times log10(2) (~1233/4096) is the number of digits or one
+ * less; a table lookup corrects it. Falls back to a binary search.
+ * Examples:
+ *   num_of_digits(0)   = 1
+ *   num_of_digits(1)   = 1
+ *   num_of_digits(10)  = 2
+ *   num_of_digits(123) = 3
+ */
+static inline size_t num_of_digits(uint64_t v)
+{
+#if defined(__GNUC__)
+  size_t t = ((64 - __builtin_clzll(v | 1)) * 1233) >> 12;
+  return t + (v >= _digits_threshold[t]);
+#else
+  if(v < P01) return 1;
+  if(v < P02) return 2;
+  if(v < P03) return 3;
+  if(v < P12) {
+    if(v < P08) {
+      if(v < P06) {
+        if(v < P04) return 4;
+        return 5 + (v >= P05);
+      }
+      return 7 + (v >= P07);
+    }
+    if(v < P10) {
+      return 9 + (v >= P09);
+    }
+    return 11 + (v >= P11);
+  }
+  return 12 + num_of_digits(v / P12);
+#endif
+}
+
+// Write the num_digits = num_of_digits(value) digits of value to dst
+static inline void _write_ulong(char *dst, uint64_t value, size_t num_digits)
+{
+  // Write two digits at a time
+  static const char digits[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+  size_t pos = num_digits - 1;
+
+  while(value >= 100)
+  {
+    size_t v = value % 100;
+    value /= 100;
+    dst[pos] = digits[v * 2 + 1];
+    dst[pos - 1] = digits[v * 2];
+    pos -= 2;
+  }
+
+  // Handle last 1-2 digits
+  if(value < 10) {
+    dst[pos] = '0' + value;
+  } else {
+    dst[pos] = digits[value * 2 + 1];
+    dst[pos - 1] = digits[value * 2];
+  }
+}
+
+// Magnitude of a signed integer, without overflow for LONG_MIN / INT64_MIN
+#define _ulong_abs(l) ((l) < 0 ? 0UL - (unsigned long)(l) : (unsigned long)(l))
+#define _u64_abs(l) ((l) < 0 ? (uint64_t)0 - (uint64_t)(l) : (uint64_t)(l))
+
+void strbuf_append_uint64(StrBuf *buf, uint64_t value)
+{
+  size_t num_digits = num_of_digits(value);
+  strbuf_ensure_capacity(buf, buf->end+num_digits);
+  _write_ulong(buf->b + buf->end, value, num_digits);
+  buf->end += num_digits;
+  buf->b[buf->end] = '\0';
+}
+
+void strbuf_append_int64(StrBuf *buf, int64_t value)
+{
+  uint64_t u = _u64_abs(value);
+  size_t neg = value < 0, len = neg + num_of_digits(u);
+  strbuf_ensure_capacity(buf, buf->end+len);
+  buf->b[buf->end] = '-';
+  _write_ulong(buf->b + buf->end + neg, u, len - neg);
+  buf->end += len;
+  buf->b[buf->end] = '\0';
+}
+
+void strbuf_append_ulong(StrBuf *buf, unsigned long value)
+{
+  strbuf_append_uint64(buf, value);
+}
+
+void strbuf_append_size_t(StrBuf *buf, size_t value)
+{
+  strbuf_append_uint64(buf, value);
+}
+
+void strbuf_append_int(StrBuf *buf, int value)
+{
+  // strbuf_sprintf(buf, "%i", value);
+  strbuf_append_int64(buf, value);
+}
+
+void strbuf_append_long(StrBuf *buf, long value)
+{
+  // strbuf_sprintf(buf, "%li", value);
+  strbuf_append_int64(buf, value);
+}
+
+// Right align in `width` chars. When padding with '0' the sign goes first
+static void _append_int_pad(StrBuf *buf, uint64_t u, size_t neg,
+                            size_t width, char pad)
+{
+  size_t num_digits = num_of_digits(u), len = neg + num_digits;
+  size_t npad = width > len ? width - len : 0;
+  strbuf_ensure_capacity(buf, buf->end + npad + len);
+  char *dst = buf->b + buf->end;
+  if(neg && pad == '0') *dst++ = '-';
+  memset(dst, pad, npad);
+  dst += npad;
+  if(neg && pad != '0') *dst++ = '-';
+  _write_ulong(dst, u, num_digits);
+  buf->end += npad + len;
+  buf->b[buf->end] = '\0';
+}
+
+void strbuf_append_uint64_pad(StrBuf *buf, uint64_t value,
+                              size_t width, char pad)
+{
+  _append_int_pad(buf, value, 0, width, pad);
+}
+
+void strbuf_append_int64_pad(StrBuf *buf, int64_t value,
+                             size_t width, char pad)
+{
+  _append_int_pad(buf, _u64_abs(value), value < 0, width, pad);
+}
+
+// Digits in groups of three separated by `sep`, e.g. 1,234,567
+static void _append_int_sep(StrBuf *buf, uint64_t u, size_t neg, char sep)
+{
+  size_t num_digits = num_of_digits(u);
+  size_t len = neg + num_digits + (num_digits - 1) / 3;
+  strbuf_ensure_capacity(buf, buf->end + len);
+  char *dst = buf->b + buf->end + len;
+  unsigned g;
+
+  // Groups from the right, then the leading 1-3 digits
+  while(u >= 1000) {
+    g = (unsigned)(u % 1000);
+    u /= 1000;
+    dst -= 4;
+    dst[0] = sep;
+    dst[1] = '0' + g / 100;
+    dst[2] = '0' + (g / 10) % 10;
+    dst[3] = '0' + g % 10;
+  }
+  num_digits = num_of_digits(u);
+  _write_ulong(dst - num_digits, u, num_digits);
+
+  if(neg) buf->b[buf->end] = '-';
+  buf->end += len;
+  buf->b[buf->end] = '\0';
+}
+
+void strbuf_append_uint64_sep(StrBuf *buf, uint64_t value, char sep)
+{
+  _append_int_sep(buf, value, 0, sep);
+}
+
+void strbuf_append_int64_sep(StrBuf *buf, int64_t value, char sep)
+{
+  _append_int_sep(buf, _u64_abs(value), value < 0, sep);
+}
+
+// Append n integers separated by `sep`: size everything, then grow once
+#define _func_append_uint_array(fname,type_t)                                  \
+  void fname(StrBuf *buf, const type_t *vals, size_t n, char sep)              \
+  {                                                                            \
+    if(n == 0) return;                                                         \
+    size_t i, num_digits, len = n - 1;                                         \
+    for(i = 0; i < n; i++) len += num_of_digits(vals[i]);                      \
+    strbuf_ensure_capacity(buf, buf->end + len);                               \
+    char *dst = buf->b + buf->end;                                             \
+    for(i = 0; i < n; i++) {                                                   \
+      num_digits = num_of_digits(vals[i]);                                     \
+      _write_ulong(dst, vals[i], num_digits);                                  \
+      dst += num_digits;                                                       \
+      *dst++ = sep; /* last one is overwritten by '\0' */                      \
+    }                                                                          \
+    buf->end += len;                                                           \
+    buf->b[buf->end] = '\0';                                                   \
+  }
+
+_func_append_uint_array(strbuf_append_ulong_array, unsigned long)
+_func_append_uint_array(strbuf_append_uint64_array, uint64_t)
+
+/*
+size_t strbuf_num_of_digits(unsigned long num)
+{
+  size_t digits = 1;
+  while(1) {
+    if(num < 10) return digits;
+    if(num < 100) return digits+1;
+    if(num < 1000) return digits+2;
+    if(num < 10000) return digits+3;
+    num /= 10000;
+    digits += 4;
+  }
+  return digits;
+}
+
+void strbuf_append_ulong(StrBuf *buf, unsigned long value)
+{
+  // strbuf_sprintf(buf, "%lu", value);
+
+  size_t i, num_digits = strbuf_num_of_digits(value);
+  strbuf_ensure_capacity(buf, buf->end + num_digits);
+  buf->end += num_digits;
+  buf->b[buf->end] = '\0';
+
+  for(i = 1; i <= num_digits; i++) {
+    buf->b[buf->end - i] = '0' + (value % 10);
+    value /= 10;
+  }
+}
+*/
+
+// Write the num_digits lowest hex digits of value to dst
+static inline void _write_hex(char *dst, uint64_t value, size_t num_digits,
+                              const char *pairs)
+{
+  size_t pos = num_digits;
+  // Two digits (one byte) at a time
+  for(; pos >= 2; pos -= 2, value >>= 8)
+    memcpy(dst + pos - 2, pairs + 2*(value & 0xff), 2);
+  if(pos) dst[0] = pairs[2*(value & 0xf) + 1];
+}
+
+// Append value in hex with at least `width` digits (zero padded)
+void strbuf_append_hex(StrBuf *buf, uint64_t value, size_t width, char upper)
+{
+  size_t num_digits = (64 - __builtin_clzll(value | 1) + 3) / 4;
+  if(num_digits < width) num_digits = width;
+  strbuf_ensure_capacity(buf, buf->end + num_digits);
+  _write_hex(buf->b + buf->end, value, num_digits,
+             upper ? _hex_pairs_uc : _hex_pairs_lc);
+  buf->end += num_digits;
+  buf->b[buf->end] = '\0';
+}
+
+void strbuf_append_binary(StrBuf *buf, uint64_t value, size_t width)
+{
+  size_t num_digits = 64 - __builtin_clzll(value | 1);
+  if(num_digits < width) num_digits = width;
+  strbuf_ensure_capacity(buf, buf->end + num_digits);
+  char *dst = buf->b + buf->end + num_digits;
+  for(; dst > buf->b + buf->end; value >>= 1) *--dst = (char)('0' + (value & 1));
+  buf->end += num_digits;
+  buf->b[buf->end] = '\0';
+}
+
+void strbuf_append_base(StrBuf *buf, uint64_t value, unsigned base,
+                        size_t width, char upper)
+{
+  static const char lc[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+  static const char uc[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  const char *digits = upper ? uc : lc;
+  char tmp[64], *p = tmp + sizeof(tmp);
+  size_t num_digits;
+
+  if(base < 2 || base > 36) {
+    fprintf(stderr, "[%s:%i] Invalid base: %u\n", __FILE__, __LINE__, base);
+    errno = EDOM;
+    exit_on_error();
+  }
+
+  if(base == 16) { strbuf_append_hex(buf, value, width, upper); return; }
+  if(base == 2) { strbuf_append_binary(buf, value, width); return; }
+
+  if(base == 10) {
+    num_digits = num_of_digits(value);
+    p -= num_digits;
+    _write_ulong(p, value, num_digits);
+  } else {
+    do { *--p = digits[value % base]; value /= base; } while(value);
+    num_digits = tmp + sizeof(tmp) - p;
+  }
+
+  size_t npad = width > num_digits ? width - num_digits : 0;
+  strbuf_ensure_capacity(buf, buf->end + npad + num_digits);
+  memset(buf->b + buf->end, '0', npad);
+  memcpy(buf->b + buf->end + npad, p, num_digits);
+  buf->end += npad + num_digits;
+  buf->b[buf->end] = '\0';
+}
+
+
+/*************************/
+/* Append Floating Point */
+/*************************/
+
+/*
+ * Shortest round-trip output uses Grisu2 (Florian Loitsch, "Printing
+ * Floating-Point Numbers Quickly and Accurately with Integers", PLDI 2010),
+ * as in Milo Yip's dtoa. The digits always read back to the same value and are
+ * the shortest possible for all but a tiny fraction of inputs.
+ */
+
+// v = f * 2^e
+typedef struct { uint64_t f; int e; } DiyFp;
+
+// 10^k for k = -348, -340, ..., 340 as normalised DiyFp
+static const uint64_t _cached_pow10_f[87] = {
+  0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+  0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+  0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+  0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+  0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+  0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+  0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+  0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+  0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+  0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+  0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+  0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+  0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+  0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+  0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+  0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+  0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+  0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+  0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+  0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+  0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+  0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+  0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+  0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+  0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+  0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+  0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+  0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+  0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const int16_t _cached_pow10_e[87] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+  -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+  -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+  -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+  -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+  109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+  641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+  907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const uint64_t _pow10_u64[20] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+  100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+  1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+  1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+  1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static inline DiyFp _diyfp(uint64_t f, int e)
+{
+  DiyFp r; r.f = f; r.e = e;
+  return r;
+}
+
+// Product rounded to the top 64 bits
+static inline DiyFp _diyfp_mul(DiyFp a, DiyFp b)
+{
+  const uint64_t M32 = 0xFFFFFFFF;
+  uint64_t ah = a.f >> 32, al = a.f & M32, bh = b.f >> 32, bl = b.f & M32;
+  uint64_t hh = ah * bh, lh = al * bh, hl = ah * bl, ll = al * bl;
+  uint64_t tmp = (ll >> 32) + (hl & M32) + (lh & M32) + (1ULL << 31);
+  return _diyfp(hh + (hl >> 32) + (lh >> 32) + (tmp >> 32), a.e + b.e + 64);
+}
+
+static inline DiyFp _diyfp_norm(DiyFp v)
+{
+  int s = __builtin_clzll(v.f);
+  return _diyfp(v.f << s, v.e - s);
+}
+
+// Cached power c = 10^-K such that v * c has a binary exponent in [-60,-32]
+static inline DiyFp _cached_pow10(int e, int *K)
+{
+  double dk = (-61 - e) * 0.30102999566398114 + 347;
+  int k = (int)dk;
+  if(dk - k > 0.0) k++;
+  unsigned idx = (unsigned)((k >> 3) + 1);
+  *K = -(-348 + (int)(idx << 3));
+  return _diyfp(_cached_pow10_f[idx], _cached_pow10_e[idx]);
+}
+
+static inline void _grisu_round(char *buf, int len, uint64_t delta,
+                                uint64_t rest, uint64_t ten_kappa,
+                                uint64_t wp_w)
+{
+  while(rest < wp_w && delta - rest >= ten_kappa &&
+        (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+static inline int _digits_u32(uint32_t n)
+{
+  int d = 1;
+  while(d < 10 && n >= _pow10_u64[d]) d++;
+  return d;
+}
+
+static void _grisu_digits(DiyFp w, DiyFp mp, uint64_t delta,
+                          char *buf, int *len, int *K)
+{
+  const DiyFp one = _diyfp(1ULL << -mp.e, mp.e);
+  const uint64_t wp_w = mp.f - w.f;
+  uint32_t d, p1 = (uint32_t)(mp.f >> -one.e);
+  uint64_t p2 = mp.f & (one.f - 1), tmp;
+  int kappa = _digits_u32(p1);
+  *len = 0;
+
+  // Integer part
+  while(kappa > 0) {
+    d = p1 / (uint32_t)_pow10_u64[kappa - 1];
+    p1 %= (uint32_t)_pow10_u64[kappa - 1];
+    if(d || *len) buf[(*len)++] = (char)('0' + d);
+    kappa--;
+    tmp = ((uint64_t)p1 << -one.e) + p2;
+    if(tmp <= delta) {
+      *K += kappa;
+      _grisu_round(buf, *len, delta, tmp,
+                   _pow10_u64[kappa] << -one.e, wp_w);
+      return;
+    }
+  }
+
+  // Fractional part
+  for(;;) {
+    p2 *= 10;
+    delta *= 10;
+    d = (uint32_t)(p2 >> -one.e);
+    if(d || *len) buf[(*len)++] = (char)('0' + d);
+    p2 &= one.f - 1;
+    kappa--;
+    if(p2 < delta) {
+      *K += kappa;
+      _grisu_round(buf, *len, delta, p2, one.f,
+                   wp_w * (-kappa < 20 ? _pow10_u64[-kappa] : 0));
+      return;
+    }
+  }
+}
+
+// Shortest digits of the non-zero value f * 2^e, which is halfway between
+// its neighbours except when f is a power of two and the lower neighbour is
+// closer (`lower_closer`). Result is buf[0..len) * 10^K, len <= 17
+static void _grisu2(uint64_t f, int e, int lower_closer,
+                    char *buf, int *len, int *K)
+{
+  DiyFp mp = _diyfp_norm(_diyfp((f << 1) + 1, e - 1));
+  DiyFp mm = lower_closer ? _diyfp((f << 2) - 1, e - 2)
+                          : _diyfp((f << 1) - 1, e - 1);
+  mm.f <<= mm.e - mp.e;
+  mm.e = mp.e;
+
+  const DiyFp c = _cached_pow10(mp.e, K);
+  DiyFp w = _diyfp_mul(_diyfp_norm(_diyfp(f, e)), c);
+  DiyFp wp = _diyfp_mul(mp, c), wm = _diyfp_mul(mm, c);
+  wm.f++;
+  wp.f--;
+  _grisu_digits(w, wp, wp.f - wm.f, buf, len, K);
+}
+
+// Write exponent as printf does: sign and at least two digits
+static inline size_t _write_exp10(char *dst, int dec_exp)
+{
+  unsigned u = dec_exp < 0 ? (unsigned)-dec_exp : (unsigned)dec_exp;
+  size_t n = num_of_digits(u);
+  if(n < 2) n = 2;
+  dst[0] = 'e';
+  dst[1] = dec_exp < 0 ? '-' : '+';
+  if(u < 10) dst[2] = '0';
+  _write_ulong(dst + 2 + n - num_of_digits(u), u, num_of_digits(u));
+  return 2 + n;
+}
+
+// Lay out digits buf[0..len) * 10^K as %g would, without trailing zeros.
+// Returns the number of chars written to dst (at most 26)
+static size_t _write_shortest(char *dst, const char *buf, int len, int K)
+{
+  int dec_exp = len + K - 1, i;
+  char *p = dst;
+
+  if(dec_exp < -4 || dec_exp >= 17) {
+    *p++ = buf[0];
+    if(len > 1) { *p++ = '.'; memcpy(p, buf + 1, len - 1); p += len - 1; }
+    p += _write_exp10(p, dec_exp);
+  }
+  else if(K >= 0) {
+    memcpy(p, buf, len); p += len;
+    for(i = 0; i < K; i++) *p++ = '0';
+  }
+  else if(dec_exp >= 0) {
+    memcpy(p, buf, dec_exp + 1); p += dec_exp + 1;
+    *p++ = '.';
+    memcpy(p, buf + dec_exp + 1, len - dec_exp - 1); p += len - dec_exp - 1;
+  }
+  else {
+    *p++ = '0'; *p++ = '.';
+    for(i = -1; i > dec_exp; i--) *p++ = '0';
+    memcpy(p, buf, len); p += len;
+  }
+  return p - dst;
+}
+
+// inf / nan / zero, returns number of chars written or 0 for a finite
+// non-zero value
+static inline size_t _write_special(char *dst, uint64_t bits, int expmax,
+                                    int zero)
+{
+  size_t neg = bits >> 63;
+  dst[0] = '-';
+  if(expmax) {
+    if(zero) { memcpy(dst+neg, "inf", 3); return neg+3; }
+    memcpy(dst, "nan", 3); return 3;
+  }
+  if(zero) { dst[neg] = '0'; return neg+1; }
+  return 0;
+}
+
+static inline void _append_shortest(StrBuf *buf, uint64_t bits, uint64_t f,
+                                    int e, int expmax, int lower_closer)
+{
+  char digits[20];
+  int len, K;
+  size_t n;
+
+  strbuf_ensure_capacity(buf, buf->end + 32);
+  char *dst = buf->b + buf->end;
+
+  if((n = _write_special(dst, bits, expmax, f == 0)) == 0) {
+    _grisu2(f, e, lower_closer, digits, &len, &K);
+    n = bits >> 63;
+    *dst = '-';
+    n += _write_shortest(dst + n, digits, len, K);
+  }
+  buf->end += n;
+  buf->b[buf->end] = '\0';
+}
+
+void strbuf_append_double(StrBuf *buf, double value)
+{
+  uint64_t bits, f;
+  memcpy(&bits, &value, sizeof(bits));
+  int be = (int)((bits >> 52) & 0x7FF);
+  f = bits & ((1ULL << 52) - 1);
+  int e = be ? be - 1075 : -1074;
+  if(be && be != 0x7FF) f |= 1ULL << 52;
+  _append_shortest(buf, bits, f, e, be == 0x7FF, be > 1 && f == (1ULL << 52));
+}
+
+void strbuf_append_float(StrBuf *buf, float value)
+{
+  uint32_t b32;
+  memcpy(&b32, &value, sizeof(b32));
+  uint64_t f = b32 & ((1UL << 23) - 1), bits = (uint64_t)b32 << 32;
+  int be = (int)((b32 >> 23) & 0xFF);
+  int e = be ? be - 150 : -149;
+  if(be && be != 0xFF) f |= 1UL << 23;
+  _append_shortest(buf, bits, f, e, be == 0xFF, be > 1 && f == (1UL << 23));
+}
+
+/*
+ * Fixed and scientific notation with a given precision, rounded exactly like
+ * printf. Values whose digits fit in 53 bits are scaled by an exact power of
+ * ten with an error-free product (or division remainder) so the rounding
+ * direction is known exactly. Anything else goes through snprintf with the
+ * decimal point put back to '.'.
+ */
+
+static const double _pow10_dbl[23] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define DBL_EXACT_INT 9007199254740992.0 /* 2^53 */
+
+// Exact tricks below need each double operation rounded once (not x87)
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+  #define STRBUF_EXACT_DOUBLE 1
+#else
+  #define STRBUF_EXACT_DOUBLE 0
+#endif
+
+// hi + lo == a * b exactly
+static inline void _two_prod(double a, double b, double *hi, double *lo)
+{
+  *hi = a * b;
+#if defined(__FP_FAST_FMA)
+  *lo = __builtin_fma(a, b, -*hi);
+#else
+  const double split = 134217729.0; // 2^27 + 1
+  double c, ah, al, bh, bl;
+  c = split * a; ah = c - (c - a); al = a - ah;
+  c = split * b; bh = c - (c - b); bl = b - bh;
+  *lo = ((ah * bh - *hi) + ah * bl + al * bh) + al * bl;
+#endif
+}
+
+// Round x * 10^k (x >= 0, |k| <= 22) to the nearest integer, ties to even,
+// as if computed exactly. Returns 0 if the result may not fit in 53 bits
+static int _round_scaled(double x, int k, uint64_t *result)
+{
+  double hi, lo, ph, pl;
+  if(!STRBUF_EXACT_DOUBLE) return 0;
+  if(k >= 0) {
+    _two_prod(x, _pow10_dbl[k], &hi, &lo);
+  } else {
+    // x / d = hi + r / d with the remainder r exact
+    hi = x / _pow10_dbl[-k];
+    _two_prod(hi, _pow10_dbl[-k], &ph, &pl);
+    lo = (x - ph) - pl;
+  }
+  if(!(hi < DBL_EXACT_INT / 2)) return 0;
+
+  // |lo| is under half an ulp of hi, so only its sign matters
+  uint64_t q = (uint64_t)hi;
+  double frac = hi - (double)q;
+  if(frac > 0.5 || (frac == 0.5 && (lo > 0 || (lo == 0 && (q & 1))))) q++;
+  *result = q;
+  return 1;
+}
+
+// printf writes the locale's decimal point, replace it with '.'
+static size_t _c_decimal_point(char *s, size_t len)
+{
+  size_t i = (s[0] == '-'), j;
+  while(i < len && s[i] >= '0' && s[i] <= '9') i++;
+  if(i == len || s[i] == 'e' || s[i] == '.') return len;
+  for(j = i; j < len && !(s[j] >= '0' && s[j] <= '9') && s[j] != 'e'; j++) {}
+  s[i] = '.';
+  memmove(s + i + 1, s + j, len - j);
+  return len - (j - i - 1);
+}
+
+static void _append_double_printf(StrBuf *buf, double value, size_t prec,
+                                  char conv)
+{
+  char fmt[5] = {'%', '.', '*', conv, '\0'};
+  int n = snprintf(NULL, 0, fmt, (int)prec, value);
+  strbuf_ensure_capacity(buf, buf->end + n);
+  snprintf(buf->b + buf->end, n + 1, fmt, (int)prec, value);
+  buf->end += _c_decimal_point(buf->b + buf->end, n);
+  buf->b[buf->end] = '\0';
+}
+
+// Write the num_digits digits of value, with leading zeros
+static inline void _write_ulong_zeros(char *dst, uint64_t value,
+                                      size_t num_digits)
+{
+  size_t n = num_of_digits(value);
+  if(n < num_digits) memset(dst, '0', num_digits - n);
+  _write_ulong(dst + num_digits - n, value, n);
+}
+
+// Special values of a double, as printf would write them for %f and %e
+static size_t _double_special(char *dst, double value)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  int expmax = ((bits >> 52) & 0x7FF) == 0x7FF;
+  return expmax ? _write_special(dst, bits, 1, (bits << 12) == 0) : 0;
+}
+
+void strbuf_append_double_fixed(StrBuf *buf, double value, size_t prec)
+{
+  uint64_t n;
+  size_t len, int_digits, neg = value < 0 || (value == 0 && 1 / value < 0);
+  double x = neg ? -value : value;
+
+  strbuf_ensure_capacity(buf, buf->end + 4);
+  if((len = _double_special(buf->b + buf->end, value)) > 0) {
+    buf->end += len;
+    buf->b[buf->end] = '\0';
+    return;
+  }
+
+  if(prec > 17 || !_round_scaled(x, (int)prec, &n)) {
+    _append_double_printf(buf, value, prec, 'f');
+    return;
+  }
+
+  // n = integer part * 10^prec + fraction
+  uint64_t p = (uint64_t)_pow10_dbl[prec], ipart = n / p, fpart = n % p;
+  int_digits = num_of_digits(ipart);
+  len = neg + int_digits + (prec > 0) + prec;
+  strbuf_ensure_capacity(buf, buf->end + len);
+  char *dst = buf->b + buf->end;
+  *dst = '-';
+  _write_ulong(dst + neg, ipart, int_digits);
+  if(prec) {
+    dst[neg + int_digits] = '.';
+    _write_ulong_zeros(dst + neg + int_digits + 1, fpart, prec);
+  }
+  buf->end += len;
+  buf->b[buf->end] = '\0';
+}
+
+void strbuf_append_double_sci(StrBuf *buf, double value, size_t prec)
+{
+  uint64_t bits, n = 0;
+  size_t len, neg = value < 0 || (value == 0 && 1 / value < 0);
+  double x = neg ? -value : value;
+  int dec_exp = 0, k, tries;
+
+  strbuf_ensure_capacity(buf, buf->end + 4);
+  if((len = _double_special(buf->b + buf->end, value)) > 0) {
+    buf->end += len;
+    buf->b[buf->end] = '\0';
+    return;
+  }
+
+  // Need prec+1 significant digits n in [10^prec, 10^(prec+1)), from
+  // x * 10^(prec - dec_exp). Start from floor(e2 * log10(2)), which is at most
+  // one below floor(log10(x)), and step up when n has too many digits
+  // (either from the estimate or rounding up to a power of ten)
+  int ok = (prec <= 14);
+  if(ok && x > 0) {
+    memcpy(&bits, &x, sizeof(bits));
+    double t = ((int)(bits >> 52) - 1023) * 0.30102999566398114;
+    dec_exp = (int)t;
+    if(dec_exp > t) dec_exp--;
+    for(tries = 0, ok = 0; tries < 3 && !ok; tries++) {
+      k = (int)prec - dec_exp;
+      if(k < -22 || k > 22 || !_round_scaled(x, k, &n)) break;
+      if(n >= (uint64_t)_pow10_dbl[prec + 1]) dec_exp++;
+      else ok = 1;
+    }
+  }
+
+  if(!ok) {
+    _append_double_printf(buf, value, prec, 'e');
+    return;
+  }
+
+  len = neg + 1 + (prec > 0) + prec + 4 + (dec_exp <= -100 || dec_exp >= 100);
+  strbuf_ensure_capacity(buf, buf->end + len);
+  char *dst = buf->b + buf->end;
+  char digits[20];
+  *dst = '-';
+  dst += neg;
+  _write_ulong_zeros(digits, n, prec + 1);
+  *dst++ = digits[0];
+  if(prec) { *dst++ = '.'; memcpy(dst, digits + 1, prec); dst += prec; }
+  dst += _write_exp10(dst, dec_exp);
+  buf->end = dst - buf->b;
+  buf->b[buf->end] = '\0';
+}
+
+/*****************/
+/* Parse Numbers */
+/*****************/
+
+// Parse numbers from (ptr,len), which need not be null terminated. Nothing
+// is skipped before the number. Returns the number of chars consumed, or 0 if
+// there is no number (or it overflows), in which case *val is not set.
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  #define STRBUF_SWAR_DIGITS 1
+#else
+  #define STRBUF_SWAR_DIGITS 0
+#endif
+
+// If s[0..7] are all digits, set *v to their value and return 1
+static inline int _swar_digits8(const char *s, uint64_t *v)
+{
+#if STRBUF_SWAR_DIGITS
+  uint64_t w = _swar_load(s);
+  // Each byte is 0x30-0x39: high nibble 3, and adding 6 does not carry
+  if(((w & 0xF0F0F0F0F0F0F0F0ULL) |
+      (((w + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+     != 0x3333333333333333ULL) return 0;
+  // Combine pairs of digits, then pairs of pairs, then the two halves
+  w -= 0x3030303030303030ULL;
+  w = (w * 10) + (w >> 8);
+  w = (((w & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+       (((w >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+  *v = w;
+  return 1;
+#else
+  (void)s; (void)v;
+  return 0;
+#endif
+}
+
+// Digits at the start of s, returns number consumed. Sets *overflow if the
+// value does not fit in 64 bits.
+static size_t _parse_digits_u64(const char *s, size_t len, uint64_t *val,
+                                int *overflow)
+{
+  size_t i = 0, start;
+  uint64_t v = 0, w;
+  unsigned d;
+
+  while(i < len && s[i] == '0') i++;
+  start = i;
+
+  // At most 16 digits 8 at a time, which cannot overflow
+  while(i + 8 <= len && i - start < 16 && _swar_digits8(s + i, &w)) {
+    v = v * 100000000 + w;
+    i += 8;
+  }
+
+  *overflow = 0;
+  for(; i < len && (d = (unsigned char)s[i] - '0') < 10; i++) {
+    if(i - start >= 19 && (i - start > 19 || v > (UINT64_MAX - d) / 10))
+      *overflow = 1;
+    v = v * 10 + d;
+  }
+  *val = v;
+  return i;
+}
+
+size_t strbuf_parse_u64(const char *str, size_t len, uint64_t *val)
+{
+  size_t i = (len > 0 && str[0] == '+'), n;
+  int overflow;
+  uint64_t v;
+  n = _parse_digits_u64(str + i, len - i, &v, &overflow);
+  if(n == 0 || overflow) return 0;
+  *val = v;
+  return i + n;
+}
+
+size_t strbuf_parse_i64(const char *str, size_t len, int64_t *val)
+{
+  size_t i = (len > 0 && (str[0] == '+' || str[0] == '-')), n;
+  int overflow, neg = (i && str[0] == '-');
+  uint64_t v;
+  n = _parse_digits_u64(str + i, len - i, &v, &overflow);
+  if(n == 0 || overflow || v > (uint64_t)INT64_MAX + neg) return 0;
+  *val = !neg ? (int64_t)v : (v == (uint64_t)INT64_MAX + 1 ? INT64_MIN : -(int64_t)v);
+  return i + n;
+}
+
+// Case insensitive match of a lowercase word at the start of s
+static inline size_t _match_word(const char *s, size_t len, const char *word)
+{
+  size_t i;
+  for(i = 0; word[i]; i++)
+    if(i >= len || (s[i] | 0x20) != word[i]) return 0;
+  return i;
+}
+
+// Slow path: strtod on a copy, with '.' swapped for the locale's decimal
+// point so the result does not depend on the locale
+static double _strtod_c(const char *str, size_t len)
+{
+  const char *point = localeconv()->decimal_point;
+  size_t i, j, plen = strlen(point);
+  char tmp[128], *buf = tmp;
+  double v;
+
+  if(len * plen + 1 > sizeof(tmp) && (buf = malloc(len * plen + 1)) == NULL) {
+    fprintf(stderr, "[%s:%i] Out of memory\n", __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+  for(i = j = 0; i < len; i++) {
+    if(str[i] == '.') { memcpy(buf + j, point, plen); j += plen; }
+    else buf[j++] = str[i];
+  }
+  buf[j] = '\0';
+  v = strtod(buf, NULL);
+  if(buf != tmp) free(buf);
+  return v;
+}
+
+// [+-] digits [. digits] [e [+-] digits], or inf, infinity, nan
+// Parsed exactly with Clinger's fast path when the digits fit in 53 bits and
+// the power of ten is exact, otherwise by strtod.
+size_t strbuf_parse_double(const char *str, size_t len, double *val)
+{
+  size_t i = 0, start, ndigits = 0, nsig = 0, n;
+  int neg = 0, truncated = !STRBUF_EXACT_DOUBLE, dec_exp = 0, overflow;
+  uint64_t w = 0, blk, e;
+  unsigned d;
+  double v;
+
+  if(len > 0 && (str[0] == '+' || str[0] == '-')) neg = (str[i++] == '-');
+  start = i;
+
+  if(i < len && (unsigned char)str[i] - '0' >= 10 && str[i] != '.') {
+    if((n = _match_word(str + i, len - i, "nan")) > 0) v = NAN;
+    else if((n = _match_word(str + i, len - i, "inf")) > 0) {
+      n += _match_word(str + i + n, len - i - n, "inity");
+      v = INFINITY;
+    }
+    else return 0;
+    *val = neg ? -v : v;
+    return i + n;
+  }
+
+  // Up to 19 significant digits are kept in w, the rest only move dec_exp.
+  // `truncated` sends inexact cases to strtod
+  for(; i < len && (d = (unsigned char)str[i] - '0') < 10; i++, ndigits++) {
+    if(nsig > 0 && nsig + 8 <= 19 && i + 8 <= len &&
+       _swar_digits8(str + i, &blk)) {
+      w = w * 100000000 + blk; nsig += 8; i += 7; ndigits += 7;
+    }
+    else if(nsig < 19) { w = w * 10 + d; nsig += (w > 0); }
+    else { dec_exp++; truncated |= (d != 0); }
+  }
+
+  if(i < len && str[i] == '.') {
+    for(i++; i < len && (d = (unsigned char)str[i] - '0') < 10; i++, ndigits++) {
+      if(nsig > 0 && nsig + 8 <= 19 && i + 8 <= len &&
+         _swar_digits8(str + i, &blk)) {
+        w = w * 100000000 + blk; nsig += 8; dec_exp -= 8; i += 7; ndigits += 7;
+      }
+      else if(nsig < 19) { w = w * 10 + d; nsig += (w > 0); dec_exp--; }
+      else truncated |= (d != 0);
+    }
+  }
+
+  if(ndigits == 0) return 0;
+
+  // Exponent, only consumed if it has digits
+  if(i < len && (str[i] | 0x20) == 'e') {
+    size_t j = i + 1 + (i + 1 < len && (str[i+1] == '+' || str[i+1] == '-'));
+    n = _parse_digits_u64(str + j, len - j, &e, &overflow);
+    if(n > 0) {
+      if(overflow || e > 100000) e = 100000; // under/overflows anyway
+      dec_exp += str[j-1] == '-' ? -(int)e : (int)e;
+      i = j + n;
+    }
+  }
+
+  if(w == 0) v = 0;
+  else if(!truncated && w <= (uint64_t)DBL_EXACT_INT &&
+          dec_exp >= -22 && dec_exp <= 22) {
+    v = dec_exp < 0 ? (double)w / _pow10_dbl[-dec_exp]
+                  : (double)w * _pow10_dbl[dec_exp];
+  }
+  else if(!truncated && dec_exp > 22 && dec_exp <= 22 + 15 &&
+          w <= (uint64_t)DBL_EXACT_INT / (uint64_t)_pow10_dbl[dec_exp - 22]) {
+    // e.g. 12e30 = 12000000 * 1e22, both exact
+    v = (double)(w * (uint64_t)_pow10_dbl[dec_exp - 22]) * 1e22;
+  }
+  else {
+    v = _strtod_c(str + start, i - start);
+  }
+
+  *val = neg ? -v : v;
+  return i;
+}
+
+/********************/
+/* Append functions */
+/********************/
+
+// Append string converted to lowercase
+void strbuf_append_strn_lc(StrBuf *buf, const char *str, size_t len)
+{
+  strbuf_ensure_capacity(buf, buf->end + len);
+  char *to = buf->b + buf->end;
+  const char *end = str + len;
+  for(; str < end; str++, to++) *to = tolower(*str);
+  buf->end += len;
+  buf->b[buf->end] = '\0';
+}
+
+// Append string converted to uppercase
+void strbuf_append_strn_uc(StrBuf *buf, const char *str, size_t len)
+{
+  strbuf_ensure_capacity(buf, buf->end + len);
+  char *to = buf->b + buf->end;
+  const char *end = str + len;
+  for(; str < end; str++, to++) *to = toupper(*str);
+  buf->end += len;
+  buf->b[buf->end] = '\0';
+}
+
+// Append string converted to ASCII lowercase / uppercase
+void strbuf_append_strn_lc_ascii(StrBuf *buf, const char *str, size_t len)
+{
+  strbuf_ensure_capacity_update_ptr(buf, buf->end + len, &str);
+  _ascii_case(buf->b + buf->end, str, len, 'A', 'Z');
+  buf->end += len;
+  buf->b[buf->end] = '\0';
+}
+
+void strbuf_append_strn_uc_ascii(StrBuf *buf, const char *str, size_t len)
+{
+  strbuf_ensure_capacity_update_ptr(buf, buf->end + len, &str);
+  _ascii_case(buf->b + buf->end, str, len, 'a', 'z');
+  buf->end += len;
+  buf->b[buf->end] = '\0';
+}
+
+// Append len bytes as 2*len hex digits. data may point into buf
+void strbuf_append_hex_encode(StrBuf *buf, const void *data, size_t len,
+                              char upper)
+{
+  const char *src = (const char*)data;
+  strbuf_ensure_capacity_update_ptr(buf, buf->end + 2*len, &src);
+  _hex_encode(buf->b + buf->end, src, len, upper);
+  buf->end += 2*len;
+  buf->b[buf->end] = '\0';
+}
+
+// Append bytes decoded from hex digits. Returns the number of chars of hex
+// decoded, which is less than len if a non-hex char (or odd char) was found
+size_t strbuf_append_hex_decode(StrBuf *buf, const char *hex, size_t len)
+{
+  strbuf_ensure_capacity_update_ptr(buf, buf->end + len/2, &hex);
+  size_t n = _hex_decode(buf->b + buf->end, hex, len);
+  buf->end += n;
+  buf->b[buf->end] = '\0';
+  return 2*n;
+}
+
+// Append char `c` `n` times
+void strbuf_append_charn(StrBuf *buf, char c, size_t n)
+{
+  strbuf_ensure_capacity(buf, buf->end + n);
+  memset(buf->b+buf->end, c, n);
+  buf->end += n;
+  buf->b[buf->end] = '\0';
+}
+
+// Append all segments with one capacity check
+void strbuf_append_segs(StrBuf *buf, const StrBufSeg *segs, size_t n)
+{
+  size_t i, len = 0;
+  const StrBufSeg *seg, *end = segs + n;
+
+  for(seg = segs; seg < end; seg++) {
+    switch(seg->type) {
+      case STRBUF_SEG_STR: len += seg->v.str.len; break;
+      case STRBUF_SEG_CHAR: len++; break;
+      case STRBUF_SEG_LONG:
+        len += (seg->v.l < 0) + num_of_digits(_ulong_abs(seg->v.l));
+        break;
+      case STRBUF_SEG_ULONG: len += num_of_digits(seg->v.ul); break;
+    }
+  }
+
+  // Strings may point into buf, which may move
+  const char *oldbuf = buf->b;
+  size_t oldcap = buf->size;
+  strbuf_ensure_capacity(buf, buf->end + len);
+
+  char *dst = buf->b + buf->end;
+  const char *str;
+  unsigned long ul;
+
+  for(seg = segs; seg < end; seg++) {
+    switch(seg->type) {
+      case STRBUF_SEG_STR:
+        str = seg->v.str.p;
+        if(str >= oldbuf && str < oldbuf + oldcap) str = buf->b + (str - oldbuf);
+        if(seg->v.str.len) memcpy(dst, str, seg->v.str.len);
+        dst += seg->v.str.len;
+        break;
+      case STRBUF_SEG_CHAR:
+        *dst++ = seg->v.c;
+        break;
+      case STRBUF_SEG_LONG:
+        if(seg->v.l < 0) *dst++ = '-';
+        ul = _ulong_abs(seg->v.l);
+        _write_ulong(dst, ul, i = num_of_digits(ul));
+        dst += i;
+        break;
+      case STRBUF_SEG_ULONG:
+        _write_ulong(dst, seg->v.ul, i = num_of_digits(seg->v.ul));
+        dst += i;
+        break;
+    }
+  }
+
+  buf->end += len;
+  buf->b[buf->end] = '\0';
+}
+
+// Remove \r and \n characters from the end of this StrBuf
+// Returns the number of characters removed
+size_t strbuf_chomp(StrBuf *sbuf)
+{
+  strbuf_unshare(sbuf);
+  size_t old_len = sbuf->end;
+  sbuf->end = string_chomp(sbuf->b, sbuf->end);
+  return old_len - sbuf->end;
+}
+
+// Reverse a string
+void strbuf_reverse(StrBuf *sbuf)
+{
+  strbuf_unshare(sbuf);
+  _reverse(sbuf->b, sbuf->b, sbuf->end, 0);
+}
+
+// Reverse complement DNA in place
+void strbuf_revcomp(StrBuf *sbuf)
+{
+  strbuf_unshare(sbuf);
+  _reverse(sbuf->b, sbuf->b, sbuf->end, 1);
+}
+
+// Append the reverse complement of src. src may point into buf
+void strbuf_append_revcomp(StrBuf *buf, const char *src, size_t len)
+{
+  strbuf_ensure_capacity_update_ptr(buf, buf->end + len, &src);
+  _reverse(buf->b + buf->end, src, len, 1);
+  buf->end += len;
+  buf->b[buf->end] = '\0';
+}
+
+char* strbuf_substr(const StrBuf *sbuf, size_t start, size_t len)
+{
+  _bounds_check_read_range(sbuf, start, len);
+
+  char *new_string = malloc((len+1) * sizeof(char));
+  strncpy(new_string, sbuf->b + start, len);
+  new_string[len] = '\0';
+
+  return new_string;
+}
+
+void strbuf_to_uppercase(StrBuf *sbuf)
+{
+  strbuf_unshare(sbuf);
+  char *pos, *end = sbuf->b + sbuf->end;
+  for(pos = sbuf->b; pos < end; pos++) *pos = (char)toupper(*pos);
+}
+
+void strbuf_to_lowercase(StrBuf *sbuf)
+{
+  strbuf_unshare(sbuf);
+  char *pos, *end = sbuf->b + sbuf->end;
+  for(pos = sbuf->b; pos < end; pos++) *pos = (char)tolower(*pos);
+}
+
+void strbuf_to_uppercase_ascii(StrBuf *sbuf)
+{
+  strbuf_unshare(sbuf);
+  _ascii_case(sbuf->b, sbuf->b, sbuf->end, 'a', 'z');
+}
+
+void strbuf_to_lowercase_ascii(StrBuf *sbuf)
+{
+  strbuf_unshare(sbuf);
+  _ascii_case(sbuf->b, sbuf->b, sbuf->end, 'A', 'Z');
+}
+
+// Copy a string to this StrBuf, overwriting any existing characters
+// Note: dst_pos + len can be longer the the current dst StrBuf
+void strbuf_copy(StrBuf *dst, size_t dst_pos, const char *src, size_t len)
+{
+  if(src == NULL || len == 0) return;
+
+  _bounds_check_insert(dst, dst_pos);
+
+  // Check if dst buffer can handle string
+  // src may have pointed to dst, which has now moved
+  size_t newlen = MAX(dst_pos + len, dst->end);
+  strbuf_ensure_capacity_update_ptr(dst, newlen, &src);
+
+  // memmove instead of strncpy, as it can handle overlapping regions
+  memmove(dst->b+dst_pos, src, len * sizeof(char));
+
+  if(dst_pos + len > dst->end)
+  {
+    // Extended string - add '\0' char
+    dst->end = dst_pos + len;
+    dst->b[dst->end] = '\0';
+  }
+}
+
+// Insert: copy to a StrBuf, shifting any existing characters along
+void strbuf_insert(StrBuf *dst, size_t dst_pos, const char *src, size_t len)
+{
+  if(src == NULL || len == 0) return;
+
+  _bounds_check_insert(dst, dst_pos);
+
+  // Check if dst buffer has capacity for inserted string plus \0
+  // src may have pointed to dst, which will be moved in realloc when
+  // calling ensure capacity
+  strbuf_ensure_capacity_update_ptr(dst, dst->end + len, &src);
+
+  char *insert = dst->b+dst_pos;
+
+  // dst_pos could be at the end (== dst->end)
+  if(dst_pos < dst->end)
+  {
+    // Shift some characters up
+    memmove(insert + len, insert, (dst->end - dst_pos) * sizeof(char));
+    STRBUF_STAT_ADD(memmove_bytes, dst->end - dst_pos);
+
+    if(src >= dst->b && src < dst->b + dst->size)
+    {
+      // src/dst strings point to the same string in memory
+      if(src < insert) memmove(insert, src, len * sizeof(char));
+      else if(src > insert) memmove(insert, src+len, len * sizeof(char));
+    }
+    else memmove(insert, src, len * sizeof(char));
+  }
+  else memmove(insert, src, len * sizeof(char));
+
+  // Update size
+  dst->end += len;
+  dst->b[dst->end] = '\0';
+}
+
+// Overwrite dst_pos..(dst_pos+dst_len-1) with src_len chars from src
+// if dst_len != src_len, content to the right of dst_len is shifted
+// Example:
+//   strbuf_set(sbuf, "aaabbccc");
+//   char *data = "xxx";
+//   strbuf_overwrite(sbuf,3,2,data,strlen(data));
+//   // sbuf is now "aaaxxxccc"
+//   strbuf_overwrite(sbuf,3,2,"_",1);
+//   // sbuf is now "aaa_ccc"
+void strbuf_overwrite(StrBuf *dst, size_t dst_pos, size_t dst_len,
+                      const char *src, size_t src_len)
+{
+  _bounds_check_read_range(dst, dst_pos, dst_len);
+
+  if(src == NULL) return;
+  if(dst_len == src_len) strbuf_copy(dst, dst_pos, src, src_len);
+  size_t newlen = dst->end + src_len - dst_len;
+
+  strbuf_ensure_capacity_update_ptr(dst, newlen, &src);
+
+  if(src >= dst->b && src < dst->b + dst->size)
+  {
+    if(src_len < dst_len) {
+      // copy
+      memmove(dst->b+dst_pos, src, src_len * sizeof(char));
+      // resize (shrink)
+      memmove(dst->b+dst_pos+src_len, dst->b+dst_pos+dst_len,
+              (dst->end-dst_pos-dst_len) * sizeof(char));
+      STRBUF_STAT_ADD(memmove_bytes, dst->end-dst_pos-dst_len);
+    }
+    else
+    {
+      // Buffer is going to grow and src points to this buffer
+
+      // resize (grow)
+      memmove(dst->b+dst_pos+src_len, dst->b+dst_pos+dst_len,
+              (dst->end-dst_pos-dst_len) * sizeof(char));
+      STRBUF_STAT_ADD(memmove_bytes, dst->end-dst_pos-dst_len);
+
+      char *tgt = dst->b + dst_pos;
+      char *end = dst->b + dst_pos + src_len;
+
+      if(src < tgt + dst_len)
+      {
+        size_t len = MIN((size_t)(end - src), src_len);
+        memmove(tgt, src, len);
+        tgt += len;
+        src += len;
+        src_len -= len;
+      }
+
+      if(src >= tgt + dst_len)
+      {
+        // shift to account for resizing
+        src += src_len - dst_len;
+        memmove(tgt, src, src_len);
+      }
+    }
+  }
+  else
+  {
+    // resize
+    memmove(dst->b+dst_pos+src_len, dst->b+dst_pos+dst_len,
+            (dst->end-dst_pos-dst_len) * sizeof(char));
+    STRBUF_STAT_ADD(memmove_bytes, dst->end-dst_pos-dst_len);
+    // copy
+    memcpy(dst->b+dst_pos, src, src_len * sizeof(char));
+  }
+
+  dst->end = newlen;
+  dst->b[dst->end] = '\0';
+}
+
+void strbuf_delete(StrBuf *sbuf, size_t pos, size_t len)
+{
+  _bounds_check_read_range(sbuf, pos, len);
+  strbuf_unshare(sbuf);
+  memmove(sbuf->b+pos, sbuf->b+pos+len, sbuf->end-pos-len);
+  STRBUF_STAT_ADD(memmove_bytes, sbuf->end-pos-len);
+  sbuf->end -= len;
+  sbuf->b[sbuf->end] = '\0';
+}
+
+/**************************/
+/*         sprintf        */
+/**************************/
+
+int strbuf_vsprintf(StrBuf *sbuf, size_t pos, const char *fmt, va_list argptr)
+{
+  _bounds_check_insert(sbuf, pos);
+  strbuf_unshare(sbuf);
+
+  // Length of remaining buffer
+  size_t buf_len = sbuf->size - pos;
+  if(buf_len == 0 && !strbuf_resize(sbuf, sbuf->size << 1)) {
+    fprintf(stderr, "%s:%i:Error: Out of memory\n", __FILE__, __LINE__);
+    exit_on_error();
+  }
+
+  // Make a copy of the list of args incase we need to resize buff and try again
+  va_list argptr_cpy;
+  va_copy(argptr_cpy, argptr);
+
+  int num_chars = vsnprintf(sbuf->b+pos, buf_len, fmt, argptr);
+  va_end(argptr);
+
+  // num_chars is the number of chars that would be written (not including '\0')
+  // num_chars < 0 => failure
+  if(num_chars < 0) {
+    fprintf(stderr, "Warning: strbuf_sprintf something went wrong..\n");
+    exit_on_error();
+  }
+
+  // num_chars does not include the null terminating byte
+  if((size_t)num_chars+1 > buf_len)
+  {
+    strbuf_ensure_capacity(sbuf, pos+(size_t)num_chars);
+
+    // now use the argptr copy we made earlier
+    // Don't need to use vsnprintf now, vsprintf will do since we know it'll fit
+    STRBUF_STAT_ADD(sprintf_retries, 1);
+    num_chars = vsprintf(sbuf->b+pos, fmt, argptr_cpy);
+    if(num_chars < 0) {
+      fprintf(stderr, "Warning: strbuf_sprintf something went wrong..\n");
+      exit_on_error();
+    }
+  }
+  va_end(argptr_cpy);
+
+  // Don't need to NUL terminate, vsprintf/vnsprintf does that for us
+
+  // Update length
+  sbuf->end = pos + (size_t)num_chars;
+
+  return num_chars;
+}
+
+// Appends sprintf
+int strbuf_sprintf(StrBuf *sbuf, const char *fmt, ...)
+{
+  va_list argptr;
+  va_start(argptr, fmt);
+  int num_chars = strbuf_vsprintf(sbuf, sbuf->end, fmt, argptr);
+  va_end(argptr);
+
+  return num_chars;
+}
+
+int strbuf_sprintf_at(StrBuf *sbuf, size_t pos, const char *fmt, ...)
+{
+  _bounds_check_insert(sbuf, pos);
+
+  va_list argptr;
+  va_start(argptr, fmt);
+  int num_chars = strbuf_vsprintf(sbuf, pos, fmt, argptr);
+  va_end(argptr);
+
+  return num_chars;
+}
+
+// Does not prematurely end the string if you sprintf within the string
+// (vs at the end)
+int strbuf_sprintf_noterm(StrBuf *sbuf, size_t pos, const char *fmt, ...)
+{
+  _bounds_check_insert(sbuf, pos);
+
+  char last_char;
+  size_t len = sbuf->end;
+
+  // Call vsnprintf with NULL, 0 to get resulting string length without writing
+  va_list argptr;
+  va_start(argptr, fmt);
+  int nchars = vsnprintf(NULL, 0, fmt, argptr);
+  va_end(argptr);
+
+  if(nchars < 0) {
+    fprintf(stderr, "Warning: strbuf_sprintf something went wrong..\n");
+    exit_on_error();
+  }
+
+  // Save overwritten char
+  last_char = (pos+(size_t)nchars < sbuf->end) ? sbuf->b[pos+(size_t)nchars] : 0;
+
+  va_start(argptr, fmt);
+  nchars = strbuf_vsprintf(sbuf, pos, fmt, argptr);
+  va_end(argptr);
+
+  if(nchars < 0) {
+    fprintf(stderr, "Warning: strbuf_sprintf something went wrong..\n");
+    exit_on_error();
+  }
+
+  // Restore length if shrunk, null terminate if extended
+  if(sbuf->end < len) sbuf->end = len;
+  else sbuf->b[sbuf->end] = '\0';
+
+  // Re-instate overwritten character
+  sbuf->b[pos+(size_t)nchars] = last_char;
+
+  return nchars;
+}
+
+
+/*****************/
+/* File handling */
+/*****************/
+
+// StrBuf versions of the stream_buffer.h line readers. These grow the buffer
+// with strbuf_ensure_capacity(), which copes with inline, shared, arena and
+// mmap storage, rather than calling realloc on sbuf->b.
+#define _func_strbuf_readline(name,type_t,__gets)                              \
+  static inline size_t name(type_t file, StrBuf *sbuf)                         \
+  {                                                                            \
+    _READLINE_BODY(file,__gets,sbuf->b,sbuf->end,sbuf->size,                   \
+                   strbuf_ensure_capacity,sbuf);                               \
+  }
+
+#define _func_strbuf_readline_buf(name,type_t,__read)                          \
+  static inline size_t name(type_t file, StreamBuffer *in, StrBuf *sbuf)       \
+  {                                                                            \
+    _READLINE_BUF_BODY(file,in,__read,sbuf->b,sbuf->end,sbuf->size,            \
+                       strbuf_ensure_capacity,sbuf);                           \
+  }
+
+_func_strbuf_readline(_strbuf_freadline,FILE*,fgets2)
+_func_strbuf_readline(_strbuf_gzreadline,gzFile,gzgets2)
+_func_strbuf_readline_buf(_strbuf_freadline_buf,FILE*,fread2)
+_func_strbuf_readline_buf(_strbuf_gzreadline_buf,gzFile,gzread2)
+
+// Reading a FILE
+size_t strbuf_readline(StrBuf *sbuf, FILE *file)
+{
+  strbuf_unshare(sbuf);
+  return _strbuf_freadline(file, sbuf);
+}
+
+size_t strbuf_gzreadline(StrBuf *sbuf, gzFile file)
+{
+  strbuf_unshare(sbuf);
+  return _strbuf_gzreadline(file, sbuf);
+}
+
+// Reading a FILE
+size_t strbuf_readline_buf(StrBuf *sbuf, FILE *file, StreamBuffer *in)
+{
+  strbuf_unshare(sbuf);
+  return _strbuf_freadline_buf(file, in, sbuf);
+}
+
+size_t strbuf_gzreadline_buf(StrBuf *sbuf, gzFile file, StreamBuffer *in)
+{
+  strbuf_unshare(sbuf);
+  return _strbuf_gzreadline_buf(file, in, sbuf);
+}
+
+size_t strbuf_skipline(FILE* file)
+{
+  return fskipline(file);
+}
+
+size_t strbuf_gzskipline(gzFile file)
+{
+  return gzskipline(file);
+}
+
+size_t strbuf_skipline_buf(FILE* file, StreamBuffer *in)
+{
+  return (size_t)fskipline_buf(file, in);
+}
+
+size_t strbuf_gzskipline_buf(gzFile file, StreamBuffer *in)
+{
+  return (size_t)gzskipline_buf(file, in);
+}
+
+#define _func_read_nonempty(name,type_t,__readline)                            \
+  size_t name(StrBuf *line, type_t fh)                                         \
+  {                                                                            \
+    size_t i, origlen = line->end;                                             \
+    while(__readline(line, fh) > 0) {                                          \
+      i = origlen;                                                             \
+      while(i < line->end && (line->b[i] == '\r' || line->b[i] == '\n'))       \
+        i++;                                                                   \
+      if(i < line->end) return line->end - origlen;                            \
+      line->end = origlen;                                                     \
+      line->b[line->end] = '\0';                                               \
+    }                                                                          \
+    return 0;                                                                  \
+  }
+
+_func_read_nonempty(strbuf_readline_nonempty,FILE*,strbuf_readline)
+_func_read_nonempty(strbuf_gzreadline_nonempty,gzFile,strbuf_gzreadline)
+
+
+#define _func_read(name,type_t,__read) \
+  size_t name(StrBuf *sbuf, type_t file, size_t len)                           \
+  {                                                                            \
+    if(len == 0) return 0;                                                     \
+    strbuf_ensure_capacity(sbuf, sbuf->end + len);                             \
+    long nread;                                                                \
+    if((nread = (long)__read(file,sbuf->b+sbuf->end,len)) <= 0) return 0;      \
+    sbuf->end += (size_t)nread;                                                \
+    return (size_t)nread;                                                      \
+  }
+
+_func_read(strbuf_gzread, gzFile, gzread2)
+_func_read(strbuf_fread, FILE*, fread2)
+
+// read FILE
+// returns number of characters read
+// or 0 if EOF
+size_t strbuf_reset_readline(StrBuf *sbuf, FILE *file)
+{
+  strbuf_reset(sbuf);
+  return strbuf_readline(sbuf, file);
+}
+
+// read gzFile
+// returns number of characters read
+// or 0 if EOF
+size_t strbuf_reset_gzreadline(StrBuf *sbuf, gzFile file)
+{
+  strbuf_reset(sbuf);
+  return strbuf_gzreadline(sbuf, file);
+}
+
+/********************/
+/*  Character sets  */
+/********************/
+
+const StrCharSet strcharset_space = {{
+  (1ULL << ' ') | (1ULL << '\t') | (1ULL << '\n') |
+  (1ULL << '\v') | (1ULL << '\f') | (1ULL << '\r'), 0, 0, 0
+}};
+
+void strcharset_init(StrCharSet *set, const char *list)
+{
+  memset(set, 0, sizeof(StrCharSet));
+  for(; *list; list++) strcharset_add(set, *list);
+}
+
+size_t string_span_set(const char *str, size_t len, const StrCharSet *set)
+{
+  return _span_set(str, len, set);
+}
+
+size_t string_rspan_set(const char *str, size_t len, const StrCharSet *set)
+{
+  return _rspan_set(str, len, set);
+}
+
+size_t string_cspan_set(const char *str, size_t len, const StrCharSet *set)
+{
+  return _cspan_set(str, len, set);
+}
+
+size_t string_span_space(const char *str, size_t len)
+{
+  return _span_space(str, len);
+}
+
+size_t string_rspan_space(const char *str, size_t len)
+{
+  return _rspan_space(str, len);
+}
+
+/**********/
+/*  trim  */
+/**********/
+
+// Remove the first `start` chars by moving the rest down
+static void _strbuf_drop_start(StrBuf *sbuf, size_t start)
+{
+  if(start != 0)
+  {
+    strbuf_unshare(sbuf);
+    sbuf->end -= start;
+    memmove(sbuf->b, sbuf->b+start, sbuf->end * sizeof(char));
+    STRBUF_STAT_ADD(memmove_bytes, sbuf->end);
+    sbuf->b[sbuf->end] = '\0';
+  }
+}
+
+// Remove the last `n` chars
+static void _strbuf_drop_end(StrBuf *sbuf, size_t n)
+{
+  if(n != 0)
+  {
+    strbuf_unshare(sbuf);
+    sbuf->b[sbuf->end -= n] = '\0';
+  }
+}
+
+// Trim whitespace characters from the start and end of a string
+void strbuf_trim(StrBuf *sbuf)
+{
+  _strbuf_drop_start(sbuf, strbuf_trim_offset(sbuf));
+}
+
+// Trim the characters listed in `list` from the left of `sbuf`
+// `list` is a null-terminated string of characters
+void strbuf_ltrim(StrBuf *sbuf, const char *list)
+{
+  StrCharSet set;
+  strcharset_init(&set, list);
+  _strbuf_drop_start(sbuf, string_span_set(sbuf->b, sbuf->end, &set));
+}
+
+// Trim the characters listed in `list` from the right of `sbuf`
+// `list` is a null-terminated string of characters
+void strbuf_rtrim(StrBuf *sbuf, const char *list)
+{
+  if(sbuf->end == 0)
+    return;
+
+  StrCharSet set;
+  strcharset_init(&set, list);
+  _strbuf_drop_end(sbuf, string_rspan_set(sbuf->b, sbuf->end, &set));
+}
+
+// Trim characters in `set` from both ends
+void strbuf_trim_set(StrBuf *sbuf, const StrCharSet *set)
+{
+  _strbuf_drop_start(sbuf, strbuf_trim_set_offset(sbuf, set));
+}
+
+// Trim trailing whitespace, return the number of leading whitespace chars
+size_t strbuf_trim_offset(StrBuf *sbuf)
+{
+  if(sbuf->end == 0)
+    return 0;
+
+  _strbuf_drop_end(sbuf, _rspan_space(sbuf->b, sbuf->end));
+  return _span_space(sbuf->b, sbuf->end);
+}
+
+size_t strbuf_trim_set_offset(StrBuf *sbuf, const StrCharSet *set)
+{
+  if(sbuf->end == 0)
+    return 0;
+
+  _strbuf_drop_end(sbuf, string_rspan_set(sbuf->b, sbuf->end, set));
+  return string_span_set(sbuf->b, sbuf->end, set);
+}
+
+/*********************/
+/*  Count / replace  */
+/*********************/
+
+size_t strbuf_count_char(const StrBuf *sbuf, char c)
+{
+  return _count_char(sbuf->b, sbuf->end, c);
+}
+
+size_t strbuf_count_set(const StrBuf *sbuf, const StrCharSet *set)
+{
+  return _count_set(sbuf->b, sbuf->end, set);
+}
+
+// A shared buffer is only copied if there is something to replace
+
+size_t strbuf_replace_char(StrBuf *sbuf, char from, char to)
+{
+  if(strbuf_is_shared(sbuf) && _count_char(sbuf->b, sbuf->end, from) == 0)
+    return 0;
+  strbuf_unshare(sbuf);
+  return _replace_char(sbuf->b, sbuf->end, from, to);
+}
+
+size_t strbuf_replace_set(StrBuf *sbuf, const StrCharSet *set, char to)
+{
+  if(strbuf_is_shared(sbuf) && _count_set(sbuf->b, sbuf->end, set) == 0)
+    return 0;
+  strbuf_unshare(sbuf);
+  return _replace_set(sbuf->b, sbuf->end, set, to);
+}
+
+/***************/
+/*  Searching  */
+/***************/
+
+size_t string_find(const char *str, size_t hlen, const char *needle, size_t len)
+{
+  return _find(str, hlen, needle, len);
+}
+
+size_t string_rfind(const char *str, size_t hlen, const char *needle, size_t len)
+{
+  return _rfind(str, hlen, needle, len);
+}
+
+size_t strbuf_find(const StrBuf *sbuf, size_t pos, const char *needle, size_t len)
+{
+  _bounds_check_insert(sbuf, pos);
+  size_t i = _find(sbuf->b + pos, sbuf->end - pos, needle, len);
+  return i == STRBUF_NPOS ? i : pos + i;
+}
+
+size_t strbuf_rfind(const StrBuf *sbuf, size_t pos, const char *needle, size_t len)
+{
+  // Matches must start at or before pos
+  size_t hlen = sbuf->end;
+  if(pos < hlen && len <= hlen - pos) hlen = pos + len;
+  return _rfind(sbuf->b, hlen, needle, len);
+}
+
+size_t strbuf_find_all(const StrBuf *sbuf, const char *needle, size_t len,
+                       size_t *offsets, size_t max)
+{
+  size_t n = 0, pos = 0, i;
+  if(len == 0) return 0;
+  while((i = _find(sbuf->b + pos, sbuf->end - pos, needle, len)) != STRBUF_NPOS) {
+    n = _add_offset(offsets, max, n, pos + i);
+    pos += i + len;
+  }
+  return n;
+}
+
+// Count non-overlapping matches, then rewrite left to right. If the string
+// grows, first move it to the end of the resized buffer so the output never
+// overtakes the input.
+size_t strbuf_replace_all(StrBuf *sbuf, const char *from, size_t from_len,
+                          const char *to, size_t to_len)
+{
+  if(from_len == 0) return 0;
+
+  size_t n = strbuf_find_all(sbuf, from, from_len, NULL, 0);
+  if(n == 0) return 0;
+
+  size_t oldlen = sbuf->end, newlen = oldlen - n * from_len + n * to_len;
+  size_t shift = newlen > oldlen ? newlen - oldlen : 0;
+  size_t r, w = 0, i;
+
+  strbuf_unshare(sbuf);
+  if(shift) {
+    strbuf_ensure_capacity(sbuf, newlen);
+    memmove(sbuf->b + shift, sbuf->b, oldlen);
+    STRBUF_STAT_ADD(memmove_bytes, oldlen);
+  }
+
+  // Unprocessed input is sbuf->b[shift+r .. newlen-1]
+  char *src = sbuf->b + shift;
+  for(r = 0; (i = _find(src + r, oldlen - r, from, from_len)) != STRBUF_NPOS; ) {
+    memmove(sbuf->b + w, src + r, i);
+    w += i;
+    if(to_len) memcpy(sbuf->b + w, to, to_len);
+    w += to_len;
+    r += i + from_len;
+  }
+  memmove(sbuf->b + w, src + r, oldlen - r);
+
+  sbuf->end = newlen;
+  sbuf->b[newlen] = '\0';
+  return n;
+}
+
+/****************/
+/*  Statistics  */
+/****************/
+
+#if defined(STRBUF_STATS) && STRBUF_STATS
+  __thread StrBufStats strbuf_stats_tls;
+#endif
+
+void strbuf_stats_get(StrBufStats *stats)
+{
+#if defined(STRBUF_STATS) && STRBUF_STATS
+  *stats = strbuf_stats_tls;
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+void strbuf_stats_reset(void)
+{
+#if defined(STRBUF_STATS) && STRBUF_STATS
+  memset(&strbuf_stats_tls, 0, sizeof(strbuf_stats_tls));
+#endif
+}
+
+void strbuf_stats_print(FILE *fh)
+{
+  StrBufStats st;
+  strbuf_stats_get(&st);
+  fprintf(fh, "allocs: %zu\ngrows: %zu\nmemmove_bytes: %zu\n"
+              "sprintf_retries: %zu\nrefills: %zu\n",
+          st.allocs, st.grows, st.memmove_bytes, st.sprintf_retries,
+          st.refills);
+}
+
+/*********************/
+/*  Arena allocator  */
+/*********************/
+
+#define ARENA_DEFAULT_BLOCK (1UL<<16)
+#define ARENA_ALIGN 16
+#define arena_roundup(x) (((x)+ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1))
+
+struct BufArenaBlock
+{
+  struct BufArenaBlock *next, *prev; // prev only used for large blocks
+  size_t size, used;
+};
+
+// Keep the data that follows a block header aligned
+#define ARENA_HDR arena_roundup(sizeof(BufArenaBlock))
+#define arena_block_data(blk) ((char*)(blk) + ARENA_HDR)
+
+static BufArenaBlock* _arena_block_new(size_t size)
+{
+  BufArenaBlock *blk = malloc(ARENA_HDR + size);
+  if(!blk) return NULL;
+  blk->next = blk->prev = NULL;
+  blk->size = size;
+  blk->used = 0;
+  return blk;
+}
+
+// Requests larger than a quarter of a block get their own block.
+// Callers always pass the size they allocated with, so this is stable.
+static inline int _arena_is_large(const BufArena *arena, size_t size)
+{
+  return arena_roundup(size) > arena->block_size / 4;
+}
+
+// Is `ptr` the most recent allocation from the current block?
+static inline int _arena_is_last(const BufArena *arena, const void *ptr,
+                                 size_t size)
+{
+  const BufArenaBlock *blk = arena->curr;
+  return (const char*)ptr + arena_roundup(size) ==
+         arena_block_data(blk) + blk->used;
+}
+
+static void* _arena_alloc(void *ctx, size_t size)
+{
+  BufArena *arena = (BufArena*)ctx;
+  BufArenaBlock *blk;
+  size = arena_roundup(MAX(size, 1));
+
+  if(_arena_is_large(arena, size))
+  {
+    if((blk = _arena_block_new(size)) == NULL) return NULL;
+    blk->used = size;
+    blk->next = arena->large;
+    if(arena->large) arena->large->prev = blk;
+    arena->large = blk;
+    return arena_block_data(blk);
+  }
+
+  // Move on to the next block, reusing blocks from before the last reset
+  while(arena->curr->used + size > arena->curr->size)
+  {
+    if(arena->curr->next == NULL) {
+      if((blk = _arena_block_new(arena->block_size)) == NULL) return NULL;
+      arena->curr->next = blk;
+    }
+    arena->curr = arena->curr->next;
+    arena->curr->used = 0;
+  }
+
+  blk = arena->curr;
+  char *ptr = arena_block_data(blk) + blk->used;
+  blk->used += size;
+  return ptr;
+}
+
+static void _arena_dealloc(void *ctx, void *ptr, size_t size)
+{
+  BufArena *arena = (BufArena*)ctx;
+  if(ptr == NULL) return;
+
+  if(_arena_is_large(arena, size))
+  {
+    BufArenaBlock *blk = (BufArenaBlock*)((char*)ptr - ARENA_HDR);
+    if(blk->prev) blk->prev->next = blk->next;
+    else arena->large = blk->next;
+    if(blk->next) blk->next->prev = blk->prev;
+    free(blk);
+  }
+  else if(_arena_is_last(arena, ptr, size))
+    arena->curr->used -= arena_roundup(MAX(size, 1));
+}
+
+static void* _arena_resize(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+  BufArena *arena = (BufArena*)ctx;
+  BufArenaBlock *blk;
+  void *new_ptr;
+
+  if(ptr == NULL) return _arena_alloc(ctx, new_size);
+
+  if(_arena_is_large(arena, old_size) && _arena_is_large(arena, new_size))
+  {
+    // Large block: realloc and fix up the links
+    blk = (BufArenaBlock*)((char*)ptr - ARENA_HDR);
+    new_size = arena_roundup(new_size);
+    if((blk = realloc(blk, ARENA_HDR + new_size)) == NULL) return NULL;
+    blk->size = blk->used = new_size;
+    if(blk->prev) blk->prev->next = blk;
+    else arena->large = blk;
+    if(blk->next) blk->next->prev = blk;
+    return arena_block_data(blk);
+  }
+
+  if(!_arena_is_large(arena, old_size) && !_arena_is_large(arena, new_size) &&
+     _arena_is_last(arena, ptr, old_size))
+  {
+    // Most recent allocation: grow or shrink in place if it fits
+    blk = arena->curr;
+    size_t offset = (size_t)((char*)ptr - arena_block_data(blk));
+    if(offset + arena_roundup(MAX(new_size, 1)) <= blk->size) {
+      blk->used = offset + arena_roundup(MAX(new_size, 1));
+      return ptr;
+    }
+  }
+
+  if((new_ptr = _arena_alloc(ctx, new_size)) == NULL) return NULL;
+  memcpy(new_ptr, ptr, MIN(old_size, new_size));
+  _arena_dealloc(ctx, ptr, old_size);
+  return new_ptr;
+}
+
+BufArena* buf_arena_new(size_t block_size)
+{
+  BufArena *arena = malloc(sizeof(BufArena));
+  if(!arena) return NULL;
+  arena->block_size = arena_roundup(block_size ? block_size : ARENA_DEFAULT_BLOCK);
+  arena->large = NULL;
+  if((arena->first = arena->curr = _arena_block_new(arena->block_size)) == NULL) {
+    free(arena);
+    return NULL;
+  }
+  arena->alloc.alloc   = _arena_alloc;
+  arena->alloc.resize  = _arena_resize;
+  arena->alloc.dealloc = _arena_dealloc;
+  arena->alloc.ctx     = arena;
+  return arena;
+}
+
+static void _arena_free_blocks(BufArenaBlock *blk)
+{
+  BufArenaBlock *next;
+  for(; blk != NULL; blk = next) { next = blk->next; free(blk); }
+}
+
+void buf_arena_reset(BufArena *arena)
+{
+  _arena_free_blocks(arena->large);
+  arena->large = NULL;
+  arena->curr = arena->first;
+  arena->curr->used = 0;
+}
+
+void buf_arena_free(BufArena *arena)
+{
+  _arena_free_blocks(arena->large);
+  _arena_free_blocks(arena->first);
+  free(arena);
+}
+
+/*****************/
+/*  Buffer pool  */
+/*****************/
+
+#define POOL_NCLASSES 64
+#define POOL_THREAD_CACHE 8
+// Larger buffers skip the thread cache so the high water mark always sees them
+#define POOL_THREAD_CACHE_MAX (1UL<<16)
+
+// Buffers in class c have size >= 2^c
+#define pool_class_of_size(s) (63 - __builtin_clzll(s))
+
+typedef struct
+{
+  StrBuf **bufs;
+  size_t n, cap;
+} PoolBucket;
+
+typedef struct
+{
+  StrBufPool *pool;
+  StrBuf *bufs[POOL_THREAD_CACHE];
+  size_t n;
+} PoolThreadCache;
+
+struct StrBufPool
+{
+  pthread_mutex_t lock;
+  pthread_key_t key; // -> PoolThreadCache
+  PoolBucket buckets[POOL_NCLASSES];
+  size_t bytes, high_water;
+};
+
+// Smallest class whose buffers all have capacity for len chars (+ '\0')
+// i.e. ceil(log2(len+1))
+static inline size_t _pool_class_for_len(size_t len)
+{
+  return len == 0 ? 0 : (size_t)(64 - __builtin_clzll(len));
+}
+
+static inline size_t _pool_buf_bytes(const StrBuf *sbuf)
+{
+  return sizeof(StrBuf) + (strbuf_is_inline(sbuf) ? 0 : sbuf->size);
+}
+
+// Free largest buffers first until at most max_bytes remain - must hold lock
+static void _pool_trim_locked(StrBufPool *pool, size_t max_bytes)
+{
+  size_t c = POOL_NCLASSES;
+  while(pool->bytes > max_bytes && c > 0)
+  {
+    PoolBucket *bkt = &pool->buckets[c-1];
+    if(bkt->n == 0) { c--; continue; }
+    StrBuf *sbuf = bkt->bufs[--bkt->n];
+    pool->bytes -= _pool_buf_bytes(sbuf);
+    strbuf_free(sbuf);
+  }
+}
 
-  return num_chars;
+// Add a buffer to the shared buckets - must hold lock
+static void _pool_add_locked(StrBufPool *pool, StrBuf *sbuf)
+{
+  PoolBucket *bkt = &pool->buckets[pool_class_of_size(sbuf->size)];
+  if(bkt->n == bkt->cap) {
+    size_t newcap = bkt->cap ? bkt->cap*2 : 8;
+    StrBuf **bufs = realloc(bkt->bufs, newcap * sizeof(StrBuf*));
+    if(bufs == NULL) { strbuf_free(sbuf); return; }
+    bkt->bufs = bufs;
+    bkt->cap = newcap;
+  }
+  bkt->bufs[bkt->n++] = sbuf;
+  pool->bytes += _pool_buf_bytes(sbuf);
+  if(pool->high_water && pool->bytes > pool->high_water)
+    _pool_trim_locked(pool, pool->high_water);
 }
 
-int strbuf_sprintf_at(StrBuf *sbuf, size_t pos, const char *fmt, ...)
+static void _pool_flush_cache(PoolThreadCache *cache)
 {
-  _bounds_check_insert(sbuf, pos);
+  StrBufPool *pool = cache->pool;
+  pthread_mutex_lock(&pool->lock);
+  while(cache->n) _pool_add_locked(pool, cache->bufs[--cache->n]);
+  pthread_mutex_unlock(&pool->lock);
+}
 
-  va_list argptr;
-  va_start(argptr, fmt);
-  int num_chars = strbuf_vsprintf(sbuf, pos, fmt, argptr);
-  va_end(argptr);
+// Called when a thread exits
+static void _pool_cache_destroy(void *ptr)
+{
+  _pool_flush_cache((PoolThreadCache*)ptr);
+  free(ptr);
+}
 
-  return num_chars;
+StrBufPool* strbuf_pool_new(size_t high_water)
+{
+  StrBufPool *pool = calloc(1, sizeof(StrBufPool));
+  if(!pool) return NULL;
+  if(pthread_mutex_init(&pool->lock, NULL) != 0) { free(pool); return NULL; }
+  if(pthread_key_create(&pool->key, _pool_cache_destroy) != 0) {
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    return NULL;
+  }
+  pool->high_water = high_water;
+  return pool;
 }
 
-// Does not prematurely end the string if you sprintf within the string
-// (vs at the end)
-int strbuf_sprintf_noterm(StrBuf *sbuf, size_t pos, const char *fmt, ...)
+void strbuf_pool_free(StrBufPool *pool)
 {
-  _bounds_check_insert(sbuf, pos);
+  size_t c;
+  PoolThreadCache *cache = pthread_getspecific(pool->key);
+  if(cache) {
+    while(cache->n) strbuf_free(cache->bufs[--cache->n]);
+    free(cache);
+    pthread_setspecific(pool->key, NULL);
+  }
+  pthread_key_delete(pool->key);
+  for(c = 0; c < POOL_NCLASSES; c++) {
+    while(pool->buckets[c].n)
+      strbuf_free(pool->buckets[c].bufs[--pool->buckets[c].n]);
+    free(pool->buckets[c].bufs);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
 
-  char last_char;
-  size_t len = sbuf->end;
+StrBuf* strbuf_pool_get(StrBufPool *pool, size_t len)
+{
+  StrBuf *sbuf = NULL;
+  size_t i, best, c;
 
-  // Call vsnprintf with NULL, 0 to get resulting string length without writing
-  va_list argptr;
-  va_start(argptr, fmt);
-  int nchars = vsnprintf(NULL, 0, fmt, argptr);
-  va_end(argptr);
+  // Fast path: smallest big-enough buffer in this thread's cache
+  PoolThreadCache *cache = pthread_getspecific(pool->key);
+  if(cache && cache->n)
+  {
+    for(i = 0, best = cache->n; i < cache->n; i++) {
+      if(cache->bufs[i]->size > len &&
+         (best == cache->n || cache->bufs[i]->size < cache->bufs[best]->size))
+        best = i;
+    }
+    if(best < cache->n) {
+      sbuf = cache->bufs[best];
+      cache->bufs[best] = cache->bufs[--cache->n];
+      return sbuf;
+    }
+  }
 
-  if(nchars < 0) {
-    fprintf(stderr, "Warning: strbuf_sprintf something went wrong..\n");
-    exit_on_error();
+  pthread_mutex_lock(&pool->lock);
+  for(c = _pool_class_for_len(len); c < POOL_NCLASSES; c++) {
+    if(pool->buckets[c].n) {
+      sbuf = pool->buckets[c].bufs[--pool->buckets[c].n];
+      pool->bytes -= _pool_buf_bytes(sbuf);
+      break;
+    }
   }
+  pthread_mutex_unlock(&pool->lock);
 
-  // Save overwritten char
-  last_char = (pos+(size_t)nchars < sbuf->end) ? sbuf->b[pos+(size_t)nchars] : 0;
+  return sbuf ? sbuf : strbuf_new(len);
+}
 
-  va_start(argptr, fmt);
-  nchars = strbuf_vsprintf(sbuf, pos, fmt, argptr);
-  va_end(argptr);
+void strbuf_pool_put(StrBufPool *pool, StrBuf *sbuf)
+{
+  strbuf_reset(sbuf);
 
-  if(nchars < 0) {
-    fprintf(stderr, "Warning: strbuf_sprintf something went wrong..\n");
-    exit_on_error();
+  if(_pool_buf_bytes(sbuf) <= POOL_THREAD_CACHE_MAX)
+  {
+    PoolThreadCache *cache = pthread_getspecific(pool->key);
+    if(cache == NULL && (cache = malloc(sizeof(PoolThreadCache))) != NULL) {
+      cache->pool = pool;
+      cache->n = 0;
+      if(pthread_setspecific(pool->key, cache) != 0) {
+        free(cache);
+        cache = NULL;
+      }
+    }
+
+    if(cache && cache->n < POOL_THREAD_CACHE) {
+      cache->bufs[cache->n++] = sbuf;
+      return;
+    }
   }
 
-  // Restore length if shrunk, null terminate if extended
-  if(sbuf->end < len) sbuf->end = len;
-  else sbuf->b[sbuf->end] = '\0';
+  pthread_mutex_lock(&pool->lock);
+  _pool_add_locked(pool, sbuf);
+  pthread_mutex_unlock(&pool->lock);
+}
 
-  // Re-instate overwritten character
-  sbuf->b[pos+(size_t)nchars] = last_char;
+void strbuf_pool_flush_thread(StrBufPool *pool)
+{
+  PoolThreadCache *cache = pthread_getspecific(pool->key);
+  if(cache) _pool_flush_cache(cache);
+}
 
-  return nchars;
+void strbuf_pool_trim(StrBufPool *pool, size_t max_bytes)
+{
+  pthread_mutex_lock(&pool->lock);
+  _pool_trim_locked(pool, max_bytes);
+  pthread_mutex_unlock(&pool->lock);
 }
 
+size_t strbuf_pool_bytes(StrBufPool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  size_t bytes = pool->bytes;
+  pthread_mutex_unlock(&pool->lock);
+  return bytes;
+}
 
-/*****************/
-/* File handling */
-/*****************/
+/****************/
+/*  Gap buffer  */
+/****************/
 
-// Reading a FILE
-size_t strbuf_readline(StrBuf *sbuf, FILE *file)
+#define _gap_bounds_check(gb,start,len) \
+        _call_gap_bounds_check(gb,start,len,__FILE__,__LINE__,__func__)
+
+// start+len <= strgap_len(gb) is valid
+static inline
+void _call_gap_bounds_check(const StrGapBuf *gb, size_t start, size_t len,
+                            const char *file, int line, const char *func)
 {
-  return freadline(file, &(sbuf->b), &(sbuf->end), &(sbuf->size));
+  size_t end = strgap_len(gb);
+  if(start > end || len > end - start)
+  {
+    fprintf(stderr, "%s:%i:%s() - out of bounds error "
+                    "[start: %zu; length: %zu; strlen: %zu]\n",
+            file, line, func, start, len, end);
+    errno = EDOM;
+    exit_on_error();
+  }
 }
 
-size_t strbuf_gzreadline(StrBuf *sbuf, gzFile file)
+StrGapBuf* strgap_new(size_t len)
 {
-  return gzreadline(file, &sbuf->b, &sbuf->end, &sbuf->size);
+  StrGapBuf *gb = malloc(sizeof(StrGapBuf));
+  if(!gb) return NULL;
+  if(!strgap_alloc(gb, len)) { free(gb); return NULL; }
+  return gb;
 }
 
-// Reading a FILE
-size_t strbuf_readline_buf(StrBuf *sbuf, FILE *file, StreamBuffer *in)
+void strgap_free(StrGapBuf *gb)
 {
-  return (size_t)freadline_buf(file, in, &sbuf->b, &sbuf->end, &sbuf->size);
+  strgap_dealloc(gb);
+  free(gb);
 }
 
-size_t strbuf_gzreadline_buf(StrBuf *sbuf, gzFile file, StreamBuffer *in)
+StrGapBuf* strgap_alloc(StrGapBuf *gb, size_t len)
 {
-  return (size_t)gzreadline_buf(file, in, &sbuf->b, &sbuf->end, &sbuf->size);
+  gb->gap = gb->gap_len = 0;
+  return strbuf_alloc(&gb->buf, len) ? gb : NULL;
 }
 
-size_t strbuf_skipline(FILE* file)
+void strgap_dealloc(StrGapBuf *gb)
 {
-  return fskipline(file);
+  strbuf_dealloc(&gb->buf);
+  gb->gap = gb->gap_len = 0;
 }
 
-size_t strbuf_gzskipline(gzFile file)
+char strgap_get_char(const StrGapBuf *gb, size_t pos)
 {
-  return gzskipline(file);
+  _gap_bounds_check(gb, pos, 1);
+  return gb->buf.b[pos < gb->gap ? pos : pos + gb->gap_len];
 }
 
-size_t strbuf_skipline_buf(FILE* file, StreamBuffer *in)
+StrBuf* strgap_strbuf(StrGapBuf *gb)
 {
-  return (size_t)fskipline_buf(file, in);
+  StrBuf *sb = &gb->buf;
+  if(gb->gap_len) {
+    size_t tail = sb->end - gb->gap - gb->gap_len;
+    memmove(sb->b + gb->gap, sb->b + gb->gap + gb->gap_len, tail);
+    STRBUF_STAT_ADD(memmove_bytes, tail);
+    sb->end -= gb->gap_len;
+    sb->b[sb->end] = '\0';
+    gb->gap_len = 0;
+  }
+  return sb;
 }
 
-size_t strbuf_gzskipline_buf(gzFile file, StreamBuffer *in)
+void strgap_move(StrGapBuf *gb, size_t pos)
 {
-  return (size_t)gzskipline_buf(file, in);
+  _gap_bounds_check(gb, pos, 0);
+  strbuf_unshare(&gb->buf);
+  char *b = gb->buf.b;
+  // With no gap the buffer may have been edited via strgap_strbuf(),
+  // so gap is stale and there is nothing to move
+  if(gb->gap_len == 0) {}
+  else if(pos < gb->gap) {
+    memmove(b + pos + gb->gap_len, b + pos, gb->gap - pos);
+    STRBUF_STAT_ADD(memmove_bytes, gb->gap - pos);
+  }
+  else {
+    memmove(b + gb->gap, b + gb->gap + gb->gap_len, pos - gb->gap);
+    STRBUF_STAT_ADD(memmove_bytes, pos - gb->gap);
+  }
+  gb->gap = pos;
 }
 
-#define _func_read_nonempty(name,type_t,__readline)                            \
-  size_t name(StrBuf *line, type_t fh)                                         \
-  {                                                                            \
-    size_t i, origlen = line->end;                                             \
-    while(__readline(line, fh) > 0) {                                          \
-      i = origlen;                                                             \
-      while(i < line->end && (line->b[i] == '\r' || line->b[i] == '\n'))       \
-        i++;                                                                   \
-      if(i < line->end) return line->end - origlen;                            \
-      line->end = origlen;                                                     \
-      line->b[line->end] = '\0';                                               \
-    }                                                                          \
-    return 0;                                                                  \
+// Grow the gap to at least `need` bytes. The gap takes all spare capacity,
+// and at least 1/8th of the text so that a run of inserts grows it rarely
+static void _strgap_widen(StrGapBuf *gb, size_t need)
+{
+  StrBuf *sb = &gb->buf;
+  size_t len = sb->end - gb->gap_len;
+  size_t tail = sb->end - gb->gap - gb->gap_len;
+
+  strbuf_ensure_capacity(sb, len + need + MAX(64, len / 8));
+
+  size_t new_end = sb->size - 1;
+  memmove(sb->b + new_end - tail, sb->b + gb->gap + gb->gap_len, tail);
+  STRBUF_STAT_ADD(memmove_bytes, tail);
+  gb->gap_len = new_end - len;
+  sb->end = new_end;
+  sb->b[sb->end] = '\0';
+}
+
+// Replace dst_len chars at pos with src. src may point into the text of gb:
+// we record its position since moving or widening the gap shifts the text and
+// may realloc. The source is read as it was before the edit, like
+// strbuf_overwrite().
+static void _strgap_replace(StrGapBuf *gb, size_t pos, size_t dst_len,
+                            const char *src, size_t src_len)
+{
+  StrBuf *sb = &gb->buf;
+  char alias = src >= sb->b && src < sb->b + sb->size;
+  size_t s = 0, n;
+
+  if(alias) {
+    // Convert to a text position. With no gap, gap may be stale but off is
+    // already a text position. Pointers into the gap are taken as its start.
+    size_t off = (size_t)(src - sb->b);
+    s = off < gb->gap + gb->gap_len ? MIN(off, gb->gap) : off - gb->gap_len;
   }
 
-_func_read_nonempty(strbuf_readline_nonempty,FILE*,strbuf_readline)
-_func_read_nonempty(strbuf_gzreadline_nonempty,gzFile,strbuf_gzreadline)
+  strgap_move(gb, pos);
+  if(gb->gap_len < src_len) _strgap_widen(gb, src_len);
+
+  if(src_len) {
+    char *gap = sb->b + gb->gap;
+    if(!alias) memcpy(gap, src, src_len);
+    else {
+      // Source text before pos is where it was, text after pos is now after
+      // the gap. Neither overlaps the bytes of the gap we write to.
+      n = s < pos ? MIN(src_len, pos - s) : 0;
+      memcpy(gap, sb->b + s, n);
+      memcpy(gap + n, sb->b + s + n + gb->gap_len, src_len - n);
+    }
+  }
 
+  gb->gap += src_len;
+  gb->gap_len -= src_len;
+  gb->gap_len += dst_len; // drop the overwritten text now after the gap
+}
 
-#define _func_read(name,type_t,__read) \
-  size_t name(StrBuf *sbuf, type_t file, size_t len)                           \
-  {                                                                            \
-    if(len == 0) return 0;                                                     \
-    strbuf_ensure_capacity(sbuf, sbuf->end + len);                             \
-    long nread;                                                                \
-    if((nread = (long)__read(file,sbuf->b+sbuf->end,len)) <= 0) return 0;      \
-    sbuf->end += (size_t)nread;                                                \
-    return (size_t)nread;                                                      \
+void strgap_insert(StrGapBuf *gb, size_t pos, const char *src, size_t len)
+{
+  _gap_bounds_check(gb, pos, 0);
+  if(len == 0) return;
+  _strgap_replace(gb, pos, 0, src, len);
+}
+
+void strgap_delete(StrGapBuf *gb, size_t pos, size_t len)
+{
+  _gap_bounds_check(gb, pos, len);
+  if(len == 0) return;
+  strgap_move(gb, pos);
+  gb->gap_len += len;
+}
+
+void strgap_overwrite(StrGapBuf *gb, size_t pos, size_t dst_len,
+                      const char *src, size_t src_len)
+{
+  _gap_bounds_check(gb, pos, dst_len);
+  _strgap_replace(gb, pos, dst_len, src, src_len);
+}
+
+/******************/
+/*  String views  */
+/******************/
+
+StrView strview_substr(StrView v, size_t start, size_t len)
+{
+  if(start > v.len || len > v.len - start) {
+    fprintf(stderr, "%s:%i:%s() - out of bounds error "
+                    "[start: %zu; length: %zu; strlen: %zu]\n",
+            __FILE__, __LINE__, __func__, start, len, v.len);
+    errno = EDOM;
+    exit_on_error();
   }
+  return strview_strn(v.p + start, len);
+}
 
-_func_read(strbuf_gzread, gzFile, gzread2)
-_func_read(strbuf_fread, FILE*, fread2)
+StrView strview_trim(StrView v)
+{
+  if(v.len == 0) return v;
+  v.len -= _rspan_space(v.p, v.len);
+  size_t start = _span_space(v.p, v.len);
+  return strview_strn(v.p + start, v.len - start);
+}
 
-// read FILE
-// returns number of characters read
-// or 0 if EOF
-size_t strbuf_reset_readline(StrBuf *sbuf, FILE *file)
+StrView strview_trim_set(StrView v, const StrCharSet *set)
 {
-  strbuf_reset(sbuf);
-  return strbuf_readline(sbuf, file);
+  if(v.len == 0) return v;
+  v.len -= string_rspan_set(v.p, v.len, set);
+  size_t start = string_span_set(v.p, v.len, set);
+  return strview_strn(v.p + start, v.len - start);
 }
 
-// read gzFile
-// returns number of characters read
-// or 0 if EOF
-size_t strbuf_reset_gzreadline(StrBuf *sbuf, gzFile file)
+StrView strview_chomp(StrView v)
 {
-  strbuf_reset(sbuf);
-  return strbuf_gzreadline(sbuf, file);
+  while(v.len > 0 && (v.p[v.len-1] == '\r' || v.p[v.len-1] == '\n')) v.len--;
+  return v;
 }
 
-/**********/
-/*  trim  */
-/**********/
+size_t strview_find_char(StrView v, char c)
+{
+  const char *hit = v.len ? memchr(v.p, c, v.len) : NULL;
+  return hit ? (size_t)(hit - v.p) : STRVIEW_NPOS;
+}
 
-// Trim whitespace characters from the start and end of a string
-void strbuf_trim(StrBuf *sbuf)
+size_t strview_find(StrView v, StrView needle)
 {
-  if(sbuf->end == 0)
-    return;
+  return _find(v.p, v.len, needle.p, needle.len);
+}
 
-  // Trim end first
-  while(sbuf->end > 0 && isspace(sbuf->b[sbuf->end-1]))
-    sbuf->end--;
+char strview_split_next(StrView *rest, char sep, StrView *field)
+{
+  if(rest->p == NULL) return 0;
 
-  sbuf->b[sbuf->end] = '\0';
+  const char *hit = rest->len ? memchr(rest->p, sep, rest->len) : NULL;
+  if(hit) {
+    *field = strview_strn(rest->p, (size_t)(hit - rest->p));
+    rest->len -= field->len + 1;
+    rest->p = hit + 1;
+  } else {
+    // Last field - mark *rest as used up
+    *field = *rest;
+    *rest = strview_strn(NULL, 0);
+  }
+  return 1;
+}
 
-  if(sbuf->end == 0)
-    return;
+int strview_cmp(StrView a, StrView b)
+{
+  size_t n = MIN(a.len, b.len);
+  int cmp = n ? memcmp(a.p, b.p, n) : 0;
+  if(cmp) return cmp;
+  return a.len < b.len ? -1 : (a.len > b.len);
+}
 
-  size_t start = 0;
+void strbuf_set_view(StrBuf *sbuf, StrView v)
+{
+  // v may point into sbuf, which may move
+  strbuf_ensure_capacity_update_ptr(sbuf, v.len, &v.p);
+  if(v.len) memmove(sbuf->b, v.p, v.len);
+  sbuf->b[sbuf->end = v.len] = '\0';
+}
 
-  while(start < sbuf->end && isspace(sbuf->b[start]))
-    start++;
+/***************/
+/*  Tokenizer  */
+/***************/
 
-  if(start != 0)
-  {
-    sbuf->end -= start;
-    memmove(sbuf->b, sbuf->b+start, sbuf->end * sizeof(char));
-    sbuf->b[sbuf->end] = '\0';
-  }
+static inline void _strsplit_init(StrSplit *it, const char *str, size_t len,
+                                  int type)
+{
+  memset(it, 0, sizeof(StrSplit));
+  it->str = str;
+  it->len = len;
+  it->type = type;
 }
 
-// Trim the characters listed in `list` from the left of `sbuf`
-// `list` is a null-terminated string of characters
-void strbuf_ltrim(StrBuf *sbuf, const char *list)
+void strsplit_char(StrSplit *it, const char *str, size_t len, char sep)
 {
-  size_t start = 0;
+  _strsplit_init(it, str, len, STRSPLIT_CHAR);
+  it->sep = sep;
+}
 
-  while(start < sbuf->end && (strchr(list, sbuf->b[start]) != NULL))
-    start++;
+void strsplit_set(StrSplit *it, const char *str, size_t len,
+                  const StrCharSet *set)
+{
+  _strsplit_init(it, str, len, STRSPLIT_SET);
+  it->set = *set;
+}
 
-  if(start != 0)
-  {
-    sbuf->end -= start;
-    memmove(sbuf->b, sbuf->b+start, sbuf->end * sizeof(char));
-    sbuf->b[sbuf->end] = '\0';
-  }
+void strsplit_str(StrSplit *it, const char *str, size_t len,
+                  const char *delim, size_t delim_len)
+{
+  _strsplit_init(it, str, len, STRSPLIT_STR);
+  it->delim = delim;
+  it->delim_len = delim_len;
 }
 
-// Trim the characters listed in `list` from the right of `sbuf`
-// `list` is a null-terminated string of characters
-void strbuf_rtrim(StrBuf *sbuf, const char *list)
+char strsplit_next(StrSplit *it, StrView *field)
 {
-  if(sbuf->end == 0)
-    return;
+  if(it->pos > it->len) return 0;
+
+  const char *start = it->str + it->pos, *hit = NULL;
+  size_t rem = it->len - it->pos, n, seplen = 1;
+
+  switch(it->type) {
+    case STRSPLIT_CHAR:
+      hit = rem ? memchr(start, it->sep, rem) : NULL;
+      break;
+    case STRSPLIT_SET:
+      n = _cspan_set(start, rem, &it->set);
+      hit = n < rem ? start + n : NULL;
+      break;
+    default:
+      seplen = it->delim_len;
+      if(seplen > 0) {
+        n = strview_find(strview_strn(start, rem), strview_strn(it->delim, seplen));
+        hit = n != STRVIEW_NPOS ? start + n : NULL;
+      }
+  }
+
+  if(hit) {
+    *field = strview_strn(start, (size_t)(hit - start));
+    it->pos += field->len + seplen;
+  } else {
+    // Last field
+    *field = strview_strn(start, rem);
+    it->pos = it->len + 1;
+  }
+  return 1;
+}
 
-  while(sbuf->end > 0 && strchr(list, sbuf->b[sbuf->end-1]) != NULL)
-    sbuf->end--;
+size_t string_char_offsets(const char *str, size_t len, char c,
+                           size_t *offsets, size_t max)
+{
+  return simd->char_offsets(str, 0, len, c, offsets, max, 0);
+}
 
-  sbuf->b[sbuf->end] = '\0';
+size_t string_set_offsets(const char *str, size_t len, const StrCharSet *set,
+                          size_t *offsets, size_t max)
+{
+  return simd->set_offsets(str, 0, len, set, offsets, max, 0);
 }
 
 /**************************/
@@ -824,35 +4321,72 @@ size_t string_split_str(char *str, char sep, char **ptrs, size_t nptrs)
 // Replace one char with another in a string. Return number of replacements made
 size_t string_char_replace(char *str, char from, char to)
 {
-  size_t n = 0;
-  for(; *str; str++) {
-    if(*str == from) { n++; *str = to; }
-  }
-  return n;
+  return from ? _replace_char(str, strlen(str), from, to) : 0;
+}
+
+size_t string_count_charn(const char *str, size_t len, char c)
+{
+  return _count_char(str, len, c);
+}
+
+size_t string_count_set(const char *str, size_t len, const StrCharSet *set)
+{
+  return _count_set(str, len, set);
+}
+
+size_t string_replace_charn(char *str, size_t len, char from, char to)
+{
+  return _replace_char(str, len, from, to);
+}
+
+size_t string_replace_set(char *str, size_t len, const StrCharSet *set, char to)
+{
+  return _replace_set(str, len, set, to);
+}
+
+void string_hex_encode(char *dst, const void *src, size_t len, char upper)
+{
+  _hex_encode(dst, (const char*)src, len, upper);
+}
+
+size_t string_hex_decode(void *dst, const char *src, size_t len)
+{
+  return _hex_decode((char*)dst, src, len);
+}
+
+// Convert ASCII letters to upper / lower case. dst may equal src
+void string_ascii_toupper(char *dst, const char *src, size_t len)
+{
+  _ascii_case(dst, src, len, 'a', 'z');
+}
+
+void string_ascii_tolower(char *dst, const char *src, size_t len)
+{
+  _ascii_case(dst, src, len, 'A', 'Z');
 }
 
 // Reverse a string region
 void string_reverse_region(char *str, size_t length)
 {
-  char *a = str, *b = str + length - 1;
-  char tmp;
-  while(a < b) {
-    tmp = *a; *a = *b; *b = tmp;
-    a++; b--;
-  }
+  _reverse(str, str, length, 0);
+}
+
+// Reverse complement DNA. dst may equal src
+void string_revcomp(char *dst, const char *src, size_t len)
+{
+  _reverse(dst, src, len, 1);
 }
 
 char string_is_all_whitespace(const char *s)
 {
-  int i;
-  for(i = 0; s[i] != '\0' && isspace(s[i]); i++);
-  return (s[i] == '\0');
+  size_t len = strlen(s);
+  return (_span_space(s, len) == len);
 }
 
 char* string_next_nonwhitespace(char *s)
 {
-  while(*s != '\0' && isspace(*s)) s++;
-  return (*s == '\0' ? NULL : s);
+  size_t len = strlen(s), i = _span_space(s, len);
+  return (i == len ? NULL : s + i);
 }
 
 // Strip whitespace the the start and end of a string.  
@@ -860,15 +4394,10 @@ char* string_next_nonwhitespace(char *s)
 // first non-whitespace character
 char* string_trim(char *str)
 {
-  // Work backwards
-  char *end = str+strlen(str);
-  while(end > str && isspace(*(end-1))) end--;
-  *end = '\0';
-
-  // Work forwards: don't need start < len because will hit \0
-  while(isspace(*str)) str++;
-
-  return str;
+  size_t len = strlen(str);
+  len -= _rspan_space(str, len);
+  str[len] = '\0';
+  return str + _span_space(str, len);
 }
 
 // Removes \r and \n from the ends of a string and returns the new length
@@ -882,15 +4411,15 @@ size_t string_chomp(char *str, size_t len)
 // Returns count
 size_t string_count_char(const char *str, char c)
 {
-  size_t count = 0;
-
-  while((str = strchr(str, c)) != NULL)
-  {
-    str++;
-    count++;
-  }
+  return c ? _count_char(str, strlen(str), c) : 0;
+}
 
-  return count;
+// First occurrence of needle in str..end-1 or NULL
+static inline const char* _find_ptr(const char *str, const char *end,
+                                    const char *needle, size_t len)
+{
+  size_t i = _find(str, (size_t)(end - str), needle, len);
+  return i == STRBUF_NPOS ? NULL : str + i;
 }
 
 // Returns the number of strings resulting from the split
@@ -928,10 +4457,11 @@ size_t string_split(const char *split, const char *txt, char ***result)
     }
   }
   
-  const char *find = txt;
+  const char *find = txt, *txt_end = txt + txt_len;
   size_t count = 1; // must have at least one item
 
-  for(; (find = strstr(find, split)) != NULL; count++, find += split_len) {}
+  for(; (find = _find_ptr(find, txt_end, split, split_len)) != NULL;
+      count++, find += split_len) {}
 
   // Create return array
   arr = malloc(count * sizeof(char*));
@@ -941,7 +4471,7 @@ size_t string_split(const char *split, const char *txt, char ***result)
 
   size_t str_len;
 
-  while((find = strstr(last_position, split)) != NULL)
+  while((find = _find_ptr(last_position, txt_end, split, split_len)) != NULL)
   {
     str_len = (size_t)(find - last_position);
 
@@ -13,17 +13,53 @@
 #include <stdio.h> // needed for FILE
 #include <zlib.h> // needed for gzFile
 #include <stdarg.h> // needed for va_list
+#include <stdint.h> // needed for uint64_t
 
 #include "stream_buffer.h"
 
 
+// Strings that fit in STRBUF_SSO_SIZE bytes (including the \0) are stored
+// inside the StrBuf struct rather than in a separate heap block. They move to
+// the heap when they outgrow it. Override with -DSTRBUF_SSO_SIZE=n (n >= 1)
+// when building both the library and your code.
+#ifndef STRBUF_SSO_SIZE
+  #define STRBUF_SSO_SIZE 32
+#endif
+
+// Note: since b may point into the struct itself, a StrBuf must not be copied
+// by value (e.g. `StrBuf a = *b`) - use strbuf_clone() or strbuf_set_buff()
 typedef struct
 {
   char *b;
   size_t end; // end is index of \0
   size_t size; // size should be >= end+1 to allow for \0
+  const BufAllocator *alloc; // heap memory comes from here, NULL => malloc
+  size_t *refs; // number of StrBufs sharing b, if STRBUF_SHARED
+  unsigned char flags; // STRBUF_MMAP, STRBUF_SHRINK, STRBUF_SHARED
+  unsigned char growth; // STRBUF_GROW_* policy
+  unsigned char nsmall; // consecutive resets of a mostly empty buffer
+  char sso[STRBUF_SSO_SIZE]; // inline storage, used when b == sso
 } StrBuf;
 
+// b is an anonymous memory mapping (see strbuf_set_mmap_threshold())
+#define STRBUF_MMAP 1
+// shrink the buffer on reset if it stays mostly empty
+#define STRBUF_SHRINK 2
+// b is shared with clones (see strbuf_clone()) and must be copied before writing
+#define STRBUF_SHARED 4
+
+// Growth policies - how much capacity to allocate when a buffer grows
+#define STRBUF_GROW_DEFAULT 0 // use the process-wide policy
+#define STRBUF_GROW_POW2    1 // round up to a power of two (default)
+#define STRBUF_GROW_1_5X    2 // grow by at least half the current capacity
+#define STRBUF_GROW_PAGE    3 // round up to a multiple of the page size
+#define STRBUF_GROW_EXACT   4 // allocate exactly what is needed
+
+// Returns non-zero if the string is currently stored inside the struct
+#define strbuf_is_inline(sb) ((sb)->b == (sb)->sso)
+#define strbuf_is_mmap(sb) ((sb)->flags & STRBUF_MMAP)
+#define strbuf_is_shared(sb) ((sb)->flags & STRBUF_SHARED)
+
 
 //
 // Creation, reset, free and memory expansion
@@ -31,7 +67,7 @@ typedef struct
 
 // Constructors / Destructors
 StrBuf* strbuf_new(size_t len);
-static inline void strbuf_free(StrBuf *sb) { free(sb->b); free(sb); }
+void strbuf_free(StrBuf *sb);
 
 // Place a string buffer into existing memory. Example:
 //   StrBuf buf;
@@ -39,36 +75,92 @@ static inline void strbuf_free(StrBuf *sb) { free(sb->b); free(sb); }
 //   ...
 //   strbuf_dealloc(&buf);
 StrBuf* strbuf_alloc(StrBuf *sb, size_t len);
+void strbuf_dealloc(StrBuf *sb);
 
-static inline void strbuf_dealloc(StrBuf *sb) {
-  free(sb->b);
-  memset(sb, 0, sizeof(*sb));
-}
+// As above, but take memory from allocator `a` (NULL for malloc).
+// strbuf_new_with() also allocates the StrBuf struct itself from `a`.
+StrBuf* strbuf_new_with(size_t len, const BufAllocator *a);
+StrBuf* strbuf_alloc_with(StrBuf *sb, size_t len, const BufAllocator *a);
 
 // Copy a string or existing string buffer
+// strbuf_clone() uses the same allocator as `sb`. Strings too long to be
+// stored inline are not copied: the clone shares sb's memory (copy-on-write)
+// until either of them is changed. This modifies `sb`, marking it as shared and
+// taking a reference, so don't clone one buffer from several threads at once.
+// Clones themselves may be used and freed from different threads.
 StrBuf* strbuf_create(const char *str);
-StrBuf* strbuf_clone(const StrBuf *sb);
+StrBuf* strbuf_clone(StrBuf *sb);
+
+// Slow path of strbuf_unshare() - don't call directly
+void _strbuf_unshare(StrBuf *sb);
+
+// Make sure sb has its own copy of a string it shares with a clone - exits on
+// FAILURE. All strbuf_* functions that change the string do this; you only
+// need it before writing to sb->b directly (e.g. strbuf_char(sb,i) = 'x').
+static inline void strbuf_unshare(StrBuf *sb) {
+  if(sb->flags & STRBUF_SHARED) _strbuf_unshare(sb);
+}
+
+// Shrink-on-reset / shared reset for strbuf_reset() - don't call directly
+void _strbuf_reset_slow(StrBuf *sb);
 
 // Clear the content of an existing StrBuf (sets size to 0)
+// If shrink-on-reset is enabled, memory may also be released.
+// A shared buffer is detached from its clones rather than copied.
 static inline void strbuf_reset(StrBuf *sb) {
+  if(sb->flags & (STRBUF_SHRINK | STRBUF_SHARED)) _strbuf_reset_slow(sb);
   if(sb->b) { sb->b[sb->end = 0] = '\0'; }
 }
 
+// Returns &sb->b after moving the string into a block of its own from malloc,
+// for passing to code that calls realloc on the char array, e.g.
+//   freadline(f, strbuf_heap_ptr(sb), &sb->end, &sb->size);
+// Call it again before each such use: strbuf_* functions may move the string
+// back inline. Exits if sb uses an allocator (see strbuf_new_with()).
+char** strbuf_heap_ptr(StrBuf *sb);
+
 //
 // Resizing
 //
 
+// Slow path of strbuf_ensure_capacity() - don't call directly
+void _strbuf_grow(StrBuf *sb, size_t len);
+
 // Ensure capacity for len characters plus '\0' character - exits on FAILURE
+// Also makes sure the buffer is not shared, so it can be written to.
 static inline void strbuf_ensure_capacity(StrBuf *sb, size_t len) {
-  cbuf_capacity(&sb->b, &sb->size, len);
+  if(sb->size <= len || (sb->flags & STRBUF_SHARED)) _strbuf_grow(sb, len);
 }
 
 // Same as above, but update pointer if it pointed to resized array
 void strbuf_ensure_capacity_update_ptr(StrBuf *sbuf, size_t size, const char **ptr);
 
+// Set the growth policy (STRBUF_GROW_*) for one buffer, or the process-wide
+// policy used by buffers with STRBUF_GROW_DEFAULT. Process default is
+// STRBUF_GROW_POW2. strbuf_resize() rounds the requested size in the same way
+// but doesn't add any extra space.
+void strbuf_set_growth(StrBuf *sb, int policy);
+void strbuf_set_default_growth(int policy);
+
+// With shrink-on-reset, a buffer that is reset while mostly empty (less than a
+// quarter full) 8 times in a row has its capacity halved, down to 64KB. Stops
+// one giant line from pinning a reused line buffer at its peak size.
+// strbuf_set_default_shrink_on_reset() applies to buffers created afterwards.
+void strbuf_set_shrink_on_reset(StrBuf *sb, char enable);
+void strbuf_set_default_shrink_on_reset(char enable);
+
+// Buffers (using the default allocator) that need at least `threshold` bytes
+// are backed by an anonymous mmap and grown with mremap(), which avoids copying.
+// Above the threshold, capacity grows linearly in multiples of `step` bytes
+// (rounded up to a page) rather than doubling. Pass threshold = 0 to disable.
+// Default is a 64MB threshold and 16MB step. Only has an effect on Linux.
+// Set at startup - not thread safe.
+void strbuf_set_mmap_threshold(size_t threshold, size_t step);
+
 // Resize the buffer to have capacity to hold a string of length new_len
 // (+ a null terminating character).  Can also be used to downsize the buffer's
-// memory usage.  Returns 1 on success, 0 on failure.
+// memory usage (moves the string back inline if it fits).
+// Returns 1 on success, 0 on failure.
 char strbuf_resize(StrBuf *sb, size_t new_len);
 
 //
@@ -140,16 +232,77 @@ char strbuf_resize(StrBuf *sb, size_t new_len);
 void strbuf_append_int(StrBuf *buf, int value);
 void strbuf_append_long(StrBuf *buf, long value);
 void strbuf_append_ulong(StrBuf *buf, unsigned long value);
+void strbuf_append_int64(StrBuf *buf, int64_t value);
+void strbuf_append_uint64(StrBuf *buf, uint64_t value);
+void strbuf_append_size_t(StrBuf *buf, size_t value);
+
+// Right align integers in at least `width` characters, padded with `pad`
+// (usually '0' or ' '). With '0' the sign goes before the zeros: -0042
+void strbuf_append_int64_pad(StrBuf *buf, int64_t value,
+                             size_t width, char pad);
+void strbuf_append_uint64_pad(StrBuf *buf, uint64_t value,
+                              size_t width, char pad);
+
+// Thousands separated integers e.g. 1,234,567 with sep=','
+void strbuf_append_int64_sep(StrBuf *buf, int64_t value, char sep);
+void strbuf_append_uint64_sep(StrBuf *buf, uint64_t value, char sep);
+
+// Append n integers separated by `sep` (e.g. '\t'), growing the buffer once
+void strbuf_append_ulong_array(StrBuf *buf, const unsigned long *vals,
+                               size_t n, char sep);
+void strbuf_append_uint64_array(StrBuf *buf, const uint64_t *vals,
+                                size_t n, char sep);
+
+// Integers in hex, binary or any base from 2 to 36, with at least `width`
+// digits (zero padded, 0 for no padding), e.g. like printf "%.16lx" for
+// strbuf_append_hex(buf, x, 16, 0). Letters are uppercase if `upper`.
+void strbuf_append_hex(StrBuf *buf, uint64_t value, size_t width, char upper);
+void strbuf_append_binary(StrBuf *buf, uint64_t value, size_t width);
+void strbuf_append_base(StrBuf *buf, uint64_t value, unsigned base,
+                        size_t width, char upper);
+
+// Append len bytes of data as 2*len hex digits. data may point into buf.
+void strbuf_append_hex_encode(StrBuf *buf, const void *data, size_t len,
+                              char upper);
+// Append the bytes of a string of hex digits (either case). Stops at the first
+// pair of chars that are not both hex digits. Returns the number of chars of
+// hex decoded, which is len on success.
+size_t strbuf_append_hex_decode(StrBuf *buf, const char *hex, size_t len);
+
+// Parse a number at the start of str[0..len), which need not be null
+// terminated. Nothing is skipped first. Returns the number of chars consumed,
+// or 0 (leaving *val unset) if there is no number or it does not fit.
+// Integers: [+-]digits (no '-' for u64). Doubles: [+-]digits[.digits][e[+-]
+// digits], inf, infinity or nan (any case), correctly rounded. All ignore the
+// locale. e.g. strbuf_parse_i64(sb->b+pos, sb->end-pos, &x)
+size_t strbuf_parse_u64(const char *str, size_t len, uint64_t *val);
+size_t strbuf_parse_i64(const char *str, size_t len, int64_t *val);
+size_t strbuf_parse_double(const char *str, size_t len, double *val);
+
+// Convert floating point numbers to string to append, in the C locale
+// Shortest digits that read back (strtod/strtof) as the same value e.g. 0.1,
+// 1e+100, using scientific notation as %g does, and inf, -inf, nan
+void strbuf_append_double(StrBuf *buf, double value);
+void strbuf_append_float(StrBuf *buf, float value);
+// Same output as printf "%.*f" and "%.*e" in the C locale
+void strbuf_append_double_fixed(StrBuf *buf, double value, size_t prec);
+void strbuf_append_double_sci(StrBuf *buf, double value, size_t prec);
 
 // Append a given string in lower or uppercase
 void strbuf_append_strn_lc(StrBuf *buf, const char *str, size_t len);
 void strbuf_append_strn_uc(StrBuf *buf, const char *str, size_t len);
 
+// As above, but only change ASCII letters A-Z/a-z, ignoring the locale.
+// Much faster on long strings. str may point into buf.
+void strbuf_append_strn_lc_ascii(StrBuf *buf, const char *str, size_t len);
+void strbuf_append_strn_uc_ascii(StrBuf *buf, const char *str, size_t len);
+
 // Append char `c` `n` times
 void strbuf_append_charn(StrBuf *buf, char c, size_t n);
 
 #define strbuf_shrink(__sb,__len) do {                    \
-  StrBuf *_sb = (__sb); _sb->b[_sb->end = (__len)] = 0;   \
+  StrBuf *_sb = (__sb); strbuf_unshare(_sb);              \
+  _sb->b[_sb->end = (__len)] = 0;                         \
 } while(0)
 
 #define strbuf_dup_str(sb) strdup((sb)->b)
@@ -161,6 +314,13 @@ size_t strbuf_chomp(StrBuf *sb);
 // Reverse a string
 void strbuf_reverse(StrBuf *sb);
 
+// Reverse complement a DNA sequence: A<->T, C<->G, case preserving, all other
+// characters (e.g. N) are left as they are
+void strbuf_revcomp(StrBuf *sb);
+
+// Append the reverse complement of len chars of src. src may point into buf.
+void strbuf_append_revcomp(StrBuf *buf, const char *src, size_t len);
+
 // Get a substring as a new null terminated char array
 // (remember to free the returned char* after you're done with it!)
 char* strbuf_substr(const StrBuf *sb, size_t start, size_t len);
@@ -169,6 +329,10 @@ char* strbuf_substr(const StrBuf *sb, size_t start, size_t len);
 void strbuf_to_uppercase(StrBuf *sb);
 void strbuf_to_lowercase(StrBuf *sb);
 
+// Change the case of ASCII letters only, ignoring the locale - much faster
+void strbuf_to_uppercase_ascii(StrBuf *sb);
+void strbuf_to_lowercase_ascii(StrBuf *sb);
+
 // Copy a string to this StrBuf, overwriting any existing characters
 // Note: dst_pos + len can be longer the the current dst StrBuf
 void strbuf_copy(StrBuf *dst, size_t dst_pos,
@@ -243,11 +407,69 @@ size_t strbuf_gzread(StrBuf *sb, gzFile gz_file, size_t len);
 size_t strbuf_readline_nonempty(StrBuf *line, FILE *fh);
 size_t strbuf_gzreadline_nonempty(StrBuf *line, gzFile gz);
 
+//
+// Vectorised kernels
+//
+
+// Case conversion, reverse, trim, count/replace etc. use SSE2 or AVX2 kernels
+// picked at load time from the CPU, with a portable fallback. Set the
+// environment variable STRBUF_SIMD to "scalar", "sse2" or "avx2" to force a
+// set of kernels (e.g. STRBUF_SIMD=scalar).
+
+// Name of the kernels in use: "scalar", "sse2" or "avx2"
+const char* strbuf_simd_name(void);
+
+// Switch kernels. Returns 0 on success, -1 if unknown or the CPU can't run
+// them. Not thread safe: call before other threads use the library.
+int strbuf_simd_select(const char *name);
+
+//
+// Character sets
+//
+
+// A set of byte values as a 256-bit bitmap, for trimming, counting, splitting
+// etc. on a list of characters without a strchr() per byte. Example:
+//   StrCharSet set;
+//   strcharset_init(&set, ",;|");
+//   strbuf_trim_set(sb, &set);
+typedef struct
+{
+  uint64_t bits[4];
+} StrCharSet;
+
+// Set to the characters in the null terminated string `list`
+void strcharset_init(StrCharSet *set, const char *list);
+
+static inline void strcharset_add(StrCharSet *set, char c) {
+  unsigned char u = (unsigned char)c;
+  set->bits[u >> 6] |= 1ULL << (u & 63);
+}
+
+static inline int strcharset_has(const StrCharSet *set, char c) {
+  unsigned char u = (unsigned char)c;
+  return (set->bits[u >> 6] >> (u & 63)) & 1;
+}
+
+// Whitespace as in the C locale: space, \t, \n, \v, \f and \r
+extern const StrCharSet strcharset_space;
+
+// Number of bytes at the start / end of str[0..len-1] that are in the set
+size_t string_span_set(const char *str, size_t len, const StrCharSet *set);
+size_t string_rspan_set(const char *str, size_t len, const StrCharSet *set);
+
+// Number of whitespace bytes at the start / end of str[0..len-1]
+size_t string_span_space(const char *str, size_t len);
+size_t string_rspan_space(const char *str, size_t len);
+
+// Number of bytes at the start of str[0..len-1] that are not in the set
+size_t string_cspan_set(const char *str, size_t len, const StrCharSet *set);
+
 //
 // String functions
 //
 
 // Trim whitespace characters from the start and end of a string
+// Whitespace is space, \t, \n, \v, \f and \r
 void strbuf_trim(StrBuf *sb);
 
 // Trim the characters listed in `list` from the left of `sb`
@@ -258,6 +480,372 @@ void strbuf_ltrim(StrBuf *sb, const char *list);
 // `list` is a null-terminated string of characters
 void strbuf_rtrim(StrBuf *sb, const char *list);
 
+// Trim characters in `set` from both ends
+void strbuf_trim_set(StrBuf *sb, const StrCharSet *set);
+
+// Trim without moving the string: remove trailing whitespace (or characters in
+// `set`) and return the number of leading ones, so the trimmed string
+// starts at sb->b + offset.
+size_t strbuf_trim_offset(StrBuf *sb);
+size_t strbuf_trim_set_offset(StrBuf *sb, const StrCharSet *set);
+
+// Count occurrences of a character / of any character in `set`
+size_t strbuf_count_char(const StrBuf *sb, char c);
+size_t strbuf_count_set(const StrBuf *sb, const StrCharSet *set);
+
+// Replace every `from` / every character in `set` with `to`
+// Returns the number of characters replaced
+size_t strbuf_replace_char(StrBuf *sb, char from, char to);
+size_t strbuf_replace_set(StrBuf *sb, const StrCharSet *set, char to);
+
+//
+// Searching
+//
+
+// Returned by the find functions when there is no match
+#define STRBUF_NPOS ((size_t)-1)
+
+// Offset of the first / last occurrence of needle[0..len-1] in str[0..hlen-1]
+// or STRBUF_NPOS. An empty needle matches at 0 / hlen.
+size_t string_find(const char *str, size_t hlen, const char *needle, size_t len);
+size_t string_rfind(const char *str, size_t hlen, const char *needle, size_t len);
+
+// First occurrence starting at or after pos (pos <= sb->end)
+size_t strbuf_find(const StrBuf *sb, size_t pos, const char *needle, size_t len);
+
+// Last occurrence starting at or before pos. Use STRBUF_NPOS as pos to search
+// the whole string
+size_t strbuf_rfind(const StrBuf *sb, size_t pos, const char *needle, size_t len);
+
+#define strbuf_find_str(sb,pos,str) strbuf_find(sb, pos, str, strlen(str))
+#define strbuf_rfind_str(sb,pos,str) strbuf_rfind(sb, pos, str, strlen(str))
+
+// Offsets of non-overlapping occurrences, found left to right. Stores the
+// first `max` in `offsets` and returns the total number. An empty needle
+// (len == 0) has no matches.
+size_t strbuf_find_all(const StrBuf *sb, const char *needle, size_t len,
+                       size_t *offsets, size_t max);
+
+// Replace all non-overlapping occurrences of `from` with `to`, resizing at
+// most once. Returns the number of replacements. Does nothing if from_len is
+// 0. `from` and `to` must not point into sb.
+size_t strbuf_replace_all(StrBuf *sb, const char *from, size_t from_len,
+                          const char *to, size_t to_len);
+
+//
+// Statistics
+//
+
+// Counters for the calling thread. All zero unless the library and your code
+// are built with -DSTRBUF_STATS=1 (`make STATS=1`)
+void strbuf_stats_get(StrBufStats *stats);
+void strbuf_stats_reset(void);
+void strbuf_stats_print(FILE *fh);
+
+//
+// Arena allocator
+//
+
+// Bump-pointer allocator: memory is handed out from large blocks and is all
+// released at once with buf_arena_reset() or buf_arena_free(). Freeing or
+// growing the most recent allocation is done in place, otherwise free is a
+// no-op. Not thread safe. Example:
+//   BufArena *arena = buf_arena_new(0);
+//   const BufAllocator *a = buf_arena_allocator(arena);
+//   while(...) {
+//     StrBuf *id = strbuf_new_with(0, a), *seq = strbuf_new_with(100, a);
+//     ...
+//     buf_arena_reset(arena); // drops id and seq without strbuf_free()
+//   }
+//   buf_arena_free(arena);
+
+typedef struct BufArenaBlock BufArenaBlock;
+
+typedef struct
+{
+  BufAllocator alloc; // alloc.ctx points to this arena
+  BufArenaBlock *first, *curr; // standard sized blocks, reused after reset
+  BufArenaBlock *large; // blocks for requests too big to share a block
+  size_t block_size;
+} BufArena;
+
+// block_size is the size of each block of memory, 0 for default (64KB)
+// Returns NULL if out of memory
+BufArena* buf_arena_new(size_t block_size);
+void buf_arena_free(BufArena *arena);
+
+// Release all memory handed out by the arena, keeping blocks for reuse
+void buf_arena_reset(BufArena *arena);
+
+#define buf_arena_allocator(arena) ((const BufAllocator*)&(arena)->alloc)
+
+//
+// Buffer pool
+//
+
+// Recycles StrBufs so that steady-state get/put cycles don't allocate.
+// Released buffers are kept in buckets by capacity (powers of two) and handed
+// back out empty but already grown. Each thread also keeps a few released
+// buffers of up to 64KB to itself, so most get/put calls don't take the pool
+// lock. These don't count towards high_water.
+// Only put buffers that came from strbuf_new() or strbuf_pool_get().
+// Example:
+//   StrBufPool *pool = strbuf_pool_new(64<<20); // cache at most 64MB
+//   StrBuf *field = strbuf_pool_get(pool, 100);
+//   ...
+//   strbuf_pool_put(pool, field);
+//   strbuf_pool_free(pool);
+typedef struct StrBufPool StrBufPool;
+
+// high_water is the max number of bytes of idle buffers to keep in the pool's
+// buckets (0 for no limit). Larger buffers are freed first when trimming.
+// Returns NULL if out of memory
+StrBufPool* strbuf_pool_new(size_t high_water);
+
+// Frees all buffers held by the pool and the calling thread's cache.
+// Other threads should call strbuf_pool_flush_thread() or exit first, or the
+// buffers in their caches are leaked.
+void strbuf_pool_free(StrBufPool *pool);
+
+// Get an empty buffer with capacity for at least len chars (+ '\0')
+// Returns NULL if out of memory
+StrBuf* strbuf_pool_get(StrBufPool *pool, size_t len);
+
+// Give a buffer back to the pool
+void strbuf_pool_put(StrBufPool *pool, StrBuf *sb);
+
+// Move buffers from this thread's cache back into the shared buckets
+void strbuf_pool_flush_thread(StrBufPool *pool);
+
+// Free idle buffers (largest first) until no more than max_bytes are held
+void strbuf_pool_trim(StrBufPool *pool, size_t max_bytes);
+
+// Number of bytes held in idle buffers in the shared buckets
+size_t strbuf_pool_bytes(StrBufPool *pool);
+
+//
+// Gap buffer
+//
+
+// A StrBuf that keeps its free space as a gap at the last edit position, so
+// repeated inserts/deletes near a moving cursor cost O(edit + distance moved)
+// instead of O(length of the tail). strgap_strbuf() closes the gap and returns
+// the underlying StrBuf, which can then be read or changed with any strbuf_*
+// function; the next strgap_* edit opens the gap again. Like StrBuf, a
+// StrGapBuf must not be copied by value. Example:
+//   StrGapBuf gb;
+//   strgap_alloc(&gb, 100);
+//   strbuf_set(strgap_strbuf(&gb), "aaaccc");
+//   strgap_insert(&gb, 3, "bb", 2);
+//   strgap_delete(&gb, 0, 1);
+//   printf("%s\n", strgap_strbuf(&gb)->b); // prints aabbccc
+//   strgap_dealloc(&gb);
+
+typedef struct
+{
+  StrBuf buf; // text is buf.b[0..gap) followed by buf.b[gap+gap_len..buf.end)
+  size_t gap, gap_len;
+} StrGapBuf;
+
+StrGapBuf* strgap_new(size_t len);
+void strgap_free(StrGapBuf *gb);
+StrGapBuf* strgap_alloc(StrGapBuf *gb, size_t len);
+void strgap_dealloc(StrGapBuf *gb);
+
+// Length of the text, not counting the gap
+#define strgap_len(gb) ((gb)->buf.end - (gb)->gap_len)
+
+char strgap_get_char(const StrGapBuf *gb, size_t pos);
+
+// Close the gap and return the contiguous, null terminated buffer
+StrBuf* strgap_strbuf(StrGapBuf *gb);
+
+// Move the gap (edit cursor) to pos. Edits do this themselves; call it to
+// position the cursor ahead of a run of edits.
+void strgap_move(StrGapBuf *gb, size_t pos);
+
+// Same semantics and bounds checks as strbuf_insert/overwrite/delete. src may
+// point into gb's text (e.g. strgap_strbuf(gb)->b) but not into the gap.
+void strgap_insert(StrGapBuf *gb, size_t pos, const char *src, size_t len);
+void strgap_overwrite(StrGapBuf *gb, size_t pos, size_t dst_len,
+                      const char *src, size_t src_len);
+void strgap_delete(StrGapBuf *gb, size_t pos, size_t len);
+
+//
+// String views
+//
+
+// A non-owning view of len bytes at p - not null terminated. Views are passed
+// and returned by value and none of the strview_* functions allocate.
+// A view of a StrBuf is invalidated when the StrBuf is changed. Example:
+//   StrView line = strview_buf(sb), field;
+//   while(strview_split_next(&line, '\t', &field)) {
+//     field = strview_trim(field);
+//     if(strview_eq(field, strview_str("chr1"))) ...
+//   }
+typedef struct
+{
+  const char *p;
+  size_t len;
+} StrView;
+
+// Returned by strview_find*() when there is no match
+#define STRVIEW_NPOS STRBUF_NPOS
+
+static inline StrView strview_strn(const char *str, size_t len) {
+  StrView v = {str, len};
+  return v;
+}
+
+#define strview_str(str) strview_strn((str), strlen(str))
+#define strview_buf(sb) strview_strn((sb)->b, (sb)->end)
+
+// Bytes start..(start+len-1) of v - exits on bounds error
+StrView strview_substr(StrView v, size_t start, size_t len);
+
+// Drop whitespace from both ends / \r and \n from the end
+StrView strview_trim(StrView v);
+StrView strview_chomp(StrView v);
+
+// Drop characters in `set` from both ends
+StrView strview_trim_set(StrView v, const StrCharSet *set);
+
+// Index of the first occurrence of c / needle in v, or STRVIEW_NPOS
+size_t strview_find_char(StrView v, char c);
+size_t strview_find(StrView v, StrView needle);
+
+// Take the next `sep` separated field from the front of *rest.
+// Returns 1 and sets *field, or 0 once all fields have been taken.
+// "a,,b" gives "a", "" and "b"; an empty string gives a single empty field.
+char strview_split_next(StrView *rest, char sep, StrView *field);
+
+// Compare like strcmp (a shorter prefix sorts first)
+int strview_cmp(StrView a, StrView b);
+#define strview_eq(a,b) (strview_cmp(a,b) == 0)
+
+// Copy a view into a StrBuf. v may point into sb.
+void strbuf_set_view(StrBuf *sb, StrView v);
+
+#define strbuf_append_view(__sb,__v) do {        \
+  StrView _v = (__v);                            \
+  strbuf_append_strn(__sb, _v.p, _v.len);        \
+} while(0)
+
+//
+// Tokenizer
+//
+
+// Iterate over the fields of a string separated by a char, by any char in a
+// set or by a multi-byte separator. Nothing is allocated and the string is not
+// modified. Fields are returned as views into the string; adjacent separators
+// give empty fields and n separators always give n+1 fields. Example:
+//   StrSplit it;
+//   StrView field;
+//   strsplit_char(&it, sb->b, sb->end, '\t');
+//   while(strsplit_next(&it, &field)) {
+//     size_t offset = strsplit_offset(&it, field);
+//     ...
+//   }
+typedef struct
+{
+  const char *str;
+  size_t len, pos; // pos is the start of the next field, > len when done
+  int type;
+  char sep;
+  const char *delim; // multi-byte separator
+  size_t delim_len;
+  StrCharSet set;
+} StrSplit;
+
+#define STRSPLIT_CHAR 0
+#define STRSPLIT_SET  1
+#define STRSPLIT_STR  2
+
+void strsplit_char(StrSplit *it, const char *str, size_t len, char sep);
+void strsplit_set(StrSplit *it, const char *str, size_t len,
+                  const StrCharSet *set);
+// `delim` must stay valid while iterating. An empty delim never matches.
+void strsplit_str(StrSplit *it, const char *str, size_t len,
+                  const char *delim, size_t delim_len);
+
+#define strsplit_buf_char(it,sb,sep) strsplit_char(it, (sb)->b, (sb)->end, sep)
+
+// Returns 1 and sets *field to the next field, or 0 when there are no more
+char strsplit_next(StrSplit *it, StrView *field);
+
+// Offset of a field from the start of the string
+#define strsplit_offset(it,field) ((size_t)((field).p - (it)->str))
+
+// Find every occurrence of a char / any char in a set in one pass.
+// Stores the offsets of the first `max` in `offsets` and returns the total
+// number found. With separators, field i is then
+// offsets[i-1]+1 .. offsets[i]-1 (taking offsets[-1] = -1, offsets[n] = len)
+size_t string_char_offsets(const char *str, size_t len, char c,
+                           size_t *offsets, size_t max);
+size_t string_set_offsets(const char *str, size_t len, const StrCharSet *set,
+                          size_t *offsets, size_t max);
+
+//
+// Gather append
+//
+
+// Append a list of segments (strings, chars and integers) with one capacity
+// check and at most one resize, instead of one per strbuf_append_*() call.
+// Example:
+//   strbuf_append_all(sb, strbuf_seg_str(chrom), strbuf_seg_char('\t'),
+//                         strbuf_seg_long(pos), strbuf_seg_char('\n'));
+// or build a StrBufSeg array and pass it to strbuf_append_segs().
+
+#define STRBUF_SEG_STR   0
+#define STRBUF_SEG_CHAR  1
+#define STRBUF_SEG_LONG  2
+#define STRBUF_SEG_ULONG 3
+
+typedef struct
+{
+  int type; // STRBUF_SEG_*
+  union {
+    StrView str;
+    char c;
+    long l;
+    unsigned long ul;
+  } v;
+} StrBufSeg;
+
+static inline StrBufSeg strbuf_seg_strn(const char *str, size_t len) {
+  StrBufSeg seg; seg.type = STRBUF_SEG_STR; seg.v.str = strview_strn(str, len);
+  return seg;
+}
+static inline StrBufSeg strbuf_seg_str(const char *str) {
+  return strbuf_seg_strn(str, strlen(str));
+}
+static inline StrBufSeg strbuf_seg_view(StrView v) {
+  return strbuf_seg_strn(v.p, v.len);
+}
+static inline StrBufSeg strbuf_seg_buf(const StrBuf *sb) {
+  return strbuf_seg_strn(sb->b, sb->end);
+}
+static inline StrBufSeg strbuf_seg_char(char c) {
+  StrBufSeg seg; seg.type = STRBUF_SEG_CHAR; seg.v.c = c;
+  return seg;
+}
+static inline StrBufSeg strbuf_seg_long(long l) {
+  StrBufSeg seg; seg.type = STRBUF_SEG_LONG; seg.v.l = l;
+  return seg;
+}
+static inline StrBufSeg strbuf_seg_ulong(unsigned long ul) {
+  StrBufSeg seg; seg.type = STRBUF_SEG_ULONG; seg.v.ul = ul;
+  return seg;
+}
+
+// Strings may point into sb
+void strbuf_append_segs(StrBuf *sb, const StrBufSeg *segs, size_t n);
+
+#define strbuf_append_all(__sb,...) do {                                  \
+  const StrBufSeg _segs[] = {__VA_ARGS__};                                \
+  strbuf_append_segs(__sb, _segs, sizeof(_segs) / sizeof(_segs[0]));      \
+} while(0)
+
 /**************************/
 /* Other String functions */
 /**************************/
@@ -276,7 +864,27 @@ size_t string_split_str(char *str, char sep, char **ptrs, size_t nptrs);
 // Replace one char with another in a string. Return number of replacements made
 size_t string_char_replace(char *str, char from, char to);
 
+// Count / replace in the first len bytes of str, which may contain '\0'.
+// Replace functions return the number of replacements made.
+size_t string_count_charn(const char *str, size_t len, char c);
+size_t string_count_set(const char *str, size_t len, const StrCharSet *set);
+size_t string_replace_charn(char *str, size_t len, char from, char to);
+size_t string_replace_set(char *str, size_t len, const StrCharSet *set, char to);
+
+// Hex encode len bytes of src to 2*len chars at dst (no '\0' added)
+void string_hex_encode(char *dst, const void *src, size_t len, char upper);
+// Decode the hex digits in len chars of src to dst, stopping at the first pair
+// that is not two hex digits. Returns the number of bytes written.
+size_t string_hex_decode(void *dst, const char *src, size_t len);
+
+// Change the case of ASCII letters in len bytes of src, writing to dst.
+// dst may equal src. Ignores the locale.
+void string_ascii_toupper(char *dst, const char *src, size_t len);
+void string_ascii_tolower(char *dst, const char *src, size_t len);
+
 void string_reverse_region(char *str, size_t length);
+// Reverse complement DNA (see strbuf_revcomp()). dst may equal src.
+void string_revcomp(char *dst, const char *src, size_t len);
 char string_is_all_whitespace(const char *s);
 char* string_next_nonwhitespace(char *s);
 char* string_trim(char *str);
@@ -0,0 +1,194 @@
+/*
+ string_intern.c
+ project: string_buffer
+ url: https://github.com/noporpoise/StringBuffer
+ author: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "string_intern.h"
+
+// Open addressing with linear probing. Slots hold the ID (+1, 0 is empty) and
+// 32 bits of the hash so most probes don't touch the strings themselves.
+// Table is kept at most half full.
+typedef struct
+{
+  uint32_t id1, hash;
+} InternSlot;
+
+typedef struct
+{
+  const char *str;
+  size_t len;
+  uint64_t hash;
+} InternEntry;
+
+struct StrIntern
+{
+  InternSlot *slots;
+  size_t nslots; // power of two
+  InternEntry *entries; // indexed by ID
+  size_t nentries, entries_cap;
+  BufArena *arena; // string storage
+};
+
+#define INTERN_MIN_SLOTS 64
+
+static void _intern_oom(const char *file, int line)
+{
+  fprintf(stderr, "[%s:%i] Out of memory\n", file, line);
+  exit(EXIT_FAILURE);
+}
+
+static inline uint64_t _intern_mix(uint64_t h)
+{
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Reads 8 bytes at a time, finalised with the murmur3 64 bit mixer
+uint64_t strintern_hash(const char *str, size_t len)
+{
+  const uint64_t m = 0x9e3779b97f4a7c15ULL;
+  uint64_t h = len * m, w;
+  for(; len >= 8; str += 8, len -= 8) {
+    memcpy(&w, str, 8);
+    h = (h ^ _intern_mix(w)) * m;
+  }
+  w = 0;
+  if(len) memcpy(&w, str, len);
+  h = (h ^ _intern_mix(w)) * m;
+  return _intern_mix(h);
+}
+
+StrIntern* strintern_new(size_t capacity)
+{
+  StrIntern *tbl = malloc(sizeof(StrIntern));
+  if(!tbl) return NULL;
+
+  tbl->nslots = INTERN_MIN_SLOTS;
+  while(tbl->nslots < 2 * capacity) tbl->nslots <<= 1;
+  tbl->entries_cap = tbl->nslots / 2;
+  tbl->nentries = 0;
+
+  tbl->slots = calloc(tbl->nslots, sizeof(InternSlot));
+  tbl->entries = malloc(tbl->entries_cap * sizeof(InternEntry));
+  tbl->arena = buf_arena_new(0);
+
+  if(!tbl->slots || !tbl->entries || !tbl->arena) {
+    free(tbl->slots);
+    free(tbl->entries);
+    if(tbl->arena) buf_arena_free(tbl->arena);
+    free(tbl);
+    return NULL;
+  }
+  return tbl;
+}
+
+void strintern_free(StrIntern *tbl)
+{
+  free(tbl->slots);
+  free(tbl->entries);
+  buf_arena_free(tbl->arena);
+  free(tbl);
+}
+
+size_t strintern_size(const StrIntern *tbl)
+{
+  return tbl->nentries;
+}
+
+// Returns the slot holding the string, or the empty slot where it would go
+static inline InternSlot* _intern_lookup(const StrIntern *tbl, uint64_t hash,
+                                         const char *str, size_t len)
+{
+  size_t mask = tbl->nslots - 1, i = (size_t)hash & mask;
+  uint32_t h32 = (uint32_t)(hash >> 32);
+  InternSlot *slot;
+
+  for(;; i = (i + 1) & mask) {
+    slot = &tbl->slots[i];
+    if(slot->id1 == 0) return slot;
+    if(slot->hash == h32) {
+      const InternEntry *e = &tbl->entries[slot->id1 - 1];
+      if(e->len == len && (len == 0 || memcmp(e->str, str, len) == 0)) return slot;
+    }
+  }
+}
+
+static void _intern_grow(StrIntern *tbl)
+{
+  size_t i, j, nslots = tbl->nslots * 2, mask = nslots - 1;
+  InternSlot *slots = calloc(nslots, sizeof(InternSlot));
+  if(!slots) _intern_oom(__FILE__, __LINE__);
+
+  // All strings are distinct, so only need to find an empty slot
+  for(i = 0; i < tbl->nentries; i++) {
+    uint64_t hash = tbl->entries[i].hash;
+    for(j = (size_t)hash & mask; slots[j].id1; j = (j + 1) & mask) {}
+    slots[j].id1 = (uint32_t)(i + 1);
+    slots[j].hash = (uint32_t)(hash >> 32);
+  }
+
+  free(tbl->slots);
+  tbl->slots = slots;
+  tbl->nslots = nslots;
+}
+
+size_t strintern_id(StrIntern *tbl, const char *str, size_t len)
+{
+  uint64_t hash = strintern_hash(str, len);
+  InternSlot *slot = _intern_lookup(tbl, hash, str, len);
+  if(slot->id1) return slot->id1 - 1;
+
+  // New string
+  if(tbl->nentries + 1 >= UINT32_MAX) {
+    fprintf(stderr, "[%s:%i] Too many interned strings\n", __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+
+  if(tbl->nentries == tbl->entries_cap) {
+    size_t cap = tbl->entries_cap * 2;
+    InternEntry *entries = realloc(tbl->entries, cap * sizeof(InternEntry));
+    if(!entries) _intern_oom(__FILE__, __LINE__);
+    tbl->entries = entries;
+    tbl->entries_cap = cap;
+  }
+
+  char *cpy = bufalloc_malloc(buf_arena_allocator(tbl->arena), len+1);
+  if(!cpy) _intern_oom(__FILE__, __LINE__);
+  if(len) memcpy(cpy, str, len);
+  cpy[len] = '\0';
+
+  size_t id = tbl->nentries++;
+  tbl->entries[id].str = cpy;
+  tbl->entries[id].len = len;
+  tbl->entries[id].hash = hash;
+  slot->id1 = (uint32_t)(id + 1);
+  slot->hash = (uint32_t)(hash >> 32);
+
+  if(2 * tbl->nentries > tbl->nslots) _intern_grow(tbl);
+
+  return id;
+}
+
+size_t strintern_find(const StrIntern *tbl, const char *str, size_t len)
+{
+  const InternSlot *slot = _intern_lookup(tbl, strintern_hash(str, len), str, len);
+  return slot->id1 ? slot->id1 - 1 : STRINTERN_NONE;
+}
+
+const char* strintern_get(const StrIntern *tbl, size_t id)
+{
+  return tbl->entries[id].str;
+}
+
+size_t strintern_len(const StrIntern *tbl, size_t id)
+{
+  return tbl->entries[id].len;
+}
@@ -0,0 +1,59 @@
+/*
+ string_intern.h
+ project: string_buffer
+ url: https://github.com/noporpoise/StringBuffer
+ author: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain
+*/
+
+#ifndef STRING_INTERN_FILE_SEEN
+#define STRING_INTERN_FILE_SEEN
+
+#include <stdint.h>
+#include "string_buffer.h"
+
+// An intern table keeps one copy of each distinct string and maps it to a
+// stable pointer and a dense ID (0, 1, 2, ... in order of first insertion).
+// Interned strings with the same content have the same pointer, so equality is
+// a pointer compare. Strings are stored in an arena and stay valid until the
+// table is freed. Not thread safe. Example:
+//   StrIntern *names = strintern_new(0);
+//   const char *chr = strintern_buf(names, sb);
+//   if(chr == strintern_str(names, "chr1")) ...
+//   strintern_free(names);
+
+typedef struct StrIntern StrIntern;
+
+// Returned by strintern_find() if the string has not been interned
+#define STRINTERN_NONE ((size_t)-1)
+
+// capacity is the expected number of distinct strings (0 for a default)
+// Returns NULL if out of memory
+StrIntern* strintern_new(size_t capacity);
+void strintern_free(StrIntern *tbl);
+
+// Number of distinct strings held
+size_t strintern_size(const StrIntern *tbl);
+
+// Add a string if not already present. Returns its ID. Exits if out of memory.
+// str may contain '\0' bytes.
+size_t strintern_id(StrIntern *tbl, const char *str, size_t len);
+
+// ID of a string, or STRINTERN_NONE if it has not been interned
+size_t strintern_find(const StrIntern *tbl, const char *str, size_t len);
+
+// The interned, null terminated copy of a string and its length
+const char* strintern_get(const StrIntern *tbl, size_t id);
+size_t strintern_len(const StrIntern *tbl, size_t id);
+
+// Intern and return the stable pointer
+#define strintern_strn(tbl,str,len) \
+        strintern_get(tbl, strintern_id(tbl, str, len))
+#define strintern_str(tbl,str) strintern_strn(tbl, str, strlen(str))
+#define strintern_buf(tbl,sb) strintern_strn(tbl, (sb)->b, (sb)->end)
+#define strintern_view(tbl,v) strintern_strn(tbl, (v).p, (v).len)
+
+// 64 bit non-cryptographic hash used by the table
+uint64_t strintern_hash(const char *str, size_t len);
+
+#endif /* STRING_INTERN_FILE_SEEN */
@@ -0,0 +1,360 @@
+/*
+ string_rope.c
+ project: string_buffer
+ url: https://github.com/noporpoise/StringBuffer
+ author: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "string_rope.h"
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+#define exit_on_error() do { abort(); exit(EXIT_FAILURE); } while(0)
+
+// Rope is an implicit treap: nodes are ordered by position, each node holds a
+// chunk of up to STRROPE_CHUNK chars and the length of its subtree. Priorities
+// are random so the expected depth is O(log n).
+// 472 chars makes a node 512 bytes on 64 bit
+#ifndef STRROPE_CHUNK
+  #define STRROPE_CHUNK 472
+#endif
+
+struct RopeNode
+{
+  struct RopeNode *left, *right;
+  unsigned int prio;
+  size_t len, total; // length of this chunk, length of subtree
+  char text[STRROPE_CHUNK];
+};
+
+/*********************/
+/*  Bounds checking  */
+/*********************/
+
+#define _rope_bounds_check(rope,start,len) \
+        _call_rope_bounds_check(rope,start,len,__FILE__,__LINE__,__func__)
+
+// start+len <= strrope_len(rope) is valid
+static inline
+void _call_rope_bounds_check(const StrRope *rope, size_t start, size_t len,
+                             const char *file, int line, const char *func)
+{
+  size_t end = strrope_len(rope);
+  if(start > end || len > end - start)
+  {
+    fprintf(stderr, "%s:%i:%s() - out of bounds error "
+                    "[start: %zu; length: %zu; strlen: %zu]\n",
+            file, line, func, start, len, end);
+    errno = EDOM;
+    exit_on_error();
+  }
+}
+
+/*****************/
+/*  Tree basics  */
+/*****************/
+
+static inline size_t _total(const RopeNode *n) { return n ? n->total : 0; }
+
+static inline void _update(RopeNode *n)
+{
+  n->total = _total(n->left) + n->len + _total(n->right);
+}
+
+// xorshift
+static inline unsigned int _rope_rand(StrRope *rope)
+{
+  unsigned int x = rope->seed;
+  x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+  return (rope->seed = x);
+}
+
+static RopeNode* _node_new(unsigned int prio, const char *src, size_t len)
+{
+  RopeNode *n = malloc(sizeof(RopeNode));
+  if(n == NULL) {
+    fprintf(stderr, "[%s:%i] Out of memory\n", __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+  n->left = n->right = NULL;
+  n->prio = prio;
+  n->len = n->total = len;
+  memcpy(n->text, src, len);
+  return n;
+}
+
+static void _tree_free(RopeNode *n)
+{
+  while(n) {
+    RopeNode *right = n->right;
+    _tree_free(n->left);
+    free(n);
+    n = right;
+  }
+}
+
+// All of a comes before b
+static RopeNode* _merge(RopeNode *a, RopeNode *b)
+{
+  if(a == NULL) return b;
+  if(b == NULL) return a;
+  if(a->prio >= b->prio) { a->right = _merge(a->right, b); _update(a); return a; }
+  else                   { b->left  = _merge(a, b->left);  _update(b); return b; }
+}
+
+// Split so that *l holds the first pos chars and *r the rest
+static void _split(RopeNode *n, size_t pos, RopeNode **l, RopeNode **r)
+{
+  if(n == NULL) { *l = *r = NULL; return; }
+
+  size_t lt = _total(n->left);
+
+  if(pos <= lt) {
+    _split(n->left, pos, l, &n->left);
+    _update(n);
+    *r = n;
+  }
+  else if(pos >= lt + n->len) {
+    _split(n->right, pos - lt - n->len, &n->right, r);
+    _update(n);
+    *l = n;
+  }
+  else {
+    // Split the chunk itself. The new node takes the same priority so the
+    // heap order with the right subtree still holds
+    size_t off = pos - lt;
+    RopeNode *m = _node_new(n->prio, n->text + off, n->len - off);
+    m->right = n->right;
+    n->right = NULL;
+    n->len = off;
+    _update(n);
+    _update(m);
+    *l = n;
+    *r = m;
+  }
+}
+
+// Build a tree from a string, one node per STRROPE_CHUNK chars
+static RopeNode* _build(StrRope *rope, const char *src, size_t len)
+{
+  RopeNode *tree = NULL;
+  size_t n;
+  for(; len > 0; src += n, len -= n) {
+    n = MIN(len, STRROPE_CHUNK);
+    tree = _merge(tree, _node_new(_rope_rand(rope), src, n));
+  }
+  return tree;
+}
+
+/*********************/
+/*  In-place edits   */
+/*********************/
+
+// Insert into a single chunk if there is room, avoiding split/merge
+// Returns 1 on success, 0 if the tree was not changed
+static int _insert_inplace(RopeNode *n, size_t pos, const char *src, size_t len)
+{
+  if(n == NULL) return 0;
+
+  size_t lt = _total(n->left);
+  int ok;
+
+  if(pos < lt) ok = _insert_inplace(n->left, pos, src, len);
+  else if(pos > lt + n->len) ok = _insert_inplace(n->right, pos-lt-n->len, src, len);
+  else if(n->len + len <= STRROPE_CHUNK) {
+    size_t off = pos - lt;
+    memmove(n->text + off + len, n->text + off, n->len - off);
+    memcpy(n->text + off, src, len);
+    n->len += len;
+    ok = 1;
+  }
+  else ok = 0;
+
+  if(ok) n->total += len;
+  return ok;
+}
+
+// Delete from within a single chunk, leaving it non-empty
+// Returns 1 on success, 0 if the tree was not changed
+static int _delete_inplace(RopeNode *n, size_t pos, size_t len)
+{
+  if(n == NULL) return 0;
+
+  size_t lt = _total(n->left);
+  int ok;
+
+  if(pos < lt) ok = (pos + len <= lt && _delete_inplace(n->left, pos, len));
+  else if(pos >= lt + n->len) ok = _delete_inplace(n->right, pos-lt-n->len, len);
+  else if(pos + len - lt < n->len) {
+    size_t off = pos - lt;
+    memmove(n->text + off, n->text + off + len, n->len - off - len);
+    n->len -= len;
+    ok = 1;
+  }
+  else ok = 0;
+
+  if(ok) n->total -= len;
+  return ok;
+}
+
+// Overwrite existing chars without changing the length
+static void _rope_write(RopeNode *n, size_t pos, const char *src, size_t len)
+{
+  while(n && len) {
+    size_t lt = _total(n->left), m;
+    if(pos < lt) {
+      m = MIN(len, lt - pos);
+      _rope_write(n->left, pos, src, m);
+      pos += m; src += m; len -= m;
+    }
+    if(len && pos < lt + n->len) {
+      m = MIN(len, lt + n->len - pos);
+      memcpy(n->text + pos - lt, src, m);
+      pos += m; src += m; len -= m;
+    }
+    pos -= lt + n->len;
+    n = n->right;
+  }
+}
+
+static void _rope_read(const RopeNode *n, size_t pos, size_t len, char *dst)
+{
+  while(n && len) {
+    size_t lt = _total(n->left), m;
+    if(pos < lt) {
+      m = MIN(len, lt - pos);
+      _rope_read(n->left, pos, m, dst);
+      pos += m; dst += m; len -= m;
+    }
+    if(len && pos < lt + n->len) {
+      m = MIN(len, lt + n->len - pos);
+      memcpy(dst, n->text + pos - lt, m);
+      pos += m; dst += m; len -= m;
+    }
+    pos -= lt + n->len;
+    n = n->right;
+  }
+}
+
+/******************************/
+/*  Constructors/Destructors  */
+/******************************/
+
+StrRope* strrope_new(void)
+{
+  StrRope *rope = malloc(sizeof(StrRope));
+  if(rope == NULL) return NULL;
+  rope->root = NULL;
+  rope->seed = 2463534242U;
+  return rope;
+}
+
+StrRope* strrope_create(const char *str, size_t len)
+{
+  StrRope *rope = strrope_new();
+  if(rope == NULL) return NULL;
+  strrope_append(rope, str, len);
+  return rope;
+}
+
+void strrope_free(StrRope *rope)
+{
+  _tree_free(rope->root);
+  free(rope);
+}
+
+void strrope_reset(StrRope *rope)
+{
+  _tree_free(rope->root);
+  rope->root = NULL;
+}
+
+/*************/
+/*  Reading  */
+/*************/
+
+size_t strrope_len(const StrRope *rope)
+{
+  return _total(rope->root);
+}
+
+char strrope_char(const StrRope *rope, size_t idx)
+{
+  _rope_bounds_check(rope, idx, 1);
+  const RopeNode *n = rope->root;
+  while(1) {
+    size_t lt = _total(n->left);
+    if(idx < lt) n = n->left;
+    else if(idx < lt + n->len) return n->text[idx - lt];
+    else { idx -= lt + n->len; n = n->right; }
+  }
+}
+
+void strrope_read(const StrRope *rope, size_t pos, size_t len, char *dst)
+{
+  _rope_bounds_check(rope, pos, len);
+  _rope_read(rope->root, pos, len, dst);
+}
+
+void strrope_to_strbuf(const StrRope *rope, StrBuf *sb)
+{
+  size_t len = strrope_len(rope);
+  strbuf_ensure_capacity(sb, len);
+  _rope_read(rope->root, 0, len, sb->b);
+  sb->end = len;
+  sb->b[len] = '\0';
+}
+
+/***********/
+/*  Edits  */
+/***********/
+
+void strrope_append(StrRope *rope, const char *src, size_t len)
+{
+  strrope_insert(rope, strrope_len(rope), src, len);
+}
+
+void strrope_copy(StrRope *rope, size_t pos, const char *src, size_t len)
+{
+  _rope_bounds_check(rope, pos, 0);
+  size_t n = MIN(len, strrope_len(rope) - pos);
+  _rope_write(rope->root, pos, src, n);
+  if(len > n) strrope_append(rope, src + n, len - n);
+}
+
+void strrope_insert(StrRope *rope, size_t pos, const char *src, size_t len)
+{
+  _rope_bounds_check(rope, pos, 0);
+  if(len == 0 || _insert_inplace(rope->root, pos, src, len)) return;
+
+  RopeNode *l, *r;
+  _split(rope->root, pos, &l, &r);
+  rope->root = _merge(_merge(l, _build(rope, src, len)), r);
+}
+
+void strrope_overwrite(StrRope *rope, size_t pos, size_t dst_len,
+                       const char *src, size_t src_len)
+{
+  _rope_bounds_check(rope, pos, dst_len);
+  size_t n = MIN(dst_len, src_len);
+  _rope_write(rope->root, pos, src, n);
+  if(dst_len > n) strrope_delete(rope, pos + n, dst_len - n);
+  else if(src_len > n) strrope_insert(rope, pos + n, src + n, src_len - n);
+}
+
+void strrope_delete(StrRope *rope, size_t pos, size_t len)
+{
+  _rope_bounds_check(rope, pos, len);
+  if(len == 0 || _delete_inplace(rope->root, pos, len)) return;
+
+  RopeNode *l, *m, *r;
+  _split(rope->root, pos, &l, &r);
+  _split(r, len, &m, &r);
+  _tree_free(m);
+  rope->root = _merge(l, r);
+}
@@ -0,0 +1,74 @@
+/*
+ string_rope.h
+ project: string_buffer
+ url: https://github.com/noporpoise/StringBuffer
+ author: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain
+*/
+
+#ifndef STRING_ROPE_FILE_SEEN
+#define STRING_ROPE_FILE_SEEN
+
+#include "string_buffer.h"
+
+// A rope is an editable string stored as a balanced tree of small chunks.
+// Insert, delete and overwrite take O(log n + len) rather than moving the tail
+// of the string as strbuf_insert() etc. do, so lots of edits to a long string
+// stay cheap. Use strrope_to_strbuf() when you need a contiguous char*.
+// Example:
+//   StrRope *rope = strrope_new();
+//   strrope_append(rope, sb->b, sb->end);
+//   strrope_insert(rope, 100, "xyz", 3);
+//   strrope_delete(rope, 10, 5);
+//   strrope_to_strbuf(rope, sb);
+//   strrope_free(rope);
+
+typedef struct RopeNode RopeNode;
+
+typedef struct
+{
+  RopeNode *root;
+  unsigned int seed; // for node priorities
+} StrRope;
+
+// Returns NULL if out of memory
+StrRope* strrope_new(void);
+StrRope* strrope_create(const char *str, size_t len);
+void strrope_free(StrRope *rope);
+
+// Remove all content
+void strrope_reset(StrRope *rope);
+
+size_t strrope_len(const StrRope *rope);
+
+// Get the character at index idx (idx < strrope_len(rope))
+char strrope_char(const StrRope *rope, size_t idx);
+
+// Copy len chars from pos into dst (does not add '\0')
+void strrope_read(const StrRope *rope, size_t pos, size_t len, char *dst);
+
+// Set a StrBuf to contain the content of the rope
+void strrope_to_strbuf(const StrRope *rope, StrBuf *sb);
+
+//
+// Edits - same semantics as strbuf_copy/insert/overwrite/delete
+// src must not point into the rope. Exit on out of memory or bounds error.
+//
+
+void strrope_append(StrRope *rope, const char *src, size_t len);
+
+// Copy a string to the rope, overwriting any existing characters
+// Note: pos + len can be longer than the current rope
+void strrope_copy(StrRope *rope, size_t pos, const char *src, size_t len);
+
+// Insert: copy into the rope, shifting existing characters along
+void strrope_insert(StrRope *rope, size_t pos, const char *src, size_t len);
+
+// Overwrite pos..(pos+dst_len-1) with src_len chars from src
+void strrope_overwrite(StrRope *rope, size_t pos, size_t dst_len,
+                       const char *src, size_t src_len);
+
+// Remove len characters starting at pos
+void strrope_delete(StrRope *rope, size_t pos, size_t len);
+
+#endif /* STRING_ROPE_FILE_SEEN */